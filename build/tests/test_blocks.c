@@ -0,0 +1,143 @@
+#include "src/tests/test_blocks.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCEEDS 0
+#define FAILS 1
+
+Tester __testers[] = {test_constants, 
+test_basic_allocation, 
+test_allocation_deallocation, 
+test_deallocating_deallocated, 
+test_not_deallocating, 
+test_big_allocation_deallocation, 
+test_writing_to_block, 
+test_writing_junk_into_blockinfo1, 
+test_writing_junk_into_blockinfo2, 
+test_writing_junk_into_blockinfo3, 
+test_threaded_block_caches, 
+test_double_free_to_cache, 
+test_megagroup_fragmentation, 
+test_megagroup_best_fit, 
+test_megablock_retention, 
+test_free_block_stats, 
+test_megablock_reservation, 
+test_split_group, 
+test_huge_page_reservation,  NULL};
+char *__testersq[] = {"test_constants", 
+"test_basic_allocation", 
+"test_allocation_deallocation", 
+"test_deallocating_deallocated", 
+"test_not_deallocating", 
+"test_big_allocation_deallocation", 
+"test_writing_to_block", 
+"test_writing_junk_into_blockinfo1", 
+"test_writing_junk_into_blockinfo2", 
+"test_writing_junk_into_blockinfo3", 
+"test_threaded_block_caches", 
+"test_double_free_to_cache", 
+"test_megagroup_fragmentation", 
+"test_megagroup_best_fit", 
+"test_megablock_retention", 
+"test_free_block_stats", 
+"test_megablock_reservation", 
+"test_split_group", 
+"test_huge_page_reservation",  NULL};
+int __expectations[] = {SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+FAILS, 
+FAILS, 
+SUCCEEDS, 
+SUCCEEDS, 
+FAILS, 
+FAILS, 
+FAILS, 
+SUCCEEDS, 
+FAILS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS,  0};
+char *__expectoutstrings[] = {"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"",  NULL};
+
+char *__expectstring[] = {"succeeds", "fails"};
+
+void __list_testers(FILE *out, int fancy) {
+  char** tester;
+  int* expectation;
+  for (tester = __testersq, expectation = __expectations; *tester != NULL; tester++, expectation++) {
+    if (fancy) {
+      fprintf(out, " %s (%s)\n", *tester, __expectstring[*expectation]);
+    } else {
+      fprintf(out, "%s %s\n", __expectstring[*expectation], *tester);
+    }
+  }
+}
+
+int __from_name(char *name) {
+  for (int i = 0; __testers[i] != NULL; i++) {
+    if (strcmp(__testersq[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+PRINT_USAGE:
+    fprintf(stderr, "Usage: %s [--out] tester\n", argv[0]);
+    fprintf(stderr, "       %s --list\n", argv[0]);
+    fprintf(stderr, "Available testers:\n");
+    __list_testers(stderr, 1);
+    exit(1);
+  }
+  if (strcmp(argv[1], "--list") == 0) {
+    __list_testers(stdout, 0);
+    exit(0);
+  }
+  if (strcmp(argv[1], "--out") == 0) {
+    if (argc < 3) {
+      goto PRINT_USAGE;
+    }
+    int i = __from_name(argv[2]);
+    if (i == -1) {
+      fprintf(stderr, "Unknown tester '%s'.\n", argv[2]);
+      goto PRINT_USAGE;
+    }
+    printf(__expectoutstrings[i]);
+    exit(0);
+  }
+
+  int i = __from_name(argv[1]);
+  if (i == -1) {
+    fprintf(stderr, "Unknown tester '%s'.\n", argv[1]);
+    goto PRINT_USAGE;
+  }
+  __testers[i]();
+  return 0;
+}
@@ -0,0 +1,163 @@
+#include "src/tests/test_gc.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SUCCEEDS 0
+#define FAILS 1
+
+Tester __testers[] = {test_alloc_obj, 
+test_alloc_a_lot, 
+test_gc_preserves_list, 
+test_gc_reclaims_garbage, 
+test_gc_arrays, 
+test_write_barrier, 
+test_wide_objects, 
+test_mark_region, 
+test_mark_region_compaction, 
+test_size_class_reuse, 
+test_large_objects, 
+test_pinned_objects, 
+test_thread_alloc_obj, 
+test_concurrent_mutators, 
+test_numa_nursery, 
+test_claim_too_many_nurseries, 
+test_incremental_slices, 
+test_realtime_nursery, 
+test_concurrent_marking, 
+test_gc_stats, 
+test_survival_rate, 
+test_adaptive_sizing, 
+test_gc_trace, 
+test_parallel_gc,  NULL};
+char *__testersq[] = {"test_alloc_obj", 
+"test_alloc_a_lot", 
+"test_gc_preserves_list", 
+"test_gc_reclaims_garbage", 
+"test_gc_arrays", 
+"test_write_barrier", 
+"test_wide_objects", 
+"test_mark_region", 
+"test_mark_region_compaction", 
+"test_size_class_reuse", 
+"test_large_objects", 
+"test_pinned_objects", 
+"test_thread_alloc_obj", 
+"test_concurrent_mutators", 
+"test_numa_nursery", 
+"test_claim_too_many_nurseries", 
+"test_incremental_slices", 
+"test_realtime_nursery", 
+"test_concurrent_marking", 
+"test_gc_stats", 
+"test_survival_rate", 
+"test_adaptive_sizing", 
+"test_gc_trace", 
+"test_parallel_gc",  NULL};
+int __expectations[] = {SUCCEEDS, 
+FAILS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+FAILS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS, 
+SUCCEEDS,  0};
+char *__expectoutstrings[] = {"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"", 
+"",  NULL};
+
+char *__expectstring[] = {"succeeds", "fails"};
+
+void __list_testers(FILE *out, int fancy) {
+  char** tester;
+  int* expectation;
+  for (tester = __testersq, expectation = __expectations; *tester != NULL; tester++, expectation++) {
+    if (fancy) {
+      fprintf(out, " %s (%s)\n", *tester, __expectstring[*expectation]);
+    } else {
+      fprintf(out, "%s %s\n", __expectstring[*expectation], *tester);
+    }
+  }
+}
+
+int __from_name(char *name) {
+  for (int i = 0; __testers[i] != NULL; i++) {
+    if (strcmp(__testersq[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+PRINT_USAGE:
+    fprintf(stderr, "Usage: %s [--out] tester\n", argv[0]);
+    fprintf(stderr, "       %s --list\n", argv[0]);
+    fprintf(stderr, "Available testers:\n");
+    __list_testers(stderr, 1);
+    exit(1);
+  }
+  if (strcmp(argv[1], "--list") == 0) {
+    __list_testers(stdout, 0);
+    exit(0);
+  }
+  if (strcmp(argv[1], "--out") == 0) {
+    if (argc < 3) {
+      goto PRINT_USAGE;
+    }
+    int i = __from_name(argv[2]);
+    if (i == -1) {
+      fprintf(stderr, "Unknown tester '%s'.\n", argv[2]);
+      goto PRINT_USAGE;
+    }
+    printf(__expectoutstrings[i]);
+    exit(0);
+  }
+
+  int i = __from_name(argv[1]);
+  if (i == -1) {
+    fprintf(stderr, "Unknown tester '%s'.\n", argv[1]);
+    goto PRINT_USAGE;
+  }
+  __testers[i]();
+  return 0;
+}
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <complex.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdarg.h>
@@ -9,6 +12,8 @@
 #include <jack/midiport.h>
 #include <fftw3.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 //#include <stropts.h>
 #include <poll.h>
 #include "util.h"
@@ -169,6 +174,20 @@ HashMap hashmap_new() {
   }
 }
 
+////// Vectors
+
+// Vectors of floats for the inner loops of the windows.  GCC lowers
+// them to SSE, or to AVX with -mavx.
+
+#define FLOAT_LANES 8
+
+typedef float float_vec __attribute__((vector_size(FLOAT_LANES * sizeof(float))));
+
+// The vector of floats starting at p, which needn't be aligned
+typedef float float_uvec __attribute__((vector_size(FLOAT_LANES * sizeof(float)),
+                                        aligned(sizeof(float))));
+#define VEC_AT(p) (*(float_uvec*)(p))
+
 ////// Audio windows
 
 #define WINDOW_FRAMES 1024
@@ -177,30 +196,65 @@ struct Window_s;
 
 typedef void (*window_updater)(struct Window_s*);
 
+// What a window holds.  Time-domain windows are real, and only
+// spectral windows (made with make_r2c) are complex.
+typedef enum {
+  WINDOW_REAL, // num_frames samples in frames
+  WINDOW_SPECTRUM // num_frames/2+1 bins in bins, of num_frames samples
+} WindowKind;
+
 typedef struct Window_s {
   int num_frames;
+  WindowKind kind;
   window_updater updater;
   void* data1;
   void* data2;
   void* data3;
   void* data4;
   list_t* dependencies;
-  fftw_complex * frames;
+  int num_dependents; // windows with this one in their dependencies
+  // Planning (see make_window_dep_order and program_add_dep)
+  int plan_index; // position in its program's plan, or -1
+  unsigned int visited; // plan_epoch when last reached
+  bool on_path; // on the path of the search which reached it
+  struct Window_s* plan_parent; // dependency through which it was reached
+  int sched_slot; // in its program's scheduler, or -1
+  union {
+    float* frames;
+    fftwf_complex* bins;
+  };
 } Window;
 
-Window* window_new(int num_frames) {
+Window* window__new(int num_frames, WindowKind kind, size_t size) {
   Window* window = malloc(sizeof(Window));
   if (window == NULL) {
     error("malloc error in window_new\n");
   }
   window->num_frames = num_frames;
+  window->kind = kind;
   window->updater = NULL;
   window->dependencies = list_new();
-  size_t size = sizeof(fftw_complex) * num_frames;
-  window->frames = fftw_malloc(size);
+  window->num_dependents = 0;
+  window->plan_index = -1;
+  window->visited = 0;
+  window->on_path = false;
+  window->plan_parent = NULL;
+  window->sched_slot = -1;
+  window->frames = fftwf_malloc(size);
   return window;
 }
 
+// A window of num_frames real samples
+Window* window_new(int num_frames) {
+  return window__new(num_frames, WINDOW_REAL, sizeof(float) * num_frames);
+}
+
+// A window of the spectrum of num_frames real samples
+Window* window_new_spectrum(int num_frames) {
+  return window__new(num_frames, WINDOW_SPECTRUM,
+                     sizeof(fftwf_complex) * (num_frames/2 + 1));
+}
+
 Window* window_update(Window * window) {
   if (window->updater != NULL) {
     window->updater(window);
@@ -209,37 +263,593 @@ Window* window_update(Window * window) {
 }
 
 void window_add_dep(Window * window, Window * dep) {
-  set_add(window->dependencies, (void*)dep);
+  if (!list_in(window->dependencies, (void*)dep)) {
+    list_append(window->dependencies, (void*)dep);
+    dep->num_dependents++;
+  }
+}
+
+void window_remove_dep(Window * window, Window * dep) {
+  if (list_remove(window->dependencies, (void*)dep)) {
+    dep->num_dependents--;
+  }
 }
 
 ////// Window dependencies
 
-// TODO complain about back-edges
-list_t* make_window_dep_order(list_t* root_windows) {
-  list_t* order = list_new();
-  list_t* queue = list_new();
-  for (int i = 0; i < root_windows->length; i++) {
-    set_add(queue, list_get(root_windows, i));
-  }
-  while (queue->length > 0) {
-    Window* w = list_pop(queue, -1);
-    if (!list_in(order, (void*)w)) {
-      list_insert(order, 0, (void*)w);
-      for (int i = 0; i < w->dependencies->length; i++) {
-        set_add(queue, list_get(w->dependencies, i));
+// A plan lists windows after their dependencies.  It is made by a
+// depth-first search from the root windows, which appends each window
+// once all its dependencies are in the plan.  Each window is visited
+// once per search, since visiting sets its visited field to that
+// search's epoch, so planning is linear in the windows and
+// dependencies reached.  A dependency on a window still on the search
+// path is a cycle.
+
+unsigned int plan_epoch = 0;
+
+typedef struct PlanFrame_s {
+  Window* window;
+  int next_dep; // index of the next dependency to visit
+} PlanFrame;
+
+// Whether a window is in a plan
+static inline bool window_planned(list_t* plan, Window* w) {
+  return w->plan_index >= 0 && w->plan_index < plan->length
+    && plan->data[w->plan_index] == w;
+}
+
+// Append to plan the windows the roots depend on which aren't in it
+// already.  On a cycle, returns the windows along it, each depending
+// on the next and the last on the first, with plan left as it was.
+// Otherwise returns NULL.
+list_t* window__plan(list_t* root_windows, list_t* plan) {
+  plan_epoch++;
+  int old_length = plan->length;
+  int depth = 0, max_depth = DEFAULT_LIST_SIZE;
+  PlanFrame* stack = malloc(max_depth*sizeof(PlanFrame));
+  list_t* cycle = NULL;
+  for (int r = 0; r < root_windows->length && cycle == NULL; r++) {
+    Window* root = list_get(root_windows, r);
+    if (root->visited == plan_epoch || window_planned(plan, root)) {
+      continue;
+    }
+    root->visited = plan_epoch;
+    root->on_path = true;
+    stack[depth++] = (PlanFrame){root, 0};
+    while (depth > 0) {
+      PlanFrame* top = &stack[depth - 1];
+      if (top->next_dep == top->window->dependencies->length) {
+        top->window->on_path = false;
+        top->window->plan_index = plan->length;
+        list_append(plan, top->window);
+        depth--;
+        continue;
+      }
+      Window* dep = list_get(top->window->dependencies, top->next_dep++);
+      if (dep->on_path) {
+        cycle = list_new();
+        for (int i = 0; i < depth; i++) {
+          if (stack[i].window == dep || cycle->length > 0) {
+            list_append(cycle, stack[i].window);
+          }
+        }
+        break;
       }
+      if (dep->visited == plan_epoch || window_planned(plan, dep)) {
+        continue;
+      }
+      dep->visited = plan_epoch;
+      dep->on_path = true;
+      if (depth == max_depth) {
+        max_depth *= 2;
+        stack = realloc(stack, max_depth*sizeof(PlanFrame));
+        if (stack == NULL) {
+          error("Error realloc in window__plan\n");
+        }
+      }
+      stack[depth++] = (PlanFrame){dep, 0};
+    }
+  }
+  if (cycle != NULL) {
+    for (int i = 0; i < depth; i++) {
+      stack[i].window->on_path = false;
+    }
+    for (int i = old_length; i < plan->length; i++) {
+      ((Window*)list_get(plan, i))->plan_index = -1;
     }
+    plan->length = old_length;
+  }
+  free(stack);
+  return cycle;
+}
+
+// The windows the roots depend on, each after its dependencies.  On a
+// cycle, returns NULL and sets *cycle as window__plan returns it.
+list_t* make_window_dep_order(list_t* root_windows, list_t** cycle) {
+  list_t* order = list_new();
+  *cycle = window__plan(root_windows, order);
+  if (*cycle != NULL) {
+    list_free(order);
+    return NULL;
   }
   return order;
 }
 
+void print_window_cycle(FILE* out, list_t* cycle) {
+  fprintf(out, "Window cycle:");
+  for (int i = 0; i < cycle->length; i++) {
+    fprintf(out, " %p ->", list_get(cycle, i));
+  }
+  fprintf(out, " %p\n", list_get(cycle, 0));
+}
+
+////// Parallel scheduling
+
+// A plan can be followed by a fixed pool of worker threads together
+// with the calling (JACK) thread.  Each scheduled window has a counter
+// of its dependencies not yet updated this cycle, and the thread which
+// updates the last of them pushes the window on its own deque.
+// Threads pop windows from their own deque and steal from the others'
+// (these are Chase-Lev deques).  Everything is allocated as windows are
+// scheduled, so a cycle neither allocates nor blocks: the workers are
+// woken by posting a semaphore, and spin while there is nothing ready,
+// as does the calling thread until the cycle is done.
+//
+// The calling thread is JACK's realtime thread, so the workers are made
+// realtime threads of the client at the same priority; otherwise any
+// other process could preempt a worker holding a window while the JACK
+// thread spins waiting for it.  The cycle is done when the last window
+// is updated: the calling thread does not wait for the workers to go
+// back to sleep, nor for every worker to have woken up.  So a worker
+// may come late, into the next cycle.  That is fine as long as it only
+// takes windows out of the deques, which is why the ready windows are
+// all pushed on the calling thread's deque at the start of a cycle,
+// and why the deque indices only ever grow (a late thief must not
+// mistake a slot of this cycle for the one it saw last cycle).
+//
+// The program is edited while the JACK thread follows it, so the
+// scheduler keeps two copies of its graph of windows, with each window
+// in the same slot of both.  Cycles follow the live copy, and edits go
+// to the other one in place, each costing as much as the dependencies
+// it adds or removes.  scheduler_publish makes the edited copy live,
+// which the JACK thread sees at the start of its next cycle, then waits
+// for the threads still following the old copy to leave it before
+// replaying the edits on that.  Only the editing thread ever waits.
+
+#define SCHEDULER_MAX_THREADS 16
+
+typedef struct Deque_s {
+  volatile long top; // where other threads steal from
+  volatile long bottom; // where the owner pushes and pops
+  long size; // of items, which holds items[top % size]...
+  int* items; // slots
+} Deque;
+
+// The window in a slot of a scheduler's graph
+typedef struct SchedNode_s {
+  Window* window; // NULL if the slot is free
+  int num_deps;
+  int num_dependents;
+  int max_dependents;
+  int* dependents; // slots
+} SchedNode;
+
+// A copy of a scheduler's graph, with what a cycle following it needs
+typedef struct SchedGraph_s {
+  int num_windows;
+  int num_slots; // the windows are in slots below this
+  int max_slots;
+  SchedNode* nodes;
+  volatile int* pending; // dependencies not yet updated this cycle
+  Deque deques[SCHEDULER_MAX_THREADS];
+} SchedGraph;
+
+typedef enum {
+  SCHED_ADD_WINDOW,
+  SCHED_REMOVE_WINDOW,
+  SCHED_ADD_DEP, // the window in slot depends on the one in dep
+  SCHED_REMOVE_DEP,
+  SCHED_CLEAR // remove every window
+} SchedEditKind;
+
+typedef struct SchedEdit_s {
+  SchedEditKind kind;
+  int slot;
+  int dep;
+  Window* window; // for SCHED_ADD_WINDOW
+} SchedEdit;
+
+typedef struct Scheduler_s {
+  int num_threads; // including the thread calling scheduler_run
+  int num_started;
+  SchedGraph graphs[2];
+  volatile int live; // the graph cycles follow
+  volatile int users[2]; // threads following each graph
+  // Edits made to graphs[!live] since the last scheduler_publish
+  int num_edits;
+  int max_edits;
+  SchedEdit* edits;
+  int num_slots; // slots ever used
+  int num_free;
+  int max_free;
+  int* free_slots;
+  volatile int remaining; // windows not yet updated this cycle
+  volatile bool stopping;
+  pthread_t workers[SCHEDULER_MAX_THREADS];
+  sem_t start;
+} Scheduler;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Only the owner pushes.
+void deque_push(Deque* d, int x) {
+  long b = d->bottom;
+  d->items[b % d->size] = x;
+  __sync_synchronize();
+  d->bottom = b + 1;
+}
+
+// Only the owner pops.  Returns -1 if there is nothing to pop.
+int deque_pop(Deque* d) {
+  long b = d->bottom - 1;
+  d->bottom = b;
+  __sync_synchronize();
+  long t = d->top;
+  if (t > b) {
+    d->bottom = b + 1;
+    return -1;
+  }
+  int x = d->items[b % d->size];
+  if (t == b) {
+    // The last item, which a thief may be taking too
+    if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+      x = -1;
+    }
+    d->bottom = b + 1;
+  }
+  return x;
+}
+
+// Returns -1 if there is nothing to steal, or another thread took it.
+int deque_steal(Deque* d) {
+  long t = d->top;
+  __sync_synchronize();
+  long b = d->bottom;
+  if (t >= b) {
+    return -1;
+  }
+  int x = d->items[t % d->size];
+  if (!__sync_bool_compare_and_swap(&d->top, t, t + 1)) {
+    return -1;
+  }
+  return x;
+}
+
+// Make room in a graph no thread is following for a window in slot.
+void sched_graph__reserve(SchedGraph* g, int num_threads, int slot) {
+  if (slot < g->max_slots) {
+    return;
+  }
+  int max_slots = g->max_slots > 0 ? g->max_slots : DEFAULT_LIST_SIZE;
+  while (max_slots <= slot) {
+    max_slots *= 2;
+  }
+  g->nodes = realloc(g->nodes, max_slots*sizeof(SchedNode));
+  g->pending = realloc((void*)g->pending, max_slots*sizeof(int));
+  if (g->nodes == NULL || g->pending == NULL) {
+    error("Error realloc in sched_graph__reserve\n");
+  }
+  for (int i = g->max_slots; i < max_slots; i++) {
+    g->nodes[i] = (SchedNode){NULL, 0, 0, 0, NULL};
+  }
+  for (int t = 0; t < num_threads; t++) {
+    // The deques are empty, whatever top and bottom have come to.
+    g->deques[t].size = max_slots;
+    g->deques[t].items = realloc(g->deques[t].items, max_slots*sizeof(int));
+    if (g->deques[t].items == NULL) {
+      error("Error realloc in sched_graph__reserve\n");
+    }
+  }
+  g->max_slots = max_slots;
+}
+
+void sched_graph__apply(SchedGraph* g, int num_threads, SchedEdit* e) {
+  SchedNode* node = e->slot >= 0 ? &g->nodes[e->slot] : NULL;
+  switch (e->kind) {
+  case SCHED_ADD_WINDOW:
+    sched_graph__reserve(g, num_threads, e->slot);
+    node = &g->nodes[e->slot];
+    node->window = e->window;
+    node->num_deps = 0;
+    node->num_dependents = 0;
+    g->num_windows++;
+    g->num_slots = e->slot < g->num_slots ? g->num_slots : e->slot + 1;
+    break;
+  case SCHED_REMOVE_WINDOW:
+    node->window = NULL;
+    g->num_windows--;
+    break;
+  case SCHED_ADD_DEP: {
+    SchedNode* dep = &g->nodes[e->dep];
+    if (dep->num_dependents == dep->max_dependents) {
+      dep->max_dependents = dep->max_dependents > 0 ? 2*dep->max_dependents : 4;
+      dep->dependents = realloc(dep->dependents, dep->max_dependents*sizeof(int));
+      if (dep->dependents == NULL) {
+        error("Error realloc in sched_graph__apply\n");
+      }
+    }
+    dep->dependents[dep->num_dependents++] = e->slot;
+    node->num_deps++;
+    break;
+  }
+  case SCHED_REMOVE_DEP: {
+    SchedNode* dep = &g->nodes[e->dep];
+    for (int i = 0; i < dep->num_dependents; i++) {
+      if (dep->dependents[i] == e->slot) {
+        dep->dependents[i] = dep->dependents[--dep->num_dependents];
+        break;
+      }
+    }
+    node->num_deps--;
+    break;
+  }
+  case SCHED_CLEAR:
+    for (int i = 0; i < g->num_slots; i++) {
+      g->nodes[i].window = NULL;
+      g->nodes[i].num_deps = g->nodes[i].num_dependents = 0;
+    }
+    g->num_windows = g->num_slots = 0;
+    break;
+  }
+}
+
+// Count the calling thread among those following the live graph, and
+// return that graph's index.
+int scheduler__enter(Scheduler* s) {
+  for (;;) {
+    int p = s->live;
+    __sync_add_and_fetch(&s->users[p], 1);
+    if (s->live == p) {
+      return p;
+    }
+    __sync_sub_and_fetch(&s->users[p], 1);
+  }
+}
+
+// Update ready windows of graph p until every window of the cycle is
+// updated.  Workers also leave once p is no longer live, so that its
+// edits can be replayed; the calling thread finishes its cycle on p.
+void scheduler_work(Scheduler* s, int p, int self) {
+  SchedGraph* g = &s->graphs[p];
+  while (s->remaining > 0 && (self == 0 || s->live == p)) {
+    int x = deque_pop(&g->deques[self]);
+    for (int k = 1; x < 0 && k < s->num_threads; k++) {
+      x = deque_steal(&g->deques[(self + k) % s->num_threads]);
+    }
+    if (x < 0) {
+      cpu_relax();
+      continue;
+    }
+    SchedNode* node = &g->nodes[x];
+    window_update(node->window);
+    for (int i = 0; i < node->num_dependents; i++) {
+      int d = node->dependents[i];
+      if (__sync_sub_and_fetch(&g->pending[d], 1) == 0) {
+        deque_push(&g->deques[self], d);
+      }
+    }
+    __sync_sub_and_fetch(&s->remaining, 1);
+  }
+}
+
+void* scheduler_worker(void* arg) {
+  Scheduler* s = arg;
+  int self = __sync_add_and_fetch(&s->num_started, 1);
+  for (;;) {
+    while (sem_wait(&s->start) != 0) {
+      // Interrupted
+    }
+    if (s->stopping) {
+      return NULL;
+    }
+    int p = scheduler__enter(s);
+    scheduler_work(s, p, self);
+    __sync_sub_and_fetch(&s->users[p], 1);
+  }
+}
+
+// A scheduler of no windows with num_threads - 1 workers, each pinned
+// to its own CPU.  If client is not NULL the workers are threads of
+// that JACK client, realtime if it is.
+Scheduler* scheduler_new(int num_threads, jack_client_t* client) {
+  if (num_threads < 1 || num_threads > SCHEDULER_MAX_THREADS) {
+    error("Scheduler of %d threads\n", num_threads);
+  }
+  Scheduler* s = calloc(1, sizeof(Scheduler));
+  if (s == NULL) {
+    error("malloc error in scheduler_new\n");
+  }
+  s->num_threads = num_threads;
+  if (sem_init(&s->start, 0, 0)) {
+    error("Could not create scheduler semaphore\n");
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int t = 1; t < num_threads; t++) {
+    int err;
+    if (client != NULL) {
+      err = jack_client_create_thread(client, &s->workers[t],
+                                      jack_client_real_time_priority(client),
+                                      jack_is_realtime(client),
+                                      scheduler_worker, s);
+    } else {
+      err = pthread_create(&s->workers[t], NULL, scheduler_worker, s);
+    }
+    if (err) {
+      error("Could not create scheduler worker\n");
+    }
+    cpu_set_t cpu;
+    CPU_ZERO(&cpu);
+    CPU_SET(t % cpus, &cpu);
+    if ((err = pthread_setaffinity_np(s->workers[t], sizeof(cpu), &cpu))) {
+      fprintf(stderr, "Could not pin scheduler worker %d: %s\n",
+              t, strerror(err));
+    }
+  }
+  return s;
+}
+
+void scheduler__edit(Scheduler* s, SchedEdit e) {
+  if (s->num_edits == s->max_edits) {
+    s->max_edits = s->max_edits > 0 ? 2*s->max_edits : DEFAULT_LIST_SIZE;
+    s->edits = realloc(s->edits, s->max_edits*sizeof(SchedEdit));
+    if (s->edits == NULL) {
+      error("Error realloc in scheduler__edit\n");
+    }
+  }
+  s->edits[s->num_edits++] = e;
+  sched_graph__apply(&s->graphs[!s->live], s->num_threads, &e);
+}
+
+// Schedule a window whose dependencies are all scheduled.
+void scheduler_add_window(Scheduler* s, Window* w) {
+  int slot = s->num_free > 0 ? s->free_slots[--s->num_free] : s->num_slots++;
+  w->sched_slot = slot;
+  scheduler__edit(s, (SchedEdit){SCHED_ADD_WINDOW, slot, -1, w});
+  for (int j = 0; j < w->dependencies->length; j++) {
+    Window* dep = list_get(w->dependencies, j);
+    scheduler__edit(s, (SchedEdit){SCHED_ADD_DEP, slot, dep->sched_slot, NULL});
+  }
+}
+
+// Let the scheduler know that a scheduled window now depends on
+// another scheduled window.
+void scheduler_add_dep(Scheduler* s, Window* w, Window* dep) {
+  scheduler__edit(s, (SchedEdit){SCHED_ADD_DEP, w->sched_slot, dep->sched_slot, NULL});
+}
+
+// Stop scheduling a window no scheduled window depends on, before it
+// loses its dependencies.
+void scheduler_remove_window(Scheduler* s, Window* w) {
+  for (int j = 0; j < w->dependencies->length; j++) {
+    Window* dep = list_get(w->dependencies, j);
+    scheduler__edit(s, (SchedEdit){SCHED_REMOVE_DEP, w->sched_slot, dep->sched_slot, NULL});
+  }
+  scheduler__edit(s, (SchedEdit){SCHED_REMOVE_WINDOW, w->sched_slot, -1, NULL});
+  if (s->num_free == s->max_free) {
+    s->max_free = s->max_free > 0 ? 2*s->max_free : DEFAULT_LIST_SIZE;
+    s->free_slots = realloc(s->free_slots, s->max_free*sizeof(int));
+    if (s->free_slots == NULL) {
+      error("Error realloc in scheduler_remove_window\n");
+    }
+  }
+  s->free_slots[s->num_free++] = w->sched_slot;
+  w->sched_slot = -1;
+}
+
+// Let the next cycle follow the windows as edited, and wait until no
+// thread follows them as they were.  Not to be called from the JACK
+// thread.
+void scheduler_publish(Scheduler* s) {
+  if (s->num_edits == 0) {
+    return;
+  }
+  int old = s->live;
+  __sync_synchronize();
+  s->live = !old;
+  __sync_synchronize();
+  while (s->users[old] > 0) {
+    sched_yield();
+  }
+  for (int i = 0; i < s->num_edits; i++) {
+    sched_graph__apply(&s->graphs[old], s->num_threads, &s->edits[i]);
+  }
+  s->num_edits = 0;
+}
+
+// Schedule the windows of a plan (skipping its NULLs) instead of
+// those scheduled so far.
+void scheduler_set_plan(Scheduler* s, list_t* plan) {
+  SchedGraph* g = &s->graphs[!s->live];
+  for (int i = 0; i < g->num_slots; i++) {
+    if (g->nodes[i].window != NULL) {
+      g->nodes[i].window->sched_slot = -1;
+    }
+  }
+  scheduler__edit(s, (SchedEdit){SCHED_CLEAR, -1, -1, NULL});
+  s->num_slots = s->num_free = 0;
+  for (int i = 0; i < plan->length; i++) {
+    if (plan->data[i] != NULL) {
+      scheduler_add_window(s, plan->data[i]);
+    }
+  }
+  scheduler_publish(s);
+}
+
+// Update every scheduled window once.
+void scheduler_run(Scheduler* s) {
+  int p = scheduler__enter(s);
+  SchedGraph* g = &s->graphs[p];
+  for (int i = 0; i < g->num_slots; i++) {
+    g->pending[i] = g->nodes[i].num_deps;
+  }
+  __sync_synchronize();
+  s->remaining = g->num_windows;
+  // The workers steal the windows which are ready to start with.
+  for (int i = 0; i < g->num_slots; i++) {
+    if (g->nodes[i].window != NULL && g->nodes[i].num_deps == 0) {
+      deque_push(&g->deques[0], i);
+    }
+  }
+  // A post no worker has taken since the last cycle wakes one for this.
+  int asleep;
+  sem_getvalue(&s->start, &asleep);
+  for (int k = asleep; k < s->num_threads - 1; k++) {
+    sem_post(&s->start);
+  }
+  scheduler_work(s, p, 0);
+  __sync_sub_and_fetch(&s->users[p], 1);
+}
+
+void scheduler_free(Scheduler* s) {
+  s->stopping = true;
+  __sync_synchronize();
+  for (int t = 1; t < s->num_threads; t++) {
+    sem_post(&s->start);
+  }
+  for (int t = 1; t < s->num_threads; t++) {
+    pthread_join(s->workers[t], NULL);
+  }
+  sem_destroy(&s->start);
+  for (int p = 0; p < 2; p++) {
+    SchedGraph* g = &s->graphs[p];
+    for (int i = 0; i < g->max_slots; i++) {
+      free(g->nodes[i].dependents);
+    }
+    free(g->nodes);
+    free((void*)g->pending);
+    for (int t = 0; t < s->num_threads; t++) {
+      free(g->deques[t].items);
+    }
+  }
+  free(s->edits);
+  free(s->free_slots);
+  free(s);
+}
+
 ////// Program description
 
 typedef struct Program_s {
   list_t* windows;
   Window* left;
   Window* right;
-  list_t* window_plan;
+  list_t* window_plan; // with a NULL where each removed window was
+  int plan_holes; // those NULLs
+  Scheduler* scheduler; // NULL to follow the plan on the calling thread
+  struct OscBank_s* osc_bank; // the bank make_sin adds sines to
 } Program;
 
 Program* program_new(void) {
@@ -248,6 +858,9 @@ Program* program_new(void) {
   program->left = NULL;
   program->right = NULL;
   program->window_plan = list_new();
+  program->plan_holes = 0;
+  program->scheduler = NULL;
+  program->osc_bank = NULL;
   return program;
 }
 
@@ -259,14 +872,195 @@ void program_update_plan(Program* program) {
   if (program->right != NULL) {
     list_append(root_windows, program->right);
   }
+  list_t* cycle;
+  list_t* plan = make_window_dep_order(root_windows, &cycle);
+  list_free(root_windows);
+  if (plan == NULL) {
+    print_window_cycle(stderr, cycle);
+    error("The program's windows depend on themselves\n");
+  }
   list_free(program->window_plan);
-  program->window_plan = make_window_dep_order(root_windows);
+  program->window_plan = plan;
+  program->plan_holes = 0;
+  if (program->scheduler != NULL) {
+    scheduler_set_plan(program->scheduler, plan);
+  }
+}
+
+// Re-planning a program's plan as its windows change, looking only at
+// the windows added or removed and, when a planned window gains a
+// dependency planned after it, the part of the plan between the two.
+// Planned windows must only gain dependencies through program_add_dep.
+// The scheduler, if any, is told of the same windows and dependencies,
+// so the program can be edited while the JACK thread follows it.
+
+// Plan a window nothing planned depends on yet, after whichever of its
+// dependencies weren't planned.  On a cycle, returns it (see
+// window__plan) and plans nothing.
+list_t* program_add_window(Program* program, Window* w) {
+  list_t* plan = program->window_plan;
+  int old_length = plan->length;
+  list_t* roots = list_new();
+  list_append(roots, w);
+  list_t* cycle = window__plan(roots, plan);
+  list_free(roots);
+  if (cycle == NULL && program->scheduler != NULL) {
+    for (int p = old_length; p < plan->length; p++) {
+      scheduler_add_window(program->scheduler, plan->data[p]);
+    }
+    scheduler_publish(program->scheduler);
+  }
+  return cycle;
+}
+
+// Let the scheduler, if any, know that a planned window now depends on
+// dep.
+void program__schedule_dep(Program* program, Window* window, Window* dep) {
+  if (program->scheduler != NULL) {
+    scheduler_add_dep(program->scheduler, window, dep);
+    scheduler_publish(program->scheduler);
+  }
+}
+
+// Make window depend on dep, keeping the plan in order if window is
+// planned.  The windows in the plan from window up to dep which
+// depend on window (through the windows in between) are moved after
+// the rest.  On a cycle, returns it (see window__plan) and leaves
+// window without the dependency.
+list_t* program_add_dep(Program* program, Window* window, Window* dep) {
+  list_t* plan = program->window_plan;
+  if (window_planned(plan, window) && !window_planned(plan, dep)) {
+    list_t* cycle = program_add_window(program, dep);
+    if (cycle != NULL) {
+      return cycle;
+    }
+  }
+  if (list_in(window->dependencies, dep)) {
+    return NULL;
+  }
+  window_add_dep(window, dep);
+  if (!window_planned(plan, window)) {
+    return NULL;
+  }
+  if (dep->plan_index < window->plan_index) {
+    program__schedule_dep(program, window, dep);
+    return NULL;
+  }
+  int lo = window->plan_index, hi = dep->plan_index;
+  plan_epoch++;
+  window->visited = plan_epoch;
+  int num_moved = 1;
+  for (int p = lo + 1; p <= hi; p++) {
+    Window* x = list_get(plan, p);
+    for (int j = 0; x != NULL && j < x->dependencies->length; j++) {
+      Window* d = list_get(x->dependencies, j);
+      if (d->visited == plan_epoch) {
+        x->visited = plan_epoch;
+        x->plan_parent = d;
+        num_moved++;
+        break;
+      }
+    }
+  }
+  if (dep->visited == plan_epoch) {
+    list_t* cycle = list_new();
+    for (Window* x = dep; x != window; x = x->plan_parent) {
+      list_append(cycle, x);
+    }
+    list_append(cycle, window);
+    window_remove_dep(window, dep);
+    return cycle;
+  }
+  Window** region = malloc((hi - lo + 1)*sizeof(Window*));
+  int kept = 0, moved = hi - lo + 1 - num_moved;
+  for (int p = lo; p <= hi; p++) {
+    Window* x = list_get(plan, p);
+    region[x != NULL && x->visited == plan_epoch ? moved++ : kept++] = x;
+  }
+  for (int p = lo; p <= hi; p++) {
+    plan->data[p] = region[p - lo];
+    if (region[p - lo] != NULL) {
+      region[p - lo]->plan_index = p;
+    }
+  }
+  free(region);
+  program__schedule_dep(program, window, dep);
+  return NULL;
+}
+
+// Remove a window nothing depends on from the program, along with
+// those of its dependencies which are then left without dependents
+// (other than the roots).  Their places in the plan are left NULL
+// until the NULLs are half the plan, so that removing a window costs
+// as much as its dependencies, plus the plan's length only once per
+// as many windows removed.
+void program_remove_window(Program* program, Window* w) {
+  if (w->num_dependents > 0) {
+    error("Removing a window which other windows depend on\n");
+  }
+  list_t* plan = program->window_plan;
+  list_t* removing = list_new();
+  list_append(removing, w);
+  while (removing->length > 0) {
+    Window* x = list_pop(removing, -1);
+    if (window_planned(plan, x)) {
+      if (program->scheduler != NULL) {
+        scheduler_remove_window(program->scheduler, x);
+      }
+      plan->data[x->plan_index] = NULL;
+      x->plan_index = -1;
+      program->plan_holes++;
+    }
+    while (x->dependencies->length > 0) {
+      Window* d = list_get(x->dependencies, -1);
+      window_remove_dep(x, d);
+      if (d->num_dependents == 0 && d != program->left && d != program->right) {
+        list_append(removing, d);
+      }
+    }
+  }
+  list_free(removing);
+  if (program->scheduler != NULL) {
+    scheduler_publish(program->scheduler);
+  }
+  if (2*program->plan_holes > plan->length) {
+    int n = 0;
+    for (int p = 0; p < plan->length; p++) {
+      Window* x = plan->data[p];
+      if (x != NULL) {
+        x->plan_index = n;
+        plan->data[n++] = x;
+      }
+    }
+    plan->length = n;
+    program->plan_holes = 0;
+  }
+}
+
+// Follow the plan on num_threads threads, including the calling
+// thread, the others being threads of client if it is not NULL.
+void program_set_threads(Program* program, int num_threads,
+                         jack_client_t* client) {
+  if (program->scheduler != NULL) {
+    scheduler_free(program->scheduler);
+    program->scheduler = NULL;
+  }
+  if (num_threads > 1) {
+    program->scheduler = scheduler_new(num_threads, client);
+    scheduler_set_plan(program->scheduler, program->window_plan);
+  }
 }
 
 void program_follow_plan(Program* program) {
+  if (program->scheduler != NULL) {
+    scheduler_run(program->scheduler);
+    return;
+  }
   for (int i = 0; i < program->window_plan->length; i++) {
     Window* w = list_get(program->window_plan, i);
-    window_update(w);
+    if (w != NULL) {
+      window_update(w);
+    }
   }
 }
 
@@ -329,7 +1123,7 @@ int process_program(jack_nframes_t nframes, void *arg) {
       program_follow_plan(program);
       prog_i = 0;
     }
-    out[i] = creal(program->left->frames[prog_i]);
+    out[i] = program->left->frames[prog_i];
   }
 
   long c = (long)nframes;
@@ -339,56 +1133,237 @@ int process_program(jack_nframes_t nframes, void *arg) {
   return 0;
 }
 
-void sin_update(Window* window) {
-  float* t = (float*)&window->data1;
-  float freq = *(float*)&((Window*)window->data2)->frames;
-  float gain = *(float*)&((Window*)window->data3)->frames;
-  float penlast = creal(window->frames[window->num_frames-2]);
-  float last = creal(window->frames[window->num_frames-1]);
-  bool isRising = last > penlast;
-  float phase = 0;
-  if (isRising) {
-    phase = asin(last/gain) + 2*M_PI*freq/sr;
-  } else {
-    phase = -asin(last/gain) + 2*M_PI*freq/sr + M_PI;
-  }
-  *t += (float)window->num_frames/sr;
-  for (int i = 0; i < window->num_frames; i++) {
-    window->frames[i] = gain*sin(0*phase + freq*2*M_PI*(*t+(float)i/sr));
+////// Oscillator bank
+
+// Sine windows are filled by bank windows of up to OSC_BANK_SIZE
+// oscillators, which the sine windows depend on.  Banks are kept small
+// so that a program has enough of them for the scheduler's threads to
+// share.  Each oscillator's phase is carried between windows in double
+// precision.  Within a window, samples are generated FLOAT_LANES at a
+// time: lane k of a block is the imaginary part of the phasor times
+// e^(i k step), and the phasor is advanced by a whole block with one
+// complex multiply.  So libm is only called once per oscillator per
+// window, rather than per sample.
+
+typedef struct OscBank_s {
+  Window* window; // the bank's own window
+  list_t* oscillators; // the sine windows it fills
+  double* phases; // phase of each at the start of its next window
+  int alloc_size;
+} OscBank;
+
+#define OSC_BANK_SIZE 4
+
+// The value of a constant-like window (see make_const)
+static inline float window_scalar(Window* w) {
+  return *(float*)&w->frames;
+}
+
+// Fill out[0..n) with gain*sin(phase + i*step).
+void osc_fill(float* out, int n, double phase, double step, float gain) {
+  float_vec rot_c, rot_s;
+  for (int k = 0; k < FLOAT_LANES; k++) {
+    rot_c[k] = gain*cos(k*step);
+    rot_s[k] = gain*sin(k*step);
+  }
+  double c = cos(phase), s = sin(phase);
+  double adv_c = cos(FLOAT_LANES*step), adv_s = sin(FLOAT_LANES*step);
+  for (int i = 0; i < n; i += FLOAT_LANES) {
+    float_vec v = (float)c*rot_s + (float)s*rot_c;
+    if (i + FLOAT_LANES <= n) {
+      VEC_AT(&out[i]) = v;
+    } else {
+      for (int k = 0; i + k < n; k++) {
+        out[i + k] = v[k];
+      }
+    }
+    double next_c = c*adv_c - s*adv_s;
+    s = c*adv_s + s*adv_c;
+    c = next_c;
   }
 }
 
-void sum_update(Window* window) {
-  for (int i = 0; i < window->num_frames; i++) {
-    window->frames[i] = 0;
+void osc_bank_update(Window* window) {
+  OscBank* bank = window->data1;
+  for (int j = 0; j < bank->oscillators->length; j++) {
+    Window* w = list_get(bank->oscillators, j);
+    double step = 2*M_PI*window_scalar(w->data2)/sr;
+    osc_fill(w->frames, w->num_frames, bank->phases[j], step, window_scalar(w->data3));
+    bank->phases[j] = fmod(bank->phases[j] + step*w->num_frames, 2*M_PI);
+  }
+}
+
+OscBank* osc_bank_new(void) {
+  OscBank* bank = malloc(sizeof(OscBank));
+  if (bank == NULL) {
+    error("malloc error in osc_bank_new\n");
   }
-  list_t* windows = window->data1;
-  for (int j = 0; j < windows->length; j++) {
-    Window* s = list_get(windows, j);
-    for (int i = 0; i < window->num_frames; i++) {
-      window->frames[i] += s->frames[i];
+  bank->window = window_new(0);
+  bank->window->updater = osc_bank_update;
+  bank->window->data1 = bank;
+  bank->oscillators = list_new();
+  bank->alloc_size = DEFAULT_LIST_SIZE;
+  bank->phases = malloc(bank->alloc_size*sizeof(double));
+  return bank;
+}
+
+void osc_bank_add(OscBank* bank, Window* w) {
+  list_append(bank->oscillators, w);
+  if (bank->oscillators->length > bank->alloc_size) {
+    bank->alloc_size *= 2;
+    bank->phases = realloc(bank->phases, bank->alloc_size*sizeof(double));
+    if (bank->phases == NULL) {
+      error("Error realloc in osc_bank_add\n");
     }
   }
+  bank->phases[bank->oscillators->length - 1] = 0;
+  window_add_dep(w, bank->window);
+  window_add_dep(bank->window, w->data2);
+  window_add_dep(bank->window, w->data3);
 }
 
-Window* make_sin(Window* freq, Window* gain) {
+// A sine of the given frequency and gain windows, filled by one of
+// the program's oscillator banks.
+Window* make_sin(Program* program, Window* freq, Window* gain) {
+  OscBank* bank = program->osc_bank;
+  // A planned bank mustn't gain dependencies (see program_add_dep).
+  if (bank == NULL || bank->oscillators->length == OSC_BANK_SIZE
+      || bank->window->plan_index >= 0) {
+    bank = program->osc_bank = osc_bank_new();
+  }
   Window* w = window_new(WINDOW_FRAMES);
-  w->updater = sin_update;
-  w->data1 = 0;
+  w->updater = NULL;
   w->data2 = freq;
   w->data3 = gain;
-  window_add_dep(w, freq);
-  window_add_dep(w, gain);
+  osc_bank_add(bank, w);
   return w;
 }
 
-Window* make_sum(list_t* windows) {
+////// Mixing
+
+// A mix is computed a tile of MIX_TILE_FRAMES frames at a time, so
+// that the tile of the output stays in L1 while the inputs are added
+// into it, MIX_WAYS inputs per pass over the tile.  The first pass
+// stores rather than adds, so the output is never zeroed separately.
+
+#define MIX_TILE_FRAMES 256
+#define MIX_WAYS 4
+
+typedef struct Mix_s {
+  int num_inputs;
+  float** inputs; // frames of the input windows
+  float* gains;
+} Mix;
+
+// out[i] = sum over j of gains[j]*inputs[j][offset + i], for i in [0, n)
+void mix_tile(float* out, float** inputs, float* gains, int num_inputs, int offset, int n) {
+  if (num_inputs == 0) {
+    memset(out, 0, n*sizeof(float));
+    return;
+  }
+  for (int j = 0; j < num_inputs; j += MIX_WAYS) {
+    int ways = num_inputs - j < MIX_WAYS ? num_inputs - j : MIX_WAYS;
+    int i = 0;
+    for (; i + FLOAT_LANES <= n; i += FLOAT_LANES) {
+      float_vec acc = j == 0 ? (float_vec){0} : VEC_AT(&out[i]);
+      for (int k = 0; k < ways; k++) {
+        acc += gains[j + k]*VEC_AT(&inputs[j + k][offset + i]);
+      }
+      VEC_AT(&out[i]) = acc;
+    }
+    for (; i < n; i++) {
+      float acc = j == 0 ? 0 : out[i];
+      for (int k = 0; k < ways; k++) {
+        acc += gains[j + k]*inputs[j + k][offset + i];
+      }
+      out[i] = acc;
+    }
+  }
+}
+
+void mix_update(Window* window) {
+  Mix* mix = window->data1;
+  for (int t = 0; t < window->num_frames; t += MIX_TILE_FRAMES) {
+    int n = window->num_frames - t < MIX_TILE_FRAMES ? window->num_frames - t : MIX_TILE_FRAMES;
+    mix_tile(&window->frames[t], mix->inputs, mix->gains, mix->num_inputs, t, n);
+  }
+}
+
+// A mix of real windows, each scaled by its entry of gains (or by 1
+// if gains is NULL), so that gain stages needn't be windows of their
+// own.
+Window* make_mix(list_t* windows, float* gains) {
+  Mix* mix = malloc(sizeof(Mix));
+  if (mix == NULL) {
+    error("malloc error in make_mix\n");
+  }
+  mix->num_inputs = windows->length;
+  mix->inputs = malloc(windows->length*sizeof(float*));
+  mix->gains = malloc(windows->length*sizeof(float));
   Window* w = window_new(WINDOW_FRAMES);
-  w->updater = sum_update;
-  w->data1 = list_copy(windows);
+  w->updater = mix_update;
+  w->data1 = mix;
   for (int i = 0; i < windows->length; i++) {
-    window_add_dep(w, list_get(windows, i));
+    Window* input = list_get(windows, i);
+    if (input->kind != WINDOW_REAL || input->num_frames != w->num_frames) {
+      error("make_mix of a window which isn't %d real frames\n", w->num_frames);
+    }
+    mix->inputs[i] = input->frames;
+    mix->gains[i] = gains != NULL ? gains[i] : 1;
+    window_add_dep(w, input);
+  }
+  return w;
+}
+
+Window* make_sum(list_t* windows) {
+  return make_mix(windows, NULL);
+}
+
+////// Spectral conversion
+
+// Spectral nodes work on the output of an r2c node and give their
+// result back to the time domain through a c2r node.  Each node plans
+// its transform once, on its own buffers.
+
+void r2c_update(Window* window) {
+  fftwf_execute(window->data2);
+}
+
+// The spectrum of a real window
+Window* make_r2c(Window* samples) {
+  if (samples->kind != WINDOW_REAL) {
+    error("make_r2c of a spectral window\n");
   }
+  Window* w = window_new_spectrum(samples->num_frames);
+  w->updater = r2c_update;
+  w->data1 = samples;
+  w->data2 = fftwf_plan_dft_r2c_1d(samples->num_frames, samples->frames, w->bins,
+                                   FFTW_ESTIMATE);
+  window_add_dep(w, samples);
+  return w;
+}
+
+void c2r_update(Window* window) {
+  fftwf_execute(window->data2);
+  // FFTW's transforms are unnormalized.
+  float scale = 1.0f/window->num_frames;
+  for (int i = 0; i < window->num_frames; i++) {
+    window->frames[i] *= scale;
+  }
+}
+
+// The real window of a spectrum
+Window* make_c2r(Window* spectrum) {
+  if (spectrum->kind != WINDOW_SPECTRUM) {
+    error("make_c2r of a real window\n");
+  }
+  Window* w = window_new(spectrum->num_frames);
+  w->updater = c2r_update;
+  w->data1 = spectrum;
+  // c2r transforms otherwise overwrite their input.
+  w->data2 = fftwf_plan_dft_c2r_1d(spectrum->num_frames, spectrum->bins, w->frames,
+                                   FFTW_ESTIMATE | FFTW_PRESERVE_INPUT);
+  window_add_dep(w, spectrum);
   return w;
 }
 
@@ -409,33 +1384,496 @@ Window* make_sweep(float c) {
   return w;
 }
 
-int main(int argc, char *argv[]) {
-  jack_client_t *client;
-  const char **ports;
-
-  if (pipe((void*)&pipes)) {
-    error ("Could not create pipe\n");
-  }
+////// Demo
 
-  program = program_new();
+Program* make_demo_program(void) {
+  Program* program = program_new();
   list_t* summands = list_new();
   for (int i = 1; i < 20; i++) {
-    list_append(summands, make_sin(make_const(220*pow(2, i-1)),
+    list_append(summands, make_sin(program, make_const(220*pow(2, i-1)),
                                    make_const(0.1/pow(2.2, i-1))));
   }
   for (int i = 1; i < 20; i++) {
-    list_append(summands, make_sin(make_const(5.0/4*220*pow(2, i-1)),
+    list_append(summands, make_sin(program, make_const(5.0/4*220*pow(2, i-1)),
                                    make_const(0.1/pow(2.2, i-1))));
   }
   for (int i = 1; i < 20; i++) {
-    list_append(summands, make_sin(make_const(3.0/2*220*pow(2, i-1)),
+    list_append(summands, make_sin(program, make_const(3.0/2*220*pow(2, i-1)),
                                    make_const(0.1/pow(2.2, i-1))));
   }
   program->left = make_sum(summands);
-  //list_append(summands, make_sin(make_sweep(220), make_const(0.1)));
+  //list_append(summands, make_sin(program, make_sweep(220), make_const(0.1)));
 
   program->right = window_new(WINDOW_FRAMES); //TODO make use of right
   program_update_plan(program);
+  return program;
+}
+
+////// Checks and benchmarks
+//
+// "clangor check" and "clangor bench" run these instead of the synth,
+// without needing a JACK server.
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// The oscillator bank matches libm over many windows, at frequencies
+// up to Nyquist.
+void check_osc_bank(void) {
+  float buf[WINDOW_FRAMES + 3];
+  double freqs[] = {1, 220, 440.5, 5000, 23999};
+  for (int f = 0; f < sizeof(freqs)/sizeof(freqs[0]); f++) {
+    double step = 2*M_PI*freqs[f]/48000;
+    double phase = 0, max_err = 0;
+    for (long w = 0; w < 1000; w++) {
+      // An odd length to cover the partial last block
+      int n = w % 2 == 0 ? WINDOW_FRAMES : WINDOW_FRAMES + 3;
+      osc_fill(buf, n, phase, step, 0.5);
+      for (int i = 0; i < n; i++) {
+        double err = fabs(buf[i] - 0.5*sin(phase + i*step));
+        max_err = err > max_err ? err : max_err;
+      }
+      phase = fmod(phase + step*n, 2*M_PI);
+    }
+    printf("osc_fill %g Hz: max error %g\n", freqs[f], max_err);
+    if (max_err > 1e-6) {
+      error("Oscillator at %g Hz is off by %g\n", freqs[f], max_err);
+    }
+  }
+}
+
+// A window comes back from an r2c node followed by a c2r node.
+void check_spectral_roundtrip(void) {
+  Window* samples = window_new(WINDOW_FRAMES);
+  Window* spectrum = make_r2c(samples);
+  Window* back = make_c2r(spectrum);
+  osc_fill(samples->frames, WINDOW_FRAMES, 0.3, 2*M_PI*440/48000, 0.5);
+  window_update(spectrum);
+  window_update(back);
+  double max_err = 0;
+  for (int i = 0; i < WINDOW_FRAMES; i++) {
+    double err = fabs(back->frames[i] - samples->frames[i]);
+    max_err = err > max_err ? err : max_err;
+  }
+  printf("r2c/c2r: max error %g\n", max_err);
+  if (max_err > 1e-5) {
+    error("Spectral round trip is off by %g\n", max_err);
+  }
+}
+
+// A mix of an odd number of inputs with gains matches summing them
+// one at a time.
+void check_mix(void) {
+  enum { INPUTS = 13 };
+  list_t* inputs = list_new();
+  float gains[INPUTS];
+  for (int j = 0; j < INPUTS; j++) {
+    Window* input = window_new(WINDOW_FRAMES);
+    osc_fill(input->frames, WINDOW_FRAMES, j, 0.01*(j + 1), 1);
+    list_append(inputs, input);
+    gains[j] = 1.0/(j + 2);
+  }
+  Window* mix = make_mix(inputs, gains);
+  window_update(mix);
+  double max_err = 0;
+  for (int i = 0; i < WINDOW_FRAMES; i++) {
+    double sum = 0;
+    for (int j = 0; j < INPUTS; j++) {
+      sum += gains[j]*((Window*)list_get(inputs, j))->frames[i];
+    }
+    double err = fabs(mix->frames[i] - sum);
+    max_err = err > max_err ? err : max_err;
+  }
+  printf("mix: max error %g\n", max_err);
+  if (max_err > 1e-5) {
+    error("Mix is off by %g\n", max_err);
+  }
+}
+
+// Mix throughput against the number of inputs, in input frames per
+// ns, for the mix node and for a pass over the output per input.
+void bench_mix(void) {
+  enum { MAX_INPUTS = 64, UPDATES = 2000 };
+  list_t* inputs = list_new();
+  for (int j = 0; j < MAX_INPUTS; j++) {
+    Window* input = window_new(WINDOW_FRAMES);
+    osc_fill(input->frames, WINDOW_FRAMES, 0, 0.01*(j + 1), 1);
+    list_append(inputs, input);
+  }
+  for (int num_inputs = 1; num_inputs <= MAX_INPUTS; num_inputs *= 2) {
+    list_t* some = list_new();
+    for (int j = 0; j < num_inputs; j++) {
+      list_append(some, list_get(inputs, j));
+    }
+    Window* mix = make_mix(some, NULL);
+    double start = now_ns();
+    for (int u = 0; u < UPDATES; u++) {
+      window_update(mix);
+    }
+    double mix_ns = now_ns() - start;
+    start = now_ns();
+    for (int u = 0; u < UPDATES; u++) {
+      for (int i = 0; i < WINDOW_FRAMES; i++) {
+        mix->frames[i] = 0;
+      }
+      for (int j = 0; j < num_inputs; j++) {
+        float* in = ((Window*)list_get(some, j))->frames;
+        for (int i = 0; i < WINDOW_FRAMES; i++) {
+          mix->frames[i] += in[i];
+        }
+      }
+    }
+    double pass_ns = now_ns() - start;
+    double frames = (double)UPDATES*WINDOW_FRAMES*num_inputs;
+    printf("mix: %d inputs: %.2f input frames/ns (a pass per input: %.2f)\n",
+           num_inputs, frames/mix_ns, frames/pass_ns);
+    list_free(some);
+  }
+}
+
+// Whether both of a scheduler's graphs hold just the windows of a
+// plan, with their dependencies.
+bool scheduler_matches_plan(Scheduler* s, list_t* plan) {
+  int planned = 0, deps = 0;
+  for (int i = 0; i < plan->length; i++) {
+    Window* w = list_get(plan, i);
+    if (w != NULL) {
+      planned++;
+      deps += w->dependencies->length;
+    }
+  }
+  for (int p = 0; p < 2; p++) {
+    SchedGraph* g = &s->graphs[p];
+    int dependents = 0;
+    for (int i = 0; i < g->num_slots; i++) {
+      if (g->nodes[i].window != NULL) {
+        dependents += g->nodes[i].num_dependents;
+      }
+    }
+    if (g->num_windows != planned || dependents != deps) {
+      return false;
+    }
+    for (int i = 0; i < plan->length; i++) {
+      Window* w = list_get(plan, i);
+      if (w != NULL && (w->sched_slot < 0 || w->sched_slot >= g->num_slots
+                        || g->nodes[w->sched_slot].window != w
+                        || g->nodes[w->sched_slot].num_deps != w->dependencies->length)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void check__cycles_match(Program* serial, Program* parallel, const char* when) {
+  for (int cycle = 0; cycle < 20; cycle++) {
+    program_follow_plan(serial);
+    program_follow_plan(parallel);
+    if (memcmp(serial->left->frames, parallel->left->frames, WINDOW_FRAMES*sizeof(float))) {
+      error("Parallel cycle %d %s differs from the serial one\n", cycle, when);
+    }
+  }
+}
+
+// Mix a new sine into the program's left output.
+Window* check__add_sine(Program* program, double freq) {
+  list_t* summands = list_new();
+  list_append(summands, program->left);
+  list_append(summands, make_sin(program, make_const(freq), make_const(0.1)));
+  Window* mix = make_mix(summands, NULL);
+  if (program_add_window(program, mix) != NULL) {
+    error("Mixing in a sine made a cycle\n");
+  }
+  program->left = mix;
+  return mix;
+}
+
+void check__remove_sine(Program* program, Window* mix) {
+  program->left = list_get(mix->dependencies, 0);
+  program_remove_window(program, mix);
+}
+
+typedef struct Follower_s {
+  Program* program;
+  volatile bool stopping;
+  int cycles;
+} Follower;
+
+void* check__follow(void* arg) {
+  Follower* f = arg;
+  while (!f->stopping) {
+    program_follow_plan(f->program);
+    f->cycles++;
+  }
+  return NULL;
+}
+
+// Parallel cycles match serial ones, also after the same edits to
+// both, and the program can be edited while another thread follows it.
+void check_scheduler(void) {
+  Program* serial = make_demo_program();
+  Program* parallel = make_demo_program();
+  program_set_threads(parallel, 4, NULL);
+  check__cycles_match(serial, parallel, "");
+  Window* serial_mix = check__add_sine(serial, 330);
+  Window* parallel_mix = check__add_sine(parallel, 330);
+  check__cycles_match(serial, parallel, "after adding a window");
+  Window* w = window_new(WINDOW_FRAMES);
+  program_add_dep(serial, serial_mix, w);
+  program_add_dep(parallel, parallel_mix, w);
+  check__cycles_match(serial, parallel, "after adding a dependency");
+  check__remove_sine(serial, serial_mix);
+  check__remove_sine(parallel, parallel_mix);
+  check__cycles_match(serial, parallel, "after removing a window");
+  if (!scheduler_matches_plan(parallel->scheduler, parallel->window_plan)) {
+    error("The scheduler lost track of the plan's edits\n");
+  }
+
+  enum { EDITS = 200 };
+  Follower follower = {parallel, false, 0};
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, check__follow, &follower)) {
+    error("Could not create follower thread\n");
+  }
+  for (int e = 0; e < EDITS; e++) {
+    check__remove_sine(parallel, check__add_sine(parallel, 220 + e));
+  }
+  follower.stopping = true;
+  pthread_join(thread, NULL);
+  if (!scheduler_matches_plan(parallel->scheduler, parallel->window_plan)) {
+    error("The scheduler lost track of edits made while following\n");
+  }
+  program_set_threads(parallel, 1, NULL);
+  printf("scheduler: 4 threads match 1, through %d edits in %d cycles\n",
+         EDITS, follower.cycles);
+}
+
+// Cycles of the demo program on 1 to 16 threads, up to the number of
+// CPUs, and their speedup over one thread.
+void bench_scheduler(void) {
+  enum { CYCLES = 2000 };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  Program* demo = make_demo_program();
+  double serial_ns = 0;
+  for (int threads = 1; threads <= SCHEDULER_MAX_THREADS && threads <= cpus; threads *= 2) {
+    program_set_threads(demo, threads, NULL);
+    double start = now_ns();
+    for (int cycle = 0; cycle < CYCLES; cycle++) {
+      program_follow_plan(demo);
+    }
+    double cycle_ns = (now_ns() - start)/CYCLES;
+    serial_ns = threads == 1 ? cycle_ns : serial_ns;
+    printf("scheduler: %d threads: %.1f us per cycle, speedup %.2f\n",
+           threads, cycle_ns/1e3, serial_ns/cycle_ns);
+  }
+  program_set_threads(demo, 1, NULL);
+}
+
+// Whether every window in a plan comes after its dependencies.
+bool plan_is_ordered(list_t* plan) {
+  for (int i = 0; i < plan->length; i++) {
+    Window* w = list_get(plan, i);
+    if (w == NULL) {
+      continue;
+    }
+    if (w->plan_index != i) {
+      return false;
+    }
+    for (int j = 0; j < w->dependencies->length; j++) {
+      Window* dep = list_get(w->dependencies, j);
+      if (!window_planned(plan, dep) || dep->plan_index >= i) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Plans are ordered through adding and removing windows and
+// dependencies, and cycles are refused with their path.
+void check_planning(void) {
+  Program* demo = make_demo_program();
+  int demo_length = demo->window_plan->length - demo->plan_holes;
+  if (!plan_is_ordered(demo->window_plan)) {
+    error("The demo plan is out of order\n");
+  }
+
+  // A new sine mixed with the old left, then taken out again
+  Window* old_left = demo->left;
+  list_t* summands = list_new();
+  list_append(summands, old_left);
+  list_append(summands, make_sin(demo, make_const(330), make_const(0.1)));
+  demo->left = make_mix(summands, NULL);
+  if (program_add_window(demo, demo->left) != NULL
+      || !plan_is_ordered(demo->window_plan)) {
+    error("Adding a window put the plan out of order\n");
+  }
+  Window* new_left = demo->left;
+  demo->left = old_left;
+  program_remove_window(demo, new_left);
+  if (demo->window_plan->length - demo->plan_holes != demo_length
+      || !plan_is_ordered(demo->window_plan)) {
+    error("Removing a window left %d of %d windows planned\n",
+          demo->window_plan->length - demo->plan_holes, demo_length);
+  }
+
+  // a -> b -> c -> a
+  Window* a = window_new(WINDOW_FRAMES);
+  Window* b = window_new(WINDOW_FRAMES);
+  Window* c = window_new(WINDOW_FRAMES);
+  window_add_dep(a, b);
+  window_add_dep(b, c);
+  window_add_dep(c, a);
+  list_t* roots = list_new();
+  list_append(roots, a);
+  list_t* cycle;
+  if (make_window_dep_order(roots, &cycle) != NULL || cycle->length != 3
+      || list_get(cycle, 0) != a || list_get(cycle, 1) != b || list_get(cycle, 2) != c) {
+    error("The cycle a -> b -> c -> a went unreported\n");
+  }
+  list_free(cycle);
+
+  // Random dependencies among fresh windows, refusing those which
+  // close cycles
+  enum { WINDOWS = 200, DEPS = 2000 };
+  Program* program = program_new();
+  Window* windows[WINDOWS];
+  for (int i = 0; i < WINDOWS; i++) {
+    windows[i] = window_new(WINDOW_FRAMES);
+    program_add_window(program, windows[i]);
+  }
+  unsigned int seed = 1;
+  int refused = 0;
+  for (int e = 0; e < DEPS; e++) {
+    Window* w = windows[rand_r(&seed) % WINDOWS];
+    Window* dep = windows[rand_r(&seed) % WINDOWS];
+    cycle = program_add_dep(program, w, dep);
+    if (cycle != NULL) {
+      // From dep, each depending on the next, to w
+      bool path = list_get(cycle, 0) == dep && list_get(cycle, -1) == w
+        && !list_in(w->dependencies, dep);
+      for (int i = 0; i + 1 < cycle->length; i++) {
+        Window* x = list_get(cycle, i);
+        path = path && list_in(x->dependencies, list_get(cycle, i + 1));
+      }
+      if (!path) {
+        error("Dependency %d was refused with a bad cycle\n", e);
+      }
+      list_free(cycle);
+      refused++;
+    }
+    if (!plan_is_ordered(program->window_plan)) {
+      error("Dependency %d put the plan out of order\n", e);
+    }
+  }
+  printf("planning: ordered after %d dependencies, %d refused as cycles\n",
+         DEPS - refused, refused);
+}
+
+// Planning a long chain of windows from scratch, against adding one
+// window to its plan.
+void bench_planning(void) {
+  enum { WINDOWS = 100000, REPEATS = 20 };
+  Program* program = program_new();
+  Window* prev = window_new(1);
+  program->left = prev;
+  for (int i = 1; i < WINDOWS; i++) {
+    Window* w = window_new(1);
+    window_add_dep(w, prev);
+    window_add_dep(w, program->left);
+    prev = w;
+  }
+  program->left = prev;
+  program->right = window_new(1);
+  double start = now_ns();
+  for (int r = 0; r < REPEATS; r++) {
+    program_update_plan(program);
+  }
+  double full_ns = (now_ns() - start)/REPEATS;
+  start = now_ns();
+  for (int r = 0; r < REPEATS; r++) {
+    Window* w = window_new(1);
+    window_add_dep(w, program->left);
+    program_add_window(program, w);
+    program_remove_window(program, w);
+  }
+  double add_ns = (now_ns() - start)/REPEATS;
+  program_set_threads(program, 2, NULL);
+  start = now_ns();
+  for (int r = 0; r < REPEATS; r++) {
+    Window* w = window_new(1);
+    window_add_dep(w, program->left);
+    program_add_window(program, w);
+    program_remove_window(program, w);
+  }
+  double scheduled_ns = (now_ns() - start)/REPEATS;
+  program_set_threads(program, 1, NULL);
+  printf("planning: %d windows: %.2f ms to plan, %.2f us to add and remove one"
+         " (%.2f us scheduled)\n",
+         WINDOWS, full_ns/1e6, add_ns/1e3, scheduled_ns/1e3);
+}
+
+// How many oscillators one core can keep up with at 48 kHz, for the
+// oscillator bank and for a libm sin() per sample.
+void bench_osc_bank(void) {
+  enum { OSCILLATORS = 64, WINDOWS = 200 };
+  static float buf[OSCILLATORS][WINDOW_FRAMES];
+  double phases[OSCILLATORS] = {0};
+  double start = now_ns();
+  for (int w = 0; w < WINDOWS; w++) {
+    for (int j = 0; j < OSCILLATORS; j++) {
+      double step = 2*M_PI*(220 + j)/48000;
+      osc_fill(buf[j], WINDOW_FRAMES, phases[j], step, 0.1);
+      phases[j] = fmod(phases[j] + step*WINDOW_FRAMES, 2*M_PI);
+    }
+  }
+  double bank_ns = (now_ns() - start)/((double)WINDOWS*OSCILLATORS);
+  start = now_ns();
+  for (int w = 0; w < WINDOWS; w++) {
+    for (int j = 0; j < OSCILLATORS; j++) {
+      double step = 2*M_PI*(220 + j)/48000;
+      for (int i = 0; i < WINDOW_FRAMES; i++) {
+        buf[j][i] = 0.1*sin(phases[j] + i*step);
+      }
+      phases[j] = fmod(phases[j] + step*WINDOW_FRAMES, 2*M_PI);
+    }
+  }
+  double libm_ns = (now_ns() - start)/((double)WINDOWS*OSCILLATORS);
+  double window_ns = 1e9*WINDOW_FRAMES/48000;
+  printf("osc_bank: %.0f oscillators per core at 48 kHz (libm sin: %.0f)\n",
+         window_ns/bank_ns, window_ns/libm_ns);
+}
+
+int main(int argc, char *argv[]) {
+  jack_client_t *client;
+  const char **ports;
+
+  if (argc > 1 && strcmp(argv[1], "check") == 0) {
+    sr = 48000;
+    check_osc_bank();
+    check_spectral_roundtrip();
+    check_mix();
+    check_scheduler();
+    check_planning();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    sr = 48000;
+    bench_osc_bank();
+    bench_mix();
+    bench_scheduler();
+    bench_planning();
+    return 0;
+  }
+
+  if (pipe((void*)&pipes)) {
+    error ("Could not create pipe\n");
+  }
+
+  program = make_demo_program();
 
   in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * WINDOW_FRAMES);
   out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * WINDOW_FRAMES);
@@ -445,6 +1883,10 @@ int main(int argc, char *argv[]) {
   if(0 == (client = jack_client_open("clangor", JackNoStartServer, NULL))) {
     fprintf(stderr, "Cannot connect to Jack server.\n");
   }
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  program_set_threads(program, cpus < SCHEDULER_MAX_THREADS ? cpus : SCHEDULER_MAX_THREADS,
+                      client);
   
   jack_set_process_callback(client, process_program, 0);
 
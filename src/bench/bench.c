@@ -0,0 +1,117 @@
+/* Copyright 2013 Kyle Miller
+ * bench.c
+ * Timing, statistics and reporting shared by the benchmarks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "bench.h"
+
+double bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench_samples_init(BenchSamples_t *s) {
+  s->count = 0;
+  s->capacity = 1024;
+  s->ns = malloc(s->capacity * sizeof(double));
+  guard(s->ns != NULL, "Couldn't allocate benchmark samples");
+  s->ops = 0;
+  s->total_ns = 0;
+}
+
+void bench_samples_free(BenchSamples_t *s) {
+  free(s->ns);
+  s->ns = NULL;
+}
+
+void bench_record(BenchSamples_t *s, double elapsed_ns, word ops) {
+  if (s->count == s->capacity) {
+    s->capacity *= 2;
+    s->ns = realloc(s->ns, s->capacity * sizeof(double));
+    guard(s->ns != NULL, "Couldn't allocate benchmark samples");
+  }
+  s->ns[s->count++] = elapsed_ns / ops;
+  s->ops += ops;
+  s->total_ns += elapsed_ns;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// The p-th percentile of sorted samples (nearest rank)
+static double percentile(double *sorted, word count, double p) {
+  word rank = (word)(p / 100 * count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  if (rank > count) {
+    rank = count;
+  }
+  return sorted[rank - 1];
+}
+
+// Peak resident set size of the process so far, in kilobytes
+static long peak_rss_kb(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // bytes on OS X
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+void bench_report(const char *bench, const char *fields, BenchSamples_t *s) {
+  if (s->count == 0) {
+    error("Benchmark %s recorded no samples.", bench);
+  }
+  qsort(s->ns, s->count, sizeof(double), compare_doubles);
+  printf("{\"bench\": \"%s\"%s%s, \"ops\": %lu, \"ns_per_op\": %.3f, "
+         "\"p50_ns\": %.3f, \"p90_ns\": %.3f, \"p99_ns\": %.3f, \"max_ns\": %.3f, "
+         "\"peak_rss_kb\": %ld}\n",
+         bench, fields[0] != '\0' ? ", " : "", fields,
+         (unsigned long)s->ops, s->total_ns / s->ops,
+         percentile(s->ns, s->count, 50), percentile(s->ns, s->count, 90),
+         percentile(s->ns, s->count, 99), s->ns[s->count - 1],
+         peak_rss_kb());
+  fflush(stdout);
+}
+
+bool bench_selected(int argc, char *argv[], const char *bench) {
+  if (argc <= 1) {
+    return true;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], bench) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void bench_rng_seed(BenchRng_t *rng, uint64_t seed) {
+  rng->state = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+uint64_t bench_rng_next(BenchRng_t *rng) {
+  uint64_t x = rng->state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rng->state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+word bench_rng_below(BenchRng_t *rng, word n) {
+  return bench_rng_next(rng) % n;
+}
@@ -0,0 +1,51 @@
+/* Copyright 2013 Kyle Miller
+ * bench.h
+ * Timing, statistics and reporting shared by the benchmarks
+ */
+
+#ifndef clangor_bench_h
+#define clangor_bench_h
+
+#include <stdbool.h>
+#include "util.h"
+
+// Timing samples of a benchmark run.  What a sample measures is up to
+// the benchmark: usually the ns/op of a batch of operations, or the
+// length of a single pause.
+typedef struct BenchSamples_s {
+  double *ns;
+  word count;
+  word capacity;
+  word ops; // total operations over all samples
+  double total_ns; // total time over all samples
+} BenchSamples_t;
+
+// A small deterministic PRNG (xorshift64*), so runs are reproducible
+// independent of the C library.
+typedef struct BenchRng_s {
+  uint64_t state;
+} BenchRng_t;
+
+double bench_now_ns(void);
+
+void bench_samples_init(BenchSamples_t *s);
+void bench_samples_free(BenchSamples_t *s);
+// Record a sample of elapsed_ns covering the given number of
+// operations.  The stored sample is the time per operation.
+void bench_record(BenchSamples_t *s, double elapsed_ns, word ops);
+
+// Print one JSON object for the run: the benchmark name, the
+// benchmark-specific fields (a comma-separated JSON fragment, or ""),
+// ns/op, percentiles of the samples and peak RSS.
+void bench_report(const char *bench, const char *fields, BenchSamples_t *s);
+
+// Whether the benchmark of the given name was selected on the command
+// line (no arguments selects every benchmark).
+bool bench_selected(int argc, char *argv[], const char *bench);
+
+void bench_rng_seed(BenchRng_t *rng, uint64_t seed);
+uint64_t bench_rng_next(BenchRng_t *rng);
+// A number uniformly in [0, n)
+word bench_rng_below(BenchRng_t *rng, word n);
+
+#endif
@@ -0,0 +1,159 @@
+/* Copyright 2013 Kyle Miller
+ * bench_blocks.c
+ * Microbenchmarks of the block allocator
+ *
+ * Usage: bench_blocks [benchmark ...]
+ * Prints one JSON object per line per benchmark.
+ */
+
+#include <stdio.h>
+#include "blocks.h"
+#include "bench.h"
+
+// Operations per timing sample
+#define BATCH 1024
+// Timing samples per benchmark (after one warm-up batch)
+#define SAMPLES 2000
+
+// Allocate and free single blocks, keeping a small window of them
+// live so that the allocator can't simply hand back the block that
+// was just freed.
+static void bench_block_churn(bool cached) {
+  enum { WINDOW = 64 };
+  init_free_lists();
+  if (cached) {
+    attach_block_cache();
+  }
+  Blockinfo_t *window[WINDOW];
+  for (int i = 0; i < WINDOW; i++) {
+    window[i] = alloc_group(1);
+  }
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  word next = 0;
+  for (int sample = -1; sample < SAMPLES; sample++) {
+    double start = bench_now_ns();
+    for (int i = 0; i < BATCH; i++, next = (next + 1) % WINDOW) {
+      free_group(window[next]);
+      window[next] = alloc_group(1);
+    }
+    if (sample >= 0) {
+      bench_record(&s, bench_now_ns() - start, BATCH);
+    }
+  }
+  for (int i = 0; i < WINDOW; i++) {
+    free_group(window[i]);
+  }
+  if (cached) {
+    flush_block_cache();
+  }
+  bench_report("block_churn", cached ? "\"cached\": 1" : "\"cached\": 0", &s);
+  bench_samples_free(&s);
+}
+
+// A group size drawn from a distribution skewed towards small groups,
+// like a heap of mostly small objects with some larger ones.
+static word mixed_group_size(BenchRng_t *rng) {
+  word r = bench_rng_below(rng, 100);
+  if (r < 70) {
+    return 1;
+  } else if (r < 90) {
+    return 2 + bench_rng_below(rng, 7);
+  } else {
+    return 9 + bench_rng_below(rng, 120);
+  }
+}
+
+// Replace randomly chosen groups from a large pool of groups of mixed
+// sizes, exercising splitting and coalescing.
+static void bench_mixed_groups(void) {
+  enum { POOL = 4096 };
+  static Blockinfo_t *pool[POOL];
+  init_free_lists();
+  BenchRng_t rng;
+  bench_rng_seed(&rng, 1);
+  for (int i = 0; i < POOL; i++) {
+    pool[i] = alloc_group(mixed_group_size(&rng));
+  }
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int sample = -1; sample < SAMPLES; sample++) {
+    double start = bench_now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      word j = bench_rng_below(&rng, POOL);
+      free_group(pool[j]);
+      pool[j] = alloc_group(mixed_group_size(&rng));
+    }
+    if (sample >= 0) {
+      bench_record(&s, bench_now_ns() - start, BATCH);
+    }
+  }
+  for (int i = 0; i < POOL; i++) {
+    free_group(pool[i]);
+  }
+  bench_report("mixed_groups", "", &s);
+  bench_samples_free(&s);
+}
+
+// Replace randomly chosen megagroups of 1 to 16 megablocks.  Also
+// reports how many megablocks had to be mapped, as a measure of
+// fragmentation.
+static void bench_megagroup_fragmentation(void) {
+  enum { POOL = 64, MEGA_SAMPLES = 200 };
+  Blockinfo_t *pool[POOL];
+  init_free_lists();
+  BenchRng_t rng;
+  bench_rng_seed(&rng, 2);
+  word live = 0, peak_live = 0;
+  word sizes[POOL];
+  for (int i = 0; i < POOL; i++) {
+    sizes[i] = 1 + bench_rng_below(&rng, 16);
+    pool[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(sizes[i]));
+    live += sizes[i];
+  }
+  peak_live = live;
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int sample = -1; sample < MEGA_SAMPLES; sample++) {
+    double start = bench_now_ns();
+    for (int i = 0; i < BATCH; i++) {
+      word j = bench_rng_below(&rng, POOL);
+      free_group(pool[j]);
+      live -= sizes[j];
+      sizes[j] = 1 + bench_rng_below(&rng, 16);
+      pool[j] = alloc_group(MEGABLOCKS_TO_BLOCKS(sizes[j]));
+      live += sizes[j];
+      if (live > peak_live) {
+        peak_live = live;
+      }
+    }
+    if (sample >= 0) {
+      bench_record(&s, bench_now_ns() - start, BATCH);
+    }
+  }
+  MegablockStats_t stats;
+  get_megablock_stats(&stats);
+  for (int i = 0; i < POOL; i++) {
+    free_group(pool[i]);
+  }
+  char fields[128];
+  snprintf(fields, sizeof(fields),
+           "\"peak_live_megablocks\": %lu, \"mapped_megablocks\": %lu",
+           (unsigned long)peak_live, (unsigned long)stats.mapped_megablocks);
+  bench_report("megagroup_fragmentation", fields, &s);
+  bench_samples_free(&s);
+}
+
+int main(int argc, char *argv[]) {
+  if (bench_selected(argc, argv, "block_churn")) {
+    bench_block_churn(false);
+    bench_block_churn(true);
+  }
+  if (bench_selected(argc, argv, "mixed_groups")) {
+    bench_mixed_groups();
+  }
+  if (bench_selected(argc, argv, "megagroup_fragmentation")) {
+    bench_megagroup_fragmentation();
+  }
+  return 0;
+}
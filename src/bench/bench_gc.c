@@ -0,0 +1,279 @@
+/* Copyright 2013 Kyle Miller
+ * bench_gc.c
+ * Microbenchmarks of object allocation and garbage collection
+ *
+ * Usage: bench_gc [benchmark ...]
+ * Prints one JSON object per line per benchmark configuration.  Peak
+ * RSS is for the whole process so far, so within a benchmark the
+ * configurations with smaller heaps go first.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "gc.h"
+#include "bench.h"
+
+// Objects allocated per timing sample of alloc_obj
+#define ALLOC_BATCH 4096
+// Timing samples per alloc_obj configuration
+#define ALLOC_SAMPLES 2000
+// Collections timed per GC pause configuration
+#define PAUSES 50
+
+// A cons cell holding a non-pointer value and a pointer to the next cell
+static ObjDef_t cons_def = {.type = OBJ_TYPE_STD, .length = 2, .bitmap = 2};
+
+// The throughput of allocating objects of a given size which all die
+// young, including the (cheap) collections of the nursery.
+static void bench_alloc_obj(word size) {
+  ObjDef_t leaf_def = {.type = OBJ_TYPE_STD,
+                       .length = (size - OBJ_HEADER_SIZE) / sizeof(Obj_t *), .bitmap = 0};
+  init_free_lists();
+  init_generations(default_generation_config);
+  init_nurseries(1);
+  Nursery_t *nursery = get_nursery(0);
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int sample = -1; sample < ALLOC_SAMPLES; sample++) {
+    double start = bench_now_ns();
+    for (int i = 0; i < ALLOC_BATCH; i++) {
+      Obj_t *o = alloc_obj(nursery, size);
+      o->def = &leaf_def;
+      o->link = NULL;
+    }
+    if (sample >= 0) {
+      bench_record(&s, bench_now_ns() - start, ALLOC_BATCH);
+    }
+  }
+  char fields[64];
+  snprintf(fields, sizeof(fields), "\"object_bytes\": %lu", (unsigned long)size);
+  bench_report("alloc_obj", fields, &s);
+  bench_samples_free(&s);
+}
+
+// Pause times of collections with a rooted list of live_cells cons
+// cells, with half a nursery of garbage allocated between
+// collections.  With a single generation every collection copies the
+// whole live heap; with the default generations the live list is
+// promoted and most collections only touch the nursery.  With
+// slice_words set or background on, each pause is a gc_slice instead,
+// and the oldest generation is always being collected incrementally
+// (by the background thread, with background on).
+static void bench_gc_pause(int *generation_config, const char *config_name,
+                           word live_cells, int gc_threads, word slice_words,
+                           bool background) {
+  init_free_lists();
+  init_generations(generation_config);
+  init_nurseries(1);
+  init_gc_threads(gc_threads);
+  Nursery_t *nursery = get_nursery(0);
+  Obj_t *list = NULL;
+  gc_add_root(&list);
+  for (word i = 0; i < live_cells; i++) {
+    Obj_t *cell = alloc_obj(nursery, OBJ_STD_SIZE(2));
+    cell->def = &cons_def;
+    cell->link = NULL;
+    cell->payload.obj.data[0] = (Obj_t *)i;
+    cell->payload.obj.data[1] = list;
+    list = cell;
+  }
+  garbage_collect();
+  Generation_t *oldest = &generations[0];
+  while (oldest->to_gen != NULL) {
+    oldest = oldest->to_gen;
+  }
+  set_gc_slice_words(slice_words);
+  set_gc_background(background);
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int pause = 0; pause < PAUSES; pause++) {
+    for (word i = 0; i < NURSERY_BLOCKS * BLOCK_SIZE / 2 / OBJ_STD_SIZE(2); i++) {
+      Obj_t *o = alloc_obj(nursery, OBJ_STD_SIZE(2));
+      o->def = &cons_def;
+      o->link = NULL;
+      o->payload.obj.data[1] = NULL;
+    }
+    double start = bench_now_ns();
+    if (slice_words != 0 || background) {
+      oldest->n_max_blocks = 0;
+      gc_slice();
+    } else {
+      garbage_collect();
+    }
+    bench_record(&s, bench_now_ns() - start, 1);
+  }
+  set_gc_slice_words(0);
+  set_gc_background(false);
+  gc_remove_root(&list);
+  char fields[160];
+  snprintf(fields, sizeof(fields),
+           "\"generations\": \"%s\", \"gc_threads\": %d, \"live_bytes\": %lu",
+           config_name, gc_threads, (unsigned long)(live_cells * OBJ_STD_SIZE(2)));
+  bench_report("gc_pause", fields, &s);
+  bench_samples_free(&s);
+}
+
+// The number of fields of an object with a size drawn from a mix of
+// mostly small and some mid-sized objects (16 to 1024 bytes).
+static word mixed_object_fields(BenchRng_t *rng) {
+  word r = bench_rng_below(rng, 100);
+  if (r < 70) {
+    return bench_rng_below(rng, 7);
+  } else if (r < 95) {
+    return 7 + bench_rng_below(rng, 24);
+  } else {
+    return 31 + bench_rng_below(rng, 96);
+  }
+}
+
+// Objects of mixed sizes live in the oldest generation, and a quarter
+// of them are replaced before each collection of it.  Reports how
+// densely the oldest generation holds its live data, and the time per
+// object to visit them all after each collection.
+static void bench_old_gen_density(void) {
+  enum { OBJECTS = 1 << 15, ROUNDS = 20 };
+  static ObjDef_t leaf_defs[127];
+  static word sizes[OBJECTS];
+  for (word n = 0; n < 127; n++) {
+    leaf_defs[n] = (ObjDef_t){.type = OBJ_TYPE_STD, .length = n, .bitmap = 0};
+  }
+  init_free_lists();
+  init_generations(default_generation_config);
+  init_nurseries(1);
+  Nursery_t *nursery = get_nursery(0);
+  Generation_t *oldest = &generations[0];
+  while (oldest->to_gen != NULL) {
+    oldest = oldest->to_gen;
+  }
+  BenchRng_t rng;
+  bench_rng_seed(&rng, 3);
+  ObjDef_t table_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 1};
+  Obj_t *table = NULL;
+  gc_add_root(&table);
+  table = alloc_obj(nursery, OBJ_ARRAY_SIZE(OBJECTS));
+  table->def = &table_def;
+  table->link = NULL;
+  table->payload.array.length = OBJECTS;
+  memset(table->payload.array.data, 0, OBJECTS * sizeof(Obj_t *));
+  word live_bytes = 0;
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int round = 0; round < ROUNDS; round++) {
+    for (word i = 0; i < (round == 0 ? OBJECTS : OBJECTS / 4); i++) {
+      word j = round == 0 ? i : bench_rng_below(&rng, OBJECTS);
+      word fields = mixed_object_fields(&rng);
+      Obj_t *o = alloc_obj(nursery, OBJ_STD_SIZE(fields));
+      o->def = &leaf_defs[fields];
+      o->link = NULL;
+      gc_write_field(table, j, o);
+      live_bytes += OBJ_STD_SIZE(fields) - sizes[j];
+      sizes[j] = OBJ_STD_SIZE(fields);
+    }
+    for (Generation_t *gen = &generations[0]; gen != NULL; gen = gen->to_gen) {
+      gen->n_max_blocks = 0;
+    }
+    garbage_collect();
+    double start = bench_now_ns();
+    word sum = 0;
+    for (word i = 0; i < OBJECTS; i++) {
+      sum += table->payload.array.data[i]->def->length;
+    }
+    bench_record(&s, bench_now_ns() - start, OBJECTS);
+    guard(sum > 0, "Objects were lost");
+  }
+  gc_remove_root(&table);
+  char fields[160];
+  snprintf(fields, sizeof(fields),
+           "\"live_bytes\": %lu, \"oldest_blocks\": %lu, \"density\": %.3f",
+           (unsigned long)live_bytes, (unsigned long)oldest->n_blocks,
+           (double)live_bytes / (oldest->n_blocks * BLOCK_SIZE));
+  bench_report("old_gen_density", fields, &s);
+  bench_samples_free(&s);
+}
+
+// The time per live object of collections which copy a heap of
+// objects of one shape, each of FIELDS entries and reachable from a
+// rooted table, with the Objs among their entries pointing at random
+// earlier objects.
+static void bench_scavenge(const char *shape, ObjDef_t *def) {
+  enum { OBJECTS = 1 << 16, FIELDS = 16, COLLECTIONS = 20 };
+  int single_config[] = {1, 0};
+  init_free_lists();
+  init_generations(single_config);
+  init_nurseries(1);
+  Nursery_t *nursery = get_nursery(0);
+  BenchRng_t rng;
+  bench_rng_seed(&rng, 5);
+  ObjDef_t table_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 1};
+  Obj_t *table = NULL;
+  gc_add_root(&table);
+  table = alloc_obj(nursery, OBJ_ARRAY_SIZE(OBJECTS));
+  table->def = &table_def;
+  table->link = NULL;
+  table->payload.array.length = OBJECTS;
+  memset(table->payload.array.data, 0, OBJECTS * sizeof(Obj_t *));
+  bool array = def->type == OBJ_TYPE_ARRAY;
+  for (word i = 0; i < OBJECTS; i++) {
+    Obj_t *o = alloc_obj(nursery, array ? OBJ_ARRAY_SIZE(FIELDS) : OBJ_STD_SIZE(FIELDS));
+    o->def = def;
+    o->link = NULL;
+    Obj_t **data = o->payload.obj.data;
+    if (array) {
+      o->payload.array.length = FIELDS;
+      data = o->payload.array.data;
+    }
+    for (word f = 0; f < FIELDS; f++) {
+      data[f] = !obj_entry_is_obj(def, f) ? (Obj_t *)f
+        : i == 0 ? NULL : table->payload.array.data[bench_rng_below(&rng, i)];
+    }
+    table->payload.array.data[i] = o;
+  }
+  BenchSamples_t s;
+  bench_samples_init(&s);
+  for (int c = 0; c < COLLECTIONS; c++) {
+    double start = bench_now_ns();
+    garbage_collect();
+    bench_record(&s, bench_now_ns() - start, OBJECTS);
+  }
+  gc_remove_root(&table);
+  char fields[64];
+  snprintf(fields, sizeof(fields), "\"shape\": \"%s\"", shape);
+  bench_report("scavenge", fields, &s);
+  bench_samples_free(&s);
+}
+
+int main(int argc, char *argv[]) {
+  if (bench_selected(argc, argv, "alloc_obj")) {
+    word sizes[] = {16, 32, 64, 128, 256, 1024};
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      bench_alloc_obj(sizes[i]);
+    }
+  }
+  if (bench_selected(argc, argv, "old_gen_density")) {
+    bench_old_gen_density();
+  }
+  if (bench_selected(argc, argv, "scavenge")) {
+    ObjDef_t record_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 0};
+    ObjDef_t std_def = {.type = OBJ_TYPE_STD, .length = 16, .bitmap = 1 | 1 << 7 | 1 << 15};
+    ObjDef_t ptr_array_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 1};
+    bench_scavenge("record", &record_def);
+    bench_scavenge("std", &std_def);
+    bench_scavenge("pointer_array", &ptr_array_def);
+  }
+  if (bench_selected(argc, argv, "gc_pause")) {
+    int single_config[] = {1, 0};
+    word live[] = {1 << 12, 1 << 15, 1 << 18, 1 << 20};
+    // init_gc_threads can only add threads, so the single-threaded
+    // configurations go first.
+    int threads[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+      for (int i = 0; i < sizeof(live) / sizeof(live[0]); i++) {
+        bench_gc_pause(single_config, "single", live[i], threads[t], 0, false);
+        bench_gc_pause(default_generation_config, "default", live[i], threads[t], 0, false);
+        bench_gc_pause(default_generation_config, "incremental", live[i], threads[t], 1 << 12, false);
+        bench_gc_pause(default_generation_config, "background", live[i], threads[t], 0, true);
+      }
+    }
+  }
+  return 0;
+}
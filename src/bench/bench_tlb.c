@@ -0,0 +1,111 @@
+/* Copyright 2013 Kyle Miller
+ * bench_tlb.c
+ * Compares TLB misses of a random walk over a megablock heap with and
+ * without transparent huge pages.
+ *
+ * Usage: bench_tlb [--huge-pages] [heap-megablocks]
+ * Prints one JSON object per line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "blocks.h"
+
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+// Number of steps of the random walk
+#define STEPS (1 << 24)
+
+// Keeps the walk from being optimized away
+static void * volatile sink;
+
+// Open a counter of data TLB load misses for this thread, or -1.
+static int open_dtlb_counter(void) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+  bool huge = argc > 1 && strcmp(argv[1], "--huge-pages") == 0;
+  word megablocks = argc > 1 + huge ? strtoul(argv[1 + huge], NULL, 10) : 512;
+
+  init_free_lists();
+  set_megablock_huge_pages(huge);
+  Blockinfo_t *heap = alloc_group(MEGABLOCKS_TO_BLOCKS(megablocks));
+
+  // Link one word per block into a single random cycle, so each step
+  // lands on a different page.
+  word n = heap->blocks;
+  word *order = malloc(n * sizeof(word));
+  for (word i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  srand(22);
+  for (word i = n - 1; i > 0; i--) {
+    word j = rand() % (i + 1);
+    word t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for (word i = 0; i < n; i++) {
+    void **from = (void **)((uint8_t *)heap->start + order[i] * BLOCK_SIZE);
+    *from = (uint8_t *)heap->start + order[(i + 1) % n] * BLOCK_SIZE;
+  }
+  free(order);
+
+  int fd = open_dtlb_counter();
+  long long misses = -1;
+  void **p = heap->start;
+  double start = now_ns();
+#ifdef __linux__
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  for (word i = 0; i < STEPS; i++) {
+    p = *p;
+  }
+#ifdef __linux__
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = -1;
+    }
+  }
+#endif
+  double elapsed = now_ns() - start;
+  sink = p;
+
+  printf("{\"bench\": \"tlb_walk\", \"huge_pages\": %d, \"heap_megablocks\": %lu, "
+         "\"ns_per_op\": %.3f, \"dtlb_misses_per_op\": %.4f}\n",
+         huge, (unsigned long)megablocks, elapsed / STEPS,
+         misses < 0 ? -1.0 : (double)misses / STEPS);
+  return 0;
+}
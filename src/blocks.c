@@ -9,99 +9,262 @@
  */
 
 #include <sys/mman.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include "blocks.h"
 
+#ifndef MAP_NORESERVE
+# define MAP_NORESERVE 0
+#endif
+
+#ifdef __linux__
+# include <unistd.h>
+# include <sys/syscall.h>
+// From linux/mempolicy.h, to avoid depending on libnuma
+# define MPOL_PREFERRED 1
+# define MPOL_MF_MOVE (1 << 1)
+# define NUMA_MAX_NODES 1024
+#endif
+
 // Free lists
 
-static Blockinfo_t *free_megablock_list;
+// Free megagroups are binned by their number of megablocks: bin n < 
+// MEGA_EXACT_BINS holds groups of exactly n megablocks, and the bins
+// after those hold groups of 2^i to 2^{i+1}-1 megablocks for i >=
+// MEGA_EXACT_BINS_LG.  The exact bins are doubly linked through
+// link/back.  The other bins are treaps ordered by size (then
+// address), with link and back as the left and right children and a
+// hash of the address as the priority, so that the best fit in a bin
+// is found in logarithmic time.
+#define MEGA_EXACT_BINS_LG 6
+#define MEGA_EXACT_BINS (1 << MEGA_EXACT_BINS_LG)
+#define MEGA_BINS (MEGA_EXACT_BINS + 8 * sizeof(word) - MEGA_EXACT_BINS_LG)
+#define MEGA_BINS_WORDS ((MEGA_BINS + 63) / 64)
+static Blockinfo_t *free_megablock_bins[MEGA_BINS];
+// Bit i of this bitmap is set iff free_megablock_bins[i] is non-empty.
+static uint64_t free_megablock_bins_nonempty[MEGA_BINS_WORDS];
+
+// The megablock map gives, for the first and last megablock of each
+// free megagroup, the head of that megagroup, so neighbours can be
+// found in constant time when coalescing.  It is a two-level table
+// over the address space whose leaves are mmapped on demand.
+#define MEGABLOCK_MAP_BITS (48 - MEGABLOCK_SIZE_LG)
+#define MEGABLOCK_MAP_LEAF_BITS (MEGABLOCK_MAP_BITS / 2)
+#define MEGABLOCK_MAP_ROOT_BITS (MEGABLOCK_MAP_BITS - MEGABLOCK_MAP_LEAF_BITS)
+static Blockinfo_t **megablock_map[1 << MEGABLOCK_MAP_ROOT_BITS];
+
+// Fresh megablocks are committed from a range of RESERVATION_SIZE
+// bytes of address space reserved in one go, so that heap growth is
+// usually one mprotect rather than an mmap and two munmaps.
+#define RESERVATION_SIZE ((word)1 << RESERVATION_SIZE_LG)
+static bool reserve_megablocks = true;
+static void *reservation_next; // first uncommitted byte of the reservation
+static void *reservation_end;
+
+// Whether megablock memory is advised to be backed by transparent
+// huge pages
+#define HUGE_PAGE_SIZE ((word)1 << HUGE_PAGE_SIZE_LG)
+static bool huge_pages = false;
+
+static inline
+void advise_huge_pages(void *start, word size) {
+#ifdef MADV_HUGEPAGE
+  // Only advice, so failure (e.g. THP being disabled) is fine.
+  madvise(start, size, MADV_HUGEPAGE);
+#endif
+}
+
+// Megablock accounting (see MegablockStats_t)
+static MegablockStats_t megablock_stats;
+// Free megablocks beyond this many are returned to the OS by
+// release_free_megablocks.
+static word megablock_retention = (word)-1;
 
 #define FREE_LIST_SIZE  (MEGABLOCK_SIZE_LG - BLOCK_SIZE_LG + 1)
 // free_block_list[i] holds blocks of size 2^i to 2^{i+1}-1.
 static Blockinfo_t *free_block_list[FREE_LIST_SIZE];
-
-// Initialize the megablock and block free lists
+// Bit i is set when free_block_list[i] is non-empty.
+static word free_block_list_nonempty;
+
+// Protects the free lists
+static pthread_mutex_t free_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per-thread caches of free groups of up to BLOCK_CACHE_MAX_BLOCKS
+// blocks, so that most small allocations don't take free_list_lock.
+// Cached groups are not marked free, so they are not coalesced until
+// they are flushed back to the free lists.
+#define BLOCK_CACHE_MAX_BLOCKS 4
+// Most groups of each size a cache holds
+#define BLOCK_CACHE_SIZE 32
+// Number of groups moved between a cache and the free lists at once
+#define BLOCK_CACHE_BATCH 16
+
+typedef struct BlockCache_s {
+  bool attached;
+  word count[BLOCK_CACHE_MAX_BLOCKS];
+  Blockinfo_t *groups[BLOCK_CACHE_MAX_BLOCKS]; // groups[i] has i+1 blocks
+} BlockCache_t;
+
+static __thread BlockCache_t block_cache;
+
+static Blockinfo_t *alloc_group_nolock(word blocks);
+static void free_group_nolock(Blockinfo_t *blockinfo);
+
+// Initialize the megablock and block free lists.  This drops the
+// calling thread's block cache.
 void init_free_lists(void) {
-  free_megablock_list = NULL;
-  for (int i = 0; i < FREE_LIST_SIZE; i++) {
-    free_block_list[i] = NULL;
+  for (int i = 0; i < MEGA_BINS; i++) {
+    free_megablock_bins[i] = NULL;
   }
-}
-
-// Remove a block from a list, double-linked.
-static
-void list_unlink_blockinfo(Blockinfo_t *removed, Blockinfo_t **list) {
-  if (removed->back != NULL) {
-    removed->back->link = removed->link;
-  } else {
-    // otherwise 'removed' was the beginning of the list
-    *list = removed->link;
+  for (int i = 0; i < MEGA_BINS_WORDS; i++) {
+    free_megablock_bins_nonempty[i] = 0;
   }
-  if (removed->link != NULL) {
-    removed->link->back = removed->back;
+  for (int i = 0; i < (1 << MEGABLOCK_MAP_ROOT_BITS); i++) {
+    if (megablock_map[i] != NULL) {
+      memset(megablock_map[i], 0, sizeof(Blockinfo_t *) << MEGABLOCK_MAP_LEAF_BITS);
+    }
   }
-}
-
-// Add a block to the front of a list, double-linked.
-static
-void list_link_blockinfo(Blockinfo_t *added, Blockinfo_t **list) {
-  added->link = *list;
-  added->back = NULL;
-  if (*list != NULL) {
-    (*list)->back = added;
+  for (int i = 0; i < FREE_LIST_SIZE; i++) {
+    free_block_list[i] = NULL;
   }
-  *list = added;
+  free_block_list_nonempty = 0;
+  block_cache = (BlockCache_t){0};
+  megablock_stats.free_megablocks = 0;
+  megablock_stats.free_blocks = 0;
 }
 
-// Compute floor(log2(n)).  Used for finding in which free list to
-// store a block.
+// Compute floor(log2(n)) for n > 0.  Used for finding in which free
+// list to store a block.
 static inline
 word log2_floor(word n) {
-  word i;
-  for (i = -1; n != 0; n >>= 1, i++)
-    ;
-  return i;
+  return 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(n);
 }
-// Compute ceil(log2(n)). Used for finding in which free list to place
-// a free block.
+// Compute ceil(log2(n)) for n > 0. Used for finding in which free list
+// to place a free block.
 static inline
 word log2_ceil(word n) {
-  word i, x;
-  for (x = 1, i = 0; x < n; x <<= 1, i++)
-    ;
-  return i;
+  return n <= 1 ? 0 : log2_floor(n - 1) + 1;
 }
 
+// Add a free group to the free list for its size.
+static inline
+void link_free_group(Blockinfo_t *blockinfo) {
+  word i = log2_floor(blockinfo->blocks);
+  assert(i < FREE_LIST_SIZE, "Block group is too big for free list.");
+  list_link_blockinfo(blockinfo, &free_block_list[i]);
+  free_block_list_nonempty |= (word)1 << i;
+  megablock_stats.free_blocks += blockinfo->blocks;
+}
 
-// Allocate some number of raw megablocks at the megablock-size
-// boundary.  The technique is to allocate one more megablock than
-// required and then munmap-ing the slop.  This function shouldn't be
-// confused with alloc_megagroup.
+// Remove a free group from the free list for its size.  Must be
+// called before the size of the group changes.
+static inline
+void unlink_free_group(Blockinfo_t *blockinfo) {
+  word i = log2_floor(blockinfo->blocks);
+  list_unlink_blockinfo(blockinfo, &free_block_list[i]);
+  if (free_block_list[i] == NULL) {
+    free_block_list_nonempty &= ~((word)1 << i);
+  }
+  megablock_stats.free_blocks -= blockinfo->blocks;
+}
+
+
+// Map some memory at an alignment boundary (a multiple of
+// MEGABLOCK_SIZE).  The technique is to map one more alignment's worth
+// than required and then munmap-ing the slop.
 static
-Megablock_t *alloc_megablocks(word n_megablocks) {
-  word size = MEGABLOCK_SIZE * n_megablocks;
-  // Allocate one more megablock than expected so we can ensure alignment
-  void *ptr = mmap(NULL, size + MEGABLOCK_SIZE,
-                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+void *map_aligned(word size, word align, int prot, int flags) {
+  // Allocate one more alignment than expected so we can ensure alignment
+  void *ptr = mmap(NULL, size + align,
+                   prot, MAP_PRIVATE | MAP_ANONYMOUS | flags,
                    -1, 0);
   if (ptr == MAP_FAILED) {
-    error("alloc_megablocks unable to allocate blocks using mmap");
+    error("map_aligned unable to allocate blocks using mmap");
   }
-  word slop = (word)ptr & ~MEGABLOCK_MASK;
+  word slop = (word)ptr & (align - 1);
   if (slop == 0) {
-    slop += MEGABLOCK_SIZE;
+    slop += align;
+  }
+  if (align - slop > 0 && munmap(ptr, align - slop) == -1) {
+    error("map_aligned unable to unmap pre-slop");
+  }
+  if (munmap(ptr + size + align - slop, slop) == -1) {
+    error("map_aligned unable to unmap post-slop");
+  }
+  void *res = ptr + align - slop;
+  assert(0 == ((word)res & (align - 1)),
+         "map_aligned made misaligned megablock.");
+  if (huge_pages) {
+    advise_huge_pages(res, size);
+  }
+  return res;
+}
+
+// Unmap whatever is left of the current reservation.
+static
+void drop_reservation(void) {
+  if (reservation_next != reservation_end
+      && munmap(reservation_next, (word)reservation_end - (word)reservation_next) == -1) {
+    error("drop_reservation unable to unmap the rest of a reservation");
   }
-  if (MEGABLOCK_SIZE - slop > 0 && munmap(ptr, MEGABLOCK_SIZE - slop) == -1) {
-    error("alloc_megablocks unable to unmap pre-slop");
+  megablock_stats.reserved_megablocks -=
+    ((word)reservation_end - (word)reservation_next) >> MEGABLOCK_SIZE_LG;
+  reservation_next = reservation_end = NULL;
+}
+
+// Commit megablocks from the current reservation, reserving a fresh
+// range when it runs out.  Returns NULL if the request is too big for
+// a reservation.
+static
+Megablock_t *commit_megablocks(word n_megablocks) {
+  word size = MEGABLOCK_SIZE * n_megablocks;
+  if (size > RESERVATION_SIZE) {
+    return NULL;
+  }
+  if ((word)reservation_end - (word)reservation_next < size) {
+    drop_reservation();
+    // Huge pages need the reservation aligned to them.
+    word align = huge_pages && HUGE_PAGE_SIZE > MEGABLOCK_SIZE ? HUGE_PAGE_SIZE : MEGABLOCK_SIZE;
+    reservation_next = map_aligned(RESERVATION_SIZE, align, PROT_NONE, MAP_NORESERVE);
+    reservation_end = reservation_next + RESERVATION_SIZE;
+    megablock_stats.reserved_megablocks += RESERVATION_SIZE >> MEGABLOCK_SIZE_LG;
+  }
+  Megablock_t *res = reservation_next;
+  if (mprotect(res, size, PROT_READ | PROT_WRITE) == -1) {
+    error("commit_megablocks unable to commit megablocks");
+  }
+  reservation_next += size;
+  megablock_stats.reserved_megablocks -= n_megablocks;
+  return res;
+}
+
+// Allocate some number of raw megablocks at the megablock-size
+// boundary, from the reservation if reserve_megablocks is set.  This
+// function shouldn't be confused with alloc_megagroup.
+static
+Megablock_t *alloc_megablocks(word n_megablocks) {
+  Megablock_t *res = NULL;
+  if (reserve_megablocks) {
+    res = commit_megablocks(n_megablocks);
   }
-  if (munmap(ptr + size + MEGABLOCK_SIZE - slop, slop) == -1) {
-    error("alloc_megablocks unable to unmap post-slop");
+  if (res == NULL) {
+    res = map_aligned(MEGABLOCK_SIZE * n_megablocks, MEGABLOCK_SIZE, PROT_READ | PROT_WRITE, 0);
   }
-  void *res = ptr + MEGABLOCK_SIZE - slop;
-  assert(0 == ((word)res & ~MEGABLOCK_MASK),
-         "alloc_megablocks made misaligned megablock.");
+  megablock_stats.mapped_megablocks += n_megablocks;
   return res;
 }
 
+// Give some megablocks back to the OS.
+static
+void free_megablocks(Megablock_t *megablock, word n_megablocks) {
+  if (munmap(megablock, MEGABLOCK_SIZE * n_megablocks) == -1) {
+    error("free_megablocks unable to unmap megablocks");
+  }
+  megablock_stats.mapped_megablocks -= n_megablocks;
+  megablock_stats.returned_megablocks += n_megablocks;
+}
+
 // Initialize the Blockinfo.start's of the megablock.
 static inline
 void init_megablock(Megablock_t *megablock) {
@@ -132,43 +295,242 @@ static inline
 void init_group(Blockinfo_t *blockinfo) {
   blockinfo->free_ptr = blockinfo->start;
   blockinfo->link = NULL;
+  blockinfo->flags = 0;
   fix_group_tail(blockinfo);
 }
 
-// Allocate some group of megablocks from the freelist (if possible),
-// otherwise allocates fresh megablocks.
+// The bin for free megagroups of the given number of megablocks
+static inline
+word megagroup_bin(word megablocks) {
+  if (megablocks < MEGA_EXACT_BINS) {
+    return megablocks;
+  }
+  return MEGA_EXACT_BINS + log2_floor(megablocks) - MEGA_EXACT_BINS_LG;
+}
+
+// The first non-empty bin at or after the given bin, or MEGA_BINS.
+static inline
+word next_nonempty_megagroup_bin(word bin) {
+  for (word w = bin / 64; w < MEGA_BINS_WORDS; w++) {
+    uint64_t bits = free_megablock_bins_nonempty[w];
+    if (w == bin / 64) {
+      bits &= ~(uint64_t)0 << (bin % 64);
+    }
+    if (bits != 0) {
+      return w * 64 + __builtin_ctzll(bits);
+    }
+  }
+  return MEGA_BINS;
+}
+
+// The last non-empty bin, or MEGA_BINS if all are empty.
+static inline
+word last_nonempty_megagroup_bin(void) {
+  for (word w = MEGA_BINS_WORDS; w > 0; w--) {
+    uint64_t bits = free_megablock_bins_nonempty[w - 1];
+    if (bits != 0) {
+      return (w - 1) * 64 + 63 - __builtin_clzll(bits);
+    }
+  }
+  return MEGA_BINS;
+}
+
+// The megablock map slot for a megablock, or NULL if its leaf doesn't
+// exist and create is false.
+static
+Blockinfo_t **megablock_map_slot(Megablock_t *megablock, bool create) {
+  word index = (word)megablock >> MEGABLOCK_SIZE_LG;
+  if (index >> MEGABLOCK_MAP_BITS != 0) {
+    guard(!create, "Megablock is outside the megablock map");
+    return NULL;
+  }
+  word root = index >> MEGABLOCK_MAP_LEAF_BITS;
+  if (megablock_map[root] == NULL) {
+    if (!create) {
+      return NULL;
+    }
+    void *leaf = mmap(NULL, sizeof(Blockinfo_t *) << MEGABLOCK_MAP_LEAF_BITS,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (leaf == MAP_FAILED) {
+      error("megablock_map_slot unable to allocate map leaf using mmap");
+    }
+    megablock_map[root] = leaf;
+  }
+  return &megablock_map[root][index & ((1 << MEGABLOCK_MAP_LEAF_BITS) - 1)];
+}
+
+// The free megagroup whose first or last megablock is the given
+// megablock, if any.
+static inline
+Blockinfo_t *megablock_map_lookup(Megablock_t *megablock) {
+  Blockinfo_t **slot = megablock_map_slot(megablock, false);
+  return slot == NULL ? NULL : *slot;
+}
+
+// Whether a comes before b in a megagroup treap
+static inline
+bool megagroup_before(Blockinfo_t *a, Blockinfo_t *b) {
+  return a->blocks < b->blocks || (a->blocks == b->blocks && a < b);
+}
+
+static inline
+word megagroup_priority(Blockinfo_t *blockinfo) {
+  return ((word)blockinfo >> MEGABLOCK_SIZE_LG) * 0x9e3779b97f4a7c15;
+}
+
+// Split a treap into the groups before key and the rest.
+static
+void megagroup_treap_split(Blockinfo_t *root, Blockinfo_t *key,
+                           Blockinfo_t **before, Blockinfo_t **after) {
+  if (root == NULL) {
+    *before = *after = NULL;
+  } else if (megagroup_before(root, key)) {
+    megagroup_treap_split(root->back, key, &root->back, after);
+    *before = root;
+  } else {
+    megagroup_treap_split(root->link, key, before, &root->link);
+    *after = root;
+  }
+}
+
+// Join two treaps, every group of the first coming before the second.
+static
+Blockinfo_t *megagroup_treap_merge(Blockinfo_t *before, Blockinfo_t *after) {
+  if (before == NULL) {
+    return after;
+  } else if (after == NULL) {
+    return before;
+  } else if (megagroup_priority(before) > megagroup_priority(after)) {
+    before->back = megagroup_treap_merge(before->back, after);
+    return before;
+  } else {
+    after->link = megagroup_treap_merge(before, after->link);
+    return after;
+  }
+}
+
+static
+Blockinfo_t *megagroup_treap_insert(Blockinfo_t *root, Blockinfo_t *added) {
+  if (root == NULL || megagroup_priority(added) > megagroup_priority(root)) {
+    megagroup_treap_split(root, added, &added->link, &added->back);
+    return added;
+  }
+  if (megagroup_before(added, root)) {
+    root->link = megagroup_treap_insert(root->link, added);
+  } else {
+    root->back = megagroup_treap_insert(root->back, added);
+  }
+  return root;
+}
+
+static
+Blockinfo_t *megagroup_treap_remove(Blockinfo_t *root, Blockinfo_t *removed) {
+  if (root == removed) {
+    return megagroup_treap_merge(root->link, root->back);
+  }
+  if (megagroup_before(removed, root)) {
+    root->link = megagroup_treap_remove(root->link, removed);
+  } else {
+    root->back = megagroup_treap_remove(root->back, removed);
+  }
+  return root;
+}
+
+// The smallest free megagroup in a bin of at least the given number of
+// blocks, or NULL if there is none.
+static
+Blockinfo_t *megagroup_bin_best_fit(word bin, word blocks) {
+  if (bin < MEGA_EXACT_BINS) {
+    return free_megablock_bins[bin];
+  }
+  Blockinfo_t *best = NULL;
+  for (Blockinfo_t *node = free_megablock_bins[bin]; node != NULL; ) {
+    if (node->blocks >= blocks) {
+      best = node;
+      node = node->link;
+    } else {
+      node = node->back;
+    }
+  }
+  return best;
+}
+
+// Add a free megagroup to its bin and the megablock map.
+static
+void link_free_megagroup(Blockinfo_t *blockinfo) {
+  word megablocks = BLOCKS_TO_MEGABLOCKS(blockinfo->blocks);
+  word bin = megagroup_bin(megablocks);
+  if (bin < MEGA_EXACT_BINS) {
+    list_link_blockinfo(blockinfo, &free_megablock_bins[bin]);
+  } else {
+    free_megablock_bins[bin] = megagroup_treap_insert(free_megablock_bins[bin], blockinfo);
+  }
+  free_megablock_bins_nonempty[bin / 64] |= (uint64_t)1 << (bin % 64);
+  megablock_stats.free_megablocks += megablocks;
+  *megablock_map_slot(TO_MEGABLOCK(blockinfo), true) = blockinfo;
+  *megablock_map_slot(TO_MEGABLOCK(blockinfo) + megablocks - 1, true) = blockinfo;
+}
+
+// Remove a free megagroup from its bin and the megablock map.
+static
+void unlink_free_megagroup(Blockinfo_t *blockinfo) {
+  word megablocks = BLOCKS_TO_MEGABLOCKS(blockinfo->blocks);
+  word bin = megagroup_bin(megablocks);
+  if (bin < MEGA_EXACT_BINS) {
+    list_unlink_blockinfo(blockinfo, &free_megablock_bins[bin]);
+  } else {
+    free_megablock_bins[bin] = megagroup_treap_remove(free_megablock_bins[bin], blockinfo);
+  }
+  if (free_megablock_bins[bin] == NULL) {
+    free_megablock_bins_nonempty[bin / 64] &= ~((uint64_t)1 << (bin % 64));
+  }
+  megablock_stats.free_megablocks -= megablocks;
+  *megablock_map_slot(TO_MEGABLOCK(blockinfo), false) = NULL;
+  *megablock_map_slot(TO_MEGABLOCK(blockinfo) + megablocks - 1, false) = NULL;
+}
+
+// Allocate some group of megablocks from the free bins (if possible),
+// otherwise allocates fresh megablocks.  The group split is the
+// smallest free one big enough: the first in the first non-empty bin
+// of big enough groups, except that the bin of the requested size may
+// also hold smaller groups, so its treap is searched first.
 static
 Blockinfo_t *alloc_megagroup(word megablocks) {
-  Blockinfo_t *blockinfo, *best, *prev;
+  Blockinfo_t *blockinfo, *best;
 
   word blocks = MEGABLOCKS_TO_BLOCKS(megablocks);
   assert(BLOCKS_TO_MEGABLOCKS(blocks) == megablocks,
          "Something is wrong with MEGABLOCKS_TO_BLOCKS");
-  best = prev = NULL;
+  best = NULL;
 
-  for (blockinfo = free_megablock_list; blockinfo != NULL; prev = blockinfo, blockinfo = blockinfo->link) {
-    if (blockinfo->blocks == blocks) {
-      // This block looks good.  Let's take it!
-      if (prev) {
-        prev->link = blockinfo->link;
-      } else {
-        free_megablock_list = blockinfo->link;
-      }
-      return blockinfo;
-    } else if (blockinfo->blocks > blocks) {
-      // Heuristic: it is better to break up a smaller megablock group
-      if (best == NULL || blockinfo->blocks < best->blocks) {
-        best = blockinfo;
-      }
+  word bin = megagroup_bin(megablocks);
+  if (bin >= MEGA_EXACT_BINS) {
+    best = megagroup_bin_best_fit(bin, blocks);
+    bin++;
+  }
+  if (best == NULL) {
+    word i = next_nonempty_megagroup_bin(bin);
+    if (i < MEGA_BINS) {
+      best = megagroup_bin_best_fit(i, blocks);
     }
   }
 
   Megablock_t *megablock;
   if (best) {
+    assert(best->free_ptr == (void *)-1, "Free megagroup not marked as free");
+    assert(megagroup_bin(BLOCKS_TO_MEGABLOCKS(best->blocks)) >= megagroup_bin(megablocks),
+           "Free megagroup is in the wrong bin");
+    unlink_free_megagroup(best);
+    if (best->blocks == blocks) {
+      // This block looks good.  Let's take it!
+      return best;
+    }
     // Take a chunk off the end.
     word best_megablocks = BLOCKS_TO_MEGABLOCKS(best->blocks);
     megablock = TO_MEGABLOCK(best) + (best_megablocks - megablocks);
     best->blocks = MEGABLOCKS_TO_BLOCKS(best_megablocks - megablocks);
+    link_free_megagroup(best);
   } else {
     // Nothing was suitable.  Allocate it fresh
     megablock = alloc_megablocks(megablocks);
@@ -179,46 +541,29 @@ Blockinfo_t *alloc_megagroup(word megablocks) {
   return blockinfo;
 }
 
-
-// Coalesces a block to block->link as appropriate.  Returns the last
-// of {block, block->link} modulo coalescing so coalescing can be
-// chained.
-static inline
-Blockinfo_t *coalesce_megablocks(Blockinfo_t *blockinfo) {
-  Blockinfo_t *next = blockinfo->link;
-  if (next != NULL) {
-    word megablocks = BLOCKS_TO_MEGABLOCKS(blockinfo->blocks);
-    if (TO_MEGABLOCK(blockinfo) == TO_MEGABLOCK(next) - megablocks) {
-      blockinfo->link = next->link;
-      blockinfo->blocks = MEGABLOCKS_TO_BLOCKS(megablocks + BLOCKS_TO_MEGABLOCKS(next->blocks));
-      next = blockinfo;
-    }
-  }
-  return next;
-}
-
-// Add a megagroup to the free_megablock_list, coalescing as appropriate.
+// Add a megagroup to the free bins, coalescing with free neighbours.
 static
 void free_megagroup(Blockinfo_t *blockinfo) {
-  Blockinfo_t *prev, *curr;
-  prev = NULL;
-  curr = free_megablock_list;
-  while (curr != NULL && curr->start < blockinfo->start) {
-    prev = curr;
-    curr = curr->link;
-  }
-  if (prev != NULL) {
-    blockinfo->link = prev->link;
-    prev->link = blockinfo;
-    // coalesce backwards
-    blockinfo = coalesce_megablocks(prev);
-  } else {
-    // we're at the front
-    blockinfo->link = free_megablock_list;
-    free_megablock_list = blockinfo;
+  Megablock_t *megablock = TO_MEGABLOCK(blockinfo);
+  word megablocks = BLOCKS_TO_MEGABLOCKS(blockinfo->blocks);
+  // coalesce backwards
+  Blockinfo_t *prev = megablock_map_lookup(megablock - 1);
+  if (prev != NULL && prev->free_ptr == (void *)-1
+      && TO_MEGABLOCK(prev) + BLOCKS_TO_MEGABLOCKS(prev->blocks) == megablock) {
+    unlink_free_megagroup(prev);
+    megablocks += BLOCKS_TO_MEGABLOCKS(prev->blocks);
+    blockinfo = prev;
+    megablock = TO_MEGABLOCK(prev);
   }
   // coalesce forwards
-  coalesce_megablocks(blockinfo);
+  Blockinfo_t *next = megablock_map_lookup(megablock + megablocks);
+  if (next != NULL && next->free_ptr == (void *)-1
+      && TO_MEGABLOCK(next) == megablock + megablocks) {
+    unlink_free_megagroup(next);
+    megablocks += BLOCKS_TO_MEGABLOCKS(next->blocks);
+  }
+  blockinfo->blocks = MEGABLOCKS_TO_BLOCKS(megablocks);
+  link_free_megagroup(blockinfo);
 #ifdef DEBUG
   verify_free_megablock_list();
 #endif
@@ -227,23 +572,24 @@ void free_megagroup(Blockinfo_t *blockinfo) {
 // Split a free block group into two, where the the second part will
 // have the given number of blocks.
 static
-Blockinfo_t *split_free_group(Blockinfo_t *blockinfo, word blocks, word i) {
+Blockinfo_t *split_free_group(Blockinfo_t *blockinfo, word blocks) {
   assert(blockinfo->blocks > blocks, "Splitting a group which is too small.");
   // remove from free list since size is changing
-  list_unlink_blockinfo(blockinfo, &free_block_list[i]);
+  unlink_free_group(blockinfo);
   // Take the block off the end of this one.
   Blockinfo_t *cut = (Blockinfo_t *)((struct Blockinfo_aligned_s *)blockinfo + blockinfo->blocks - blocks);
   cut->blocks = blocks;
   blockinfo->blocks -= blocks;
   fix_group_tail(blockinfo);
   // add back to the free list
-  i = log2_floor(blockinfo->blocks);
-  list_link_blockinfo(blockinfo, &free_block_list[i]);
+  link_free_group(blockinfo);
   return cut;
 }
 
-// Allocate a region of memory of a given number of blocks
-Blockinfo_t *alloc_group(word blocks) {
+// Allocate a region of memory of a given number of blocks.  The
+// caller holds free_list_lock.
+static
+Blockinfo_t *alloc_group_nolock(word blocks) {
   if (blocks == 0) {
     error("zero blocks requested in alloc_group");
   }
@@ -258,14 +604,12 @@ Blockinfo_t *alloc_group(word blocks) {
     init_group(blockinfo);
     return blockinfo;
   } else {
-    // Fits within a single megablock.  Try to find a free block group
-    // from the free list of the right size.
+    // Fits within a single megablock.  Find the first non-empty free
+    // list whose groups are all big enough.
     word i = log2_ceil(blocks);
     assert(i < FREE_LIST_SIZE, "Megablocks should have handled this.");
-    while (i < FREE_LIST_SIZE && free_block_list[i] == NULL) {
-      i++;
-    }
-    if (i == FREE_LIST_SIZE) {
+    word candidates = free_block_list_nonempty & (~(word)0 << i);
+    if (candidates == 0) {
       // Didn't find a free block.  Need to allocate a megablock.
       blockinfo = alloc_megagroup(1);
       blockinfo->blocks = blocks;
@@ -276,19 +620,20 @@ Blockinfo_t *alloc_group(word blocks) {
       // blockinfo would get coalesced into remainder:
       init_group(blockinfo);
       init_group(remainder); // to set up the free_ptr so free_group doesn't complain
-      free_group(remainder);
+      free_group_nolock(remainder);
 			assert(blockinfo->start != NULL, "Block start is not assigned");
       return blockinfo;
     } else {
       // Found one
+      i = __builtin_ctzll(candidates);
       blockinfo = free_block_list[i];
       if (blockinfo->blocks == blocks) {
         // right size: don't need to split
-        list_unlink_blockinfo(blockinfo, &free_block_list[i]);
+        unlink_free_group(blockinfo);
       } else {
         // else the block is too big
         assert(blockinfo->blocks > blocks, "Free list is corrupted.");
-        blockinfo = split_free_group(blockinfo, blocks, i);
+        blockinfo = split_free_group(blockinfo, blocks);
         assert(blockinfo->blocks == blocks, "Didn't split block properly.");
       }
 			init_group(blockinfo);
@@ -299,16 +644,17 @@ Blockinfo_t *alloc_group(word blocks) {
 }
 
 // Returns a group to the free list.  If there are adjacent free
-// groups in memory, they are coalesced.
-void free_group(Blockinfo_t *blockinfo) {
+// groups in memory, they are coalesced.  The caller holds
+// free_list_lock.
+static
+void free_group_nolock(Blockinfo_t *blockinfo) {
   assert(blockinfo->free_ptr != (void *)-1, "Group is already freed.");
   assert(blockinfo->blocks != 0, "Group size is zero (maybe part of a group).");
   blockinfo->free_ptr = (void *)-1;
   blockinfo->gen = NULL;
   if (blockinfo->blocks >= NUM_USABLE_BLOCKS) {
     // It's a megagroup
-    word num_mblocks = BLOCKS_TO_MEGABLOCKS(blockinfo->blocks);
-    assert(blockinfo->blocks == MEGABLOCKS_TO_BLOCKS(num_mblocks),
+    assert(blockinfo->blocks == MEGABLOCKS_TO_BLOCKS(BLOCKS_TO_MEGABLOCKS(blockinfo->blocks)),
            "Number of blocks reported by megagroup does not match expected number.");
     free_megagroup(blockinfo);
     return;
@@ -317,11 +663,10 @@ void free_group(Blockinfo_t *blockinfo) {
 
     // Coalesce forwards
 		Blockinfo_t *next = (Blockinfo_t *)((struct Blockinfo_aligned_s *)blockinfo + blockinfo->blocks);
-    if (next <= LAST_BLOCKINFO(blockinfo)) {
+    if ((void *)next <= LAST_BLOCKINFO(blockinfo)) {
       if (next->free_ptr == (void *)-1) {
+        unlink_free_group(next);
         blockinfo->blocks += next->blocks;
-        word i = log2_floor(next->blocks);
-        list_unlink_blockinfo(next, &free_block_list[i]);
         if (blockinfo->blocks == NUM_USABLE_BLOCKS) {
           // hooray, we completed a tetris
           free_megagroup(blockinfo);
@@ -341,8 +686,7 @@ void free_group(Blockinfo_t *blockinfo) {
         prev = prev->link;
       }
       if (prev->free_ptr == (void *)-1) {
-        word i = log2_floor(prev->blocks);
-        list_unlink_blockinfo(prev, &free_block_list[i]);
+        unlink_free_group(prev);
         prev->blocks += blockinfo->blocks;
         if (prev->blocks == NUM_USABLE_BLOCKS) {
           free_megagroup(prev);
@@ -354,10 +698,187 @@ void free_group(Blockinfo_t *blockinfo) {
       }
     }
     fix_group_tail(blockinfo);
-    word i = log2_floor(blockinfo->blocks);
-    assert(i < FREE_LIST_SIZE, "Block group is too big for free list.");
-    list_link_blockinfo(blockinfo, &free_block_list[i]);
+    link_free_group(blockinfo);
+  }
+}
+
+
+// Split an allocated group (smaller than a megablock) into groups of
+// the given number of blocks.  Returns the new groups in address
+// order, chained with link.
+Blockinfo_t *split_group(Blockinfo_t *group, word blocks) {
+  word n = group->blocks / blocks;
+  assert(n * blocks == group->blocks, "Group doesn't split evenly.");
+  assert(group->blocks < NUM_USABLE_BLOCKS, "Megagroups can't be split.");
+  Blockinfo_t *head = NULL;
+  for (word i = n; i > 0; i--) {
+    Blockinfo_t *part = (Blockinfo_t *)((struct Blockinfo_aligned_s *)group + (i - 1) * blocks);
+    part->blocks = blocks;
+    init_group(part);
+    part->link = head;
+    head = part;
+  }
+  return head;
+}
+
+// Refill the cache for groups of the given size with a batch of groups
+// carved from one fresh group.
+static
+void refill_block_cache(word blocks) {
+  pthread_mutex_lock(&free_list_lock);
+  Blockinfo_t *batch = alloc_group_nolock(blocks * BLOCK_CACHE_BATCH);
+  pthread_mutex_unlock(&free_list_lock);
+  Blockinfo_t *group, *next;
+  for (group = split_group(batch, blocks); group != NULL; group = next) {
+    next = group->link;
+    group->link = block_cache.groups[blocks - 1];
+    block_cache.groups[blocks - 1] = group;
+  }
+  block_cache.count[blocks - 1] += BLOCK_CACHE_BATCH;
+}
+
+// Return up to n groups of the given size from the cache to the free
+// lists.
+static
+void flush_block_cache_groups(word blocks, word n) {
+  pthread_mutex_lock(&free_list_lock);
+  for (; n > 0 && block_cache.groups[blocks - 1] != NULL; n--) {
+    Blockinfo_t *group = block_cache.groups[blocks - 1];
+    block_cache.groups[blocks - 1] = group->link;
+    block_cache.count[blocks - 1]--;
+    group->flags = 0;
+    free_group_nolock(group);
   }
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+// Make the calling thread allocate small groups through its own cache.
+void attach_block_cache(void) {
+  block_cache.attached = true;
+}
+
+// Return everything in the calling thread's cache to the free lists.
+void flush_block_cache(void) {
+  for (word blocks = 1; blocks <= BLOCK_CACHE_MAX_BLOCKS; blocks++) {
+    flush_block_cache_groups(blocks, block_cache.count[blocks - 1]);
+  }
+}
+
+// Allocate a region of memory of a given number of blocks.  Safe to
+// call from any thread.
+Blockinfo_t *alloc_group(word blocks) {
+  if (block_cache.attached && blocks != 0 && blocks <= BLOCK_CACHE_MAX_BLOCKS) {
+    if (block_cache.groups[blocks - 1] == NULL) {
+      refill_block_cache(blocks);
+    }
+    Blockinfo_t *group = block_cache.groups[blocks - 1];
+    block_cache.groups[blocks - 1] = group->link;
+    block_cache.count[blocks - 1]--;
+    init_group(group);
+    return group;
+  }
+  pthread_mutex_lock(&free_list_lock);
+  Blockinfo_t *blockinfo = alloc_group_nolock(blocks);
+  pthread_mutex_unlock(&free_list_lock);
+  return blockinfo;
+}
+
+// Returns a group to the free lists (or the calling thread's cache).
+// Safe to call from any thread.
+void free_group(Blockinfo_t *blockinfo) {
+  assert(!(blockinfo->flags & BF_CACHED), "Group is already freed to a cache.");
+  word blocks = blockinfo->blocks;
+  if (block_cache.attached && blocks != 0 && blocks <= BLOCK_CACHE_MAX_BLOCKS) {
+    assert(blockinfo->free_ptr != (void *)-1, "Group is already freed.");
+    blockinfo->gen = NULL;
+    blockinfo->flags = BF_CACHED;
+    blockinfo->link = block_cache.groups[blocks - 1];
+    block_cache.groups[blocks - 1] = blockinfo;
+    if (++block_cache.count[blocks - 1] > BLOCK_CACHE_SIZE) {
+      flush_block_cache_groups(blocks, BLOCK_CACHE_BATCH);
+    }
+    return;
+  }
+  pthread_mutex_lock(&free_list_lock);
+  free_group_nolock(blockinfo);
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+
+// Set whether fresh megablocks come from a reservation of address
+// space.  If not, each megagroup is mmapped separately.
+void set_megablock_reservation(bool enabled) {
+  pthread_mutex_lock(&free_list_lock);
+  reserve_megablocks = enabled;
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+// Set whether megablocks are backed by transparent huge pages.  The
+// current reservation is dropped so the next one is aligned for them.
+void set_megablock_huge_pages(bool enabled) {
+  pthread_mutex_lock(&free_list_lock);
+  if (enabled != huge_pages) {
+    huge_pages = enabled;
+    drop_reservation();
+  }
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+// Ask the OS to back a page-aligned range with memory from the NUMA
+// node of the CPU the calling thread is on.  Returns whether it could.
+bool bind_to_local_node(void *start, word size) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+  unsigned cpu, node;
+  unsigned long nodemask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1 || node >= NUMA_MAX_NODES) {
+    return false;
+  }
+  nodemask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, start, size, MPOL_PREFERRED, nodemask,
+                 NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+#else
+  return false;
+#endif
+}
+
+// Set how many free megablocks to keep rather than return to the OS.
+void set_megablock_retention(word megablocks) {
+  pthread_mutex_lock(&free_list_lock);
+  megablock_retention = megablocks;
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+// Return free megablocks beyond the retention limit to the OS.  The
+// largest free megagroups go first, since the small ones are the most
+// likely to be reused.
+void release_free_megablocks(void) {
+  pthread_mutex_lock(&free_list_lock);
+  while (megablock_stats.free_megablocks > megablock_retention) {
+    word excess = megablock_stats.free_megablocks - megablock_retention;
+    word bin = last_nonempty_megagroup_bin();
+    Blockinfo_t *group = free_megablock_bins[bin];
+    while (bin >= MEGA_EXACT_BINS && group->back != NULL) {
+      group = group->back;
+    }
+    Megablock_t *megablock = TO_MEGABLOCK(group);
+    word megablocks = BLOCKS_TO_MEGABLOCKS(group->blocks);
+    unlink_free_megagroup(group);
+    if (megablocks <= excess) {
+      free_megablocks(megablock, megablocks);
+    } else {
+      // Keep the head of the group, which holds its blockinfo.
+      group->blocks = MEGABLOCKS_TO_BLOCKS(megablocks - excess);
+      link_free_megagroup(group);
+      free_megablocks(megablock + megablocks - excess, excess);
+    }
+  }
+  pthread_mutex_unlock(&free_list_lock);
+}
+
+void get_megablock_stats(MegablockStats_t *stats) {
+  pthread_mutex_lock(&free_list_lock);
+  *stats = megablock_stats;
+  pthread_mutex_unlock(&free_list_lock);
 }
 
 
@@ -371,15 +892,55 @@ void verify_megablock(Blockinfo_t *megablock) {
 	}
 }
 
-// Basic data consistency checks on free_megablock_list
+// Consistency checks on a free megagroup in a bin
+static
+void verify_free_megagroup(Blockinfo_t *curr, word bin) {
+  word megablocks = BLOCKS_TO_MEGABLOCKS(curr->blocks);
+  (void)megablocks;
+  (void)bin;
+  assert(curr->free_ptr == (void *)-1, "Not marked as free");
+  assert(megagroup_bin(megablocks) == bin, "Megagroup in the wrong bin");
+  assert(megablock_map_lookup(TO_MEGABLOCK(curr)) == curr,
+         "Megablock map is missing the first megablock");
+  assert(megablock_map_lookup(TO_MEGABLOCK(curr) + megablocks - 1) == curr,
+         "Megablock map is missing the last megablock");
+  assert(megablock_map_lookup(TO_MEGABLOCK(curr) + megablocks) == NULL
+         || TO_MEGABLOCK(megablock_map_lookup(TO_MEGABLOCK(curr) + megablocks))
+            != TO_MEGABLOCK(curr) + megablocks,
+         "Adjacent free megagroups were not coalesced");
+  verify_megablock(curr);
+}
+
+// Consistency checks on the treap of a bin, between the groups lo and
+// hi (if not NULL)
+static
+void verify_megagroup_treap(Blockinfo_t *root, word bin, Blockinfo_t *lo, Blockinfo_t *hi) {
+  if (root == NULL) {
+    return;
+  }
+  verify_free_megagroup(root, bin);
+  assert(lo == NULL || megagroup_before(lo, root), "Bin treap is out of order");
+  assert(hi == NULL || megagroup_before(root, hi), "Bin treap is out of order");
+  assert(root->link == NULL || megagroup_priority(root->link) <= megagroup_priority(root),
+         "Bin treap is not a heap");
+  assert(root->back == NULL || megagroup_priority(root->back) <= megagroup_priority(root),
+         "Bin treap is not a heap");
+  verify_megagroup_treap(root->link, bin, lo, root);
+  verify_megagroup_treap(root->back, bin, root, hi);
+}
+
+// Basic data consistency checks on the free megagroup bins
 void verify_free_megablock_list(void) {
-  Blockinfo_t *curr;
-  for (curr = free_megablock_list; curr != NULL; curr = curr->link) {
-    if (curr->link != NULL) {
-      assert(curr->start < curr->link->start, "Order invariant broken");
-      assert((word)TO_MEGABLOCK(curr->link) - (word)TO_MEGABLOCK(curr) > curr->blocks * (word)BLOCK_SIZE,
-             "Not enough distance between disconnected blocks.");
-			verify_megablock(curr);
+  for (word bin = 0; bin < MEGA_BINS; bin++) {
+    assert(((free_megablock_bins_nonempty[bin / 64] >> (bin % 64)) & 1)
+           == (free_megablock_bins[bin] != NULL), "Bin bitmap is wrong");
+    if (bin >= MEGA_EXACT_BINS) {
+      verify_megagroup_treap(free_megablock_bins[bin], bin, NULL, NULL);
+      continue;
+    }
+    for (Blockinfo_t *curr = free_megablock_bins[bin]; curr != NULL; curr = curr->link) {
+      verify_free_megagroup(curr, bin);
+      assert(curr->link == NULL || curr->link->back == curr, "Bin links are broken");
     }
   }
 }
@@ -387,9 +948,11 @@ void verify_free_megablock_list(void) {
 // Basic data consistency checks on free_block_list
 void verify_free_block_list(void) {
   for (int i = 0; i < FREE_LIST_SIZE; i++) {
+    assert((free_block_list[i] != NULL) == ((free_block_list_nonempty >> i) & 1),
+           "Free list non-empty bitmap is out of date");
     for (Blockinfo_t *b = free_block_list[i]; b != NULL; b = b->link) {
       assert(b->blocks >= (1 << i), "Not-big-enough group free list");
-      assert(b->blocks < (1 << i + 1), "Too-big group in free list");
+      assert(b->blocks < (1 << (i + 1)), "Too-big group in free list");
       assert(b->free_ptr == (void *)-1, "Not marked as free");
       Blockinfo_t *tail = (Blockinfo_t *)((struct Blockinfo_aligned_s *)b + b->blocks - 1);
       if (tail != b) {
@@ -401,15 +964,36 @@ void verify_free_block_list(void) {
   } 
 }
 
+static
+void debug_print_free_megagroup(Blockinfo_t *curr, word bin) {
+  printf("  Megablock %p: megablocks=%lu (blocks=%lu, bin=%lu)\n",
+         curr, (word)BLOCKS_TO_MEGABLOCKS(curr->blocks), curr->blocks, bin);
+  assert(MEGABLOCKS_TO_BLOCKS(BLOCKS_TO_MEGABLOCKS(curr->blocks)) == curr->blocks,
+         "These aren't full megablock groups.");
+}
+
+// In order of size
+static
+void debug_print_megagroup_treap(Blockinfo_t *root, word bin) {
+  if (root != NULL) {
+    debug_print_megagroup_treap(root->link, bin);
+    debug_print_free_megagroup(root, bin);
+    debug_print_megagroup_treap(root->back, bin);
+  }
+}
+
 void debug_print_free_megablock_list(void) {
-  printf("free_megablock_list:\n");
-  for (Blockinfo_t *curr = free_megablock_list; curr != NULL; curr = curr->link) {
-    printf("  Megablock %p: megablocks=%d (blocks=%d)\n",
-           curr, BLOCKS_TO_MEGABLOCKS(curr->blocks), curr->blocks);
-    assert(MEGABLOCKS_TO_BLOCKS(BLOCKS_TO_MEGABLOCKS(curr->blocks)) == curr->blocks,
-           "These aren't full megablock groups.");
+  printf("free megablock bins:\n");
+  for (word bin = 0; bin < MEGA_BINS; bin++) {
+    if (bin >= MEGA_EXACT_BINS) {
+      debug_print_megagroup_treap(free_megablock_bins[bin], bin);
+      continue;
+    }
+    for (Blockinfo_t *curr = free_megablock_bins[bin]; curr != NULL; curr = curr->link) {
+      debug_print_free_megagroup(curr, bin);
+    }
   }
-  printf("  (end free_megablock_list)\n");
+  printf("  (end free megablock bins)\n");
 }
 
 void debug_print_free_block_list(void) {
@@ -420,7 +1004,7 @@ void debug_print_free_block_list(void) {
     } else {
       printf("  for 2^%d (blocks >= %d)\n", i, 1<<i);
       for (Blockinfo_t *b = free_block_list[i]; b != NULL; b = b->link) {
-        printf("    Block %p: blocks=%d\n",
+        printf("    Block %p: blocks=%lu\n",
                b, b->blocks);
       }
     }
@@ -5,6 +5,10 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "gc.h"
 #include "util.h"
 #include <stdint.h>
@@ -15,105 +19,2372 @@
 Generation_t generations[MAX_GENERATIONS];
 Nursery_t nurseries[MAX_GC_THREADS];
 
+__thread Nursery_t *thread_nursery;
+
+static int num_generations;
+static int num_nurseries;
+static int num_claimed_nurseries;
+static bool numa_nurseries = false;
+// Blocks of each nursery which isn't realtime
+static word nursery_blocks;
+
+static Obj_t **roots[MAX_ROOTS];
+static int num_roots;
+// Protects roots, which mutators may add to at the same time
+static Spinlock_t roots_lock;
+
 // Number of steps per generation; 0 to terminate.
 int default_generation_config[] = {2, 2, 1, 0};
 
+// The oldest generation is collected by marking in place unless it
+// is to be compacted, which happens after a collection leaves more
+// than compaction_threshold percent of its blocks free.
+static int compaction_threshold = COMPACTION_THRESHOLD;
+static bool compact_oldest;
+
+// Adaptive sizing (see set_gc_target_overhead): the percentage of time
+// to spend collecting, or 0 to keep sizes fixed, and the bounds on the
+// heap in blocks (see set_gc_heap_bounds)
+static int target_overhead;
+static word min_heap_blocks, max_heap_blocks;
+// Fraction of time spent in collections, smoothed over the last few
+static double gc_overhead;
+
+// Objects of up to MAX_SIZE_CLASS_BYTES copied into the oldest
+// generation go in BF_SIZED blocks, each divided into slots of one size
+// class, so that the slots of dead objects can be reused without
+// compacting.
+#define MAX_SIZE_CLASS_BYTES 1024
+#define NUM_SIZE_CLASSES 22
+static const uint16_t size_classes[NUM_SIZE_CLASSES] = {
+	16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512, 640, 768, 1024
+};
+// size_class_of[size / sizeof(word)] is the smallest class holding size
+static uint8_t size_class_of[MAX_SIZE_CLASS_BYTES / sizeof(word) + 1];
+// The generation which allocates by size class (the last step of the
+// oldest generation), or NULL
+static Generation_t *sized_gen;
+// Blocks of sized_gen with free slots, by size class
+static Blockinfo_t **partial_blocks[NUM_SIZE_CLASSES];
+static word n_partial_blocks[NUM_SIZE_CLASSES];
+static word max_partial_blocks[NUM_SIZE_CLASSES];
+static Spinlock_t partial_blocks_lock;
+// The def of a free slot.  Free slots are chained through Obj_t.link.
+static ObjDef_t free_slot_def = {.type = OBJ_TYPE_STD, .length = 0, .bitmap = 0};
+
+// Incremental collection of the oldest generation, which is on when
+// slice_words is not 0 (see gc_slice) or background_enabled is set
+// (see set_gc_background)
+static word slice_words;
+static bool background_enabled;
+static enum {
+	INCREMENTAL_IDLE,
+	INCREMENTAL_MARKING,
+	INCREMENTAL_SWEEPING
+} incremental_phase;
+volatile bool gc_incremental_marking;
+// Shaded objects of the oldest generation yet to be traced
+static Obj_t **grey_objects;
+static word n_grey_objects;
+static word max_grey_objects;
+static Spinlock_t grey_lock;
+// The shaded object being traced, and its next entry to trace
+static Obj_t *tracing;
+static word tracing_entry;
+// Marked blocks of the oldest generation yet to be swept
+static Blockinfo_t *unswept_blocks;
+
+// An evacuated object has its def replaced by a tagged pointer to its
+// new copy.  ObjDefs are pointer-aligned, so the low bit is free.
+#define FORWARDING_TAG 1
+#define IS_FORWARDED(obj) ((word)(obj)->def & FORWARDING_TAG)
+#define FORWARDING_PTR(obj) ((Obj_t *)((word)(obj)->def & ~(word)FORWARDING_TAG))
+
+////// Statistics and tracing
+//
+// Collections are counted and timed for gc_get_stats.  With
+// set_gc_trace_events, the spans of collections and their phases are
+// also recorded in a ring buffer of the most recent events, which
+// gc_write_trace writes out in the Chrome trace event format (which
+// Perfetto and chrome://tracing load).  A span is recorded when it
+// ends, so the buffer never holds half of one.
+
+static word gc_collections;
+static double last_pause_ns, max_pause_ns, total_pause_ns;
+// Allocated in the nurseries up to the last collection
+static word allocated_bytes;
+static double allocation_rate;
+static double last_gc_end_ns;
+// Allocated in large objects and pinned blocks since the last
+// collection
+static word large_allocated_bytes;
+// Protects the large list of generations[0], which mutators allocate
+// large objects and pinned blocks onto at the same time
+static Spinlock_t large_lock;
+
+typedef struct GcEvent_s {
+	const char *name; // a string literal
+	double start_ns;
+	double end_ns;
+	int thread; // GC thread id, or BACKGROUND_THREAD_ID
+	int generation; // generation number it concerns, or -1
+} GcEvent_t;
+
+// The thread id the background collector is traced as
+#define BACKGROUND_THREAD_ID MAX_GC_THREADS
+
+static GcEvent_t *trace_events;
+static word max_trace_events;
+// Number of events recorded so far, including overwritten ones
+static volatile word n_trace_events;
+
+static inline
+double gc_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The start time of a span to trace, or 0 if tracing is off.
+static inline
+double gc_trace_start(void) {
+	return max_trace_events != 0 ? gc_now_ns() : 0;
+}
+
+// Record a span which started at start_ns (from gc_trace_start) and
+// ends now.
+static inline
+void gc_trace(const char *name, int thread, int generation, double start_ns) {
+	if (max_trace_events == 0) {
+		return;
+	}
+	word i = __sync_fetch_and_add(&n_trace_events, 1) % max_trace_events;
+	trace_events[i] = (GcEvent_t){name, start_ns, gc_now_ns(), thread, generation};
+}
+
 // generation_config is a zero-terminated array of integers, each of
 // which gives the number of steps for the given generation.
 void init_generations(int generation_config[]) {
 	int k = 0; // index into generations[]
-	for (int n = 0; n < MAX_GENERATIONS && generation_config[n] != 0; n++) {
+	for (int n = 0; generation_config[n] != 0; n++) {
 		for (int i = 0; i < generation_config[n]; i++, k++) {
+			guard(k < MAX_GENERATIONS, "Too many generation steps for MAX_GENERATIONS");
 			Generation_t *gen = &generations[k];
 			gen->num = n;
 			gen->blocks = NULL;
 			gen->n_blocks = 0;
 			gen->large = NULL;
+			gen->n_large_blocks = 0;
+			gen->n_max_blocks = NURSERY_BLOCKS << (2 * n);
 			gen->remembered = (void *)-1;
-			if (generation_config[n + 1] == 0) {
-				gen->to_gen = NULL;
-				break;
-			} else {
-				gen->to_gen = &generations[k + 1];
-			}
+			gen->n_dirty = 0;
+			gen->remembered_lock = 0;
+			gen->to_gen = &generations[k + 1];
+			gen->old_blocks = NULL;
+			gen->old_n_blocks = 0;
+			gen->old_large = NULL;
+			gen->live_bytes = 0;
+			gen->collections = 0;
+			gen->survival_rate = 0;
 		}
 	}
+	num_generations = k;
+	num_roots = 0;
+	compact_oldest = false;
+	// Whether incremental collection is possible depends on the
+	// generations, so it starts off.
+	slice_words = 0;
+	background_enabled = false;
+	incremental_phase = INCREMENTAL_IDLE;
+	gc_incremental_marking = false;
+	n_grey_objects = 0;
+	tracing = NULL;
+	unswept_blocks = NULL;
+	gc_collections = 0;
+	last_pause_ns = max_pause_ns = total_pause_ns = 0;
+	allocated_bytes = large_allocated_bytes = 0;
+	allocation_rate = 0;
+	last_gc_end_ns = gc_now_ns();
+	n_trace_events = 0;
+	target_overhead = 0;
+	min_heap_blocks = 0;
+	max_heap_blocks = (word)-1;
+	gc_overhead = 0;
+	sized_gen = k > 1 ? &generations[k - 1] : NULL;
+	for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+		n_partial_blocks[c] = 0;
+	}
+	for (word size = 0, c = 0; size <= MAX_SIZE_CLASS_BYTES; size += sizeof(word)) {
+		while (size_classes[c] < size) {
+			c++;
+		}
+		size_class_of[size / sizeof(word)] = c;
+	}
 	if (k == 0) {
 		generations[0].num = -1; // sentinel for testing
+	} else {
+		// The oldest generation copies into itself.
+		generations[k - 1].to_gen = NULL;
+	}
+}
+
+// Make a fresh block the nursery's allocation block.
+static inline
+void nursery_set_block(Nursery_t *nursery, Blockinfo_t *bd) {
+	nursery->alloc_block = bd;
+	bd->free_ptr = bd->start;
+	nursery->free_ptr = bd->start;
+	nursery->limit = (void *)((word)bd->start + BLOCK_SIZE);
+}
+
+static
+void free_group_list(Blockinfo_t *bd) {
+	while (bd != NULL) {
+		Blockinfo_t *next = bd->link;
+		free_group(bd);
+		bd = next;
 	}
 }
 
+// A list of n fresh nursery blocks.  They are runs of up to
+// NURSERY_BLOCKS contiguous single blocks, so that each run can be
+// bound to a NUMA node as a whole.
+static
+Blockinfo_t *nursery_new_blocks(word n) {
+	Blockinfo_t *blocks = NULL, **tail = &blocks;
+	for (word left = n; left > 0; ) {
+		word run = left < NURSERY_BLOCKS ? left : NURSERY_BLOCKS;
+		*tail = split_group(alloc_group(run), 1);
+		for (Blockinfo_t *block = *tail; block != NULL; block = block->link) {
+			assert(block->start != NULL, "block has bad start");
+			block->gen = &generations[0];
+			tail = &block->link;
+		}
+		left -= run;
+	}
+	return blocks;
+}
+
+// Give a nursery n fresh blocks.
+static
+void nursery_alloc_blocks(Nursery_t *nursery, word n) {
+	nursery->blocks = nursery_new_blocks(n);
+	nursery->n_blocks = n;
+	nursery_set_block(nursery, nursery->blocks);
+	assert(nursery->alloc_block->free_ptr != NULL, "Bad free pointer");
+}
+
+// Bind each run of a nursery's blocks to the NUMA node the calling
+// thread is running on.
+static
+void nursery_bind(Nursery_t *nursery) {
+	Blockinfo_t *run = nursery->blocks;
+	for (Blockinfo_t *bd = nursery->blocks; bd != NULL; bd = bd->link) {
+		if (bd->link == NULL || (word)bd->link->start != (word)bd->start + BLOCK_SIZE) {
+			bind_to_local_node(run->start, (word)bd->start + BLOCK_SIZE - (word)run->start);
+			run = bd->link;
+		}
+	}
+	nursery->rebind = false;
+}
+
 void init_nurseries(int num_threads) {
 	guard(num_threads <= MAX_GC_THREADS,
 				"Number of threads exceeds MAX_GC_THREADS");
+	nursery_blocks = NURSERY_BLOCKS;
 	for (int i = 0; i < num_threads; i++) {
 		Nursery_t *nursery = &nurseries[i];
-		Blockinfo_t *free = NULL;
-		for (int j = 0; j < NURSERY_BLOCKS; j++) {
-			Blockinfo_t *block = alloc_group(1);
-			assert(block != NULL, "Got bad block");
-			assert(block->start != NULL, "block has bad start");
-			block->link = free;
-			block->gen = &generations[0];
-			free = block;
-		}
-		nursery->blocks = free;
-		nursery->alloc_block = free;
-		nursery->alloc_block->free_ptr = nursery->alloc_block->start;
-		assert(nursery->alloc_block->free_ptr != NULL, "Bad free pointer");
+		nursery_alloc_blocks(nursery, nursery_blocks);
+		nursery->pinned_block = NULL;
+		nursery->realtime = false;
+		nursery->spare_blocks = nursery->retired_blocks = NULL;
+		nursery->rebind = false;
 	}
+	num_nurseries = num_threads;
+	num_claimed_nurseries = 0;
+}
+
+// Set whether claim_nursery binds the nursery's memory to the NUMA
+// node the claiming thread is running on.
+void set_nursery_numa_binding(bool enabled) {
+	numa_nurseries = enabled;
+}
+
+void set_compaction_threshold(int percent) {
+	compaction_threshold = percent;
+}
+
+// Set whether a nursery is used by a realtime thread, which must
+// never wait for a collection.  Allocating in a realtime nursery never
+// collects or stops: once its blocks are full it swaps in a spare set
+// of as many blocks, leaving the full ones to be evacuated by the next
+// collection, which a thread that isn't realtime runs with gc_slice
+// (or garbage_collect).  If the spare blocks are still waiting for
+// that collection, or the object is large or pinned, allocation
+// returns NULL instead.
+//
+// A realtime thread is only in the heap while it uses it, say for
+// each cycle of its work: it enters with gc_try_enter_heap, which
+// fails rather than waits if a collection is running, and leaves with
+// gc_leave_heap.  Collections wait for it to leave, so between the
+// two it may keep pointers to objects in local variables without
+// rooting them.  The nursery must be collected, or not yet used, when
+// it stops being realtime.
+void set_nursery_realtime(Nursery_t *nursery, bool realtime) {
+	if (realtime && nursery->spare_blocks == NULL) {
+		nursery->spare_blocks = nursery_new_blocks(nursery->n_blocks);
+	} else if (!realtime && nursery->spare_blocks != NULL) {
+		guard(nursery->retired_blocks == NULL, "Realtime nursery is waiting for a collection");
+		free_group_list(nursery->spare_blocks);
+		nursery->spare_blocks = NULL;
+	}
+	nursery->realtime = realtime;
 }
 
 Nursery_t *get_nursery(int i) {
 	return &nurseries[i];
 }
 
-Obj_t *alloc_obj(Nursery_t *nursery, word size) {
-	assert(((word)nursery - (word)nurseries) % sizeof(nursery) == 0,
+// Give the calling thread its own nursery, which thread_alloc_obj
+// then uses.  The thread becomes a mutator in the heap (see
+// gc_enter_heap) until release_nursery.
+Nursery_t *claim_nursery(void) {
+	int i = __sync_fetch_and_add(&num_claimed_nurseries, 1);
+	guard(i < num_nurseries, "No unclaimed nurseries left");
+	thread_nursery = &nurseries[i];
+	if (numa_nurseries) {
+		nursery_bind(thread_nursery);
+	}
+	gc_enter_heap();
+	return thread_nursery;
+}
+
+// Stop being a mutator, for a thread which is done with the heap.
+// Its nursery is not claimed again.
+void release_nursery(void) {
+	gc_leave_heap();
+	thread_nursery = NULL;
+}
+
+void gc_add_root(Obj_t **root) {
+	spin_lock(&roots_lock);
+	guard(num_roots < MAX_ROOTS, "Too many roots for MAX_ROOTS");
+	roots[num_roots++] = root;
+	spin_unlock(&roots_lock);
+}
+
+void gc_remove_root(Obj_t **root) {
+	spin_lock(&roots_lock);
+	for (int i = 0; i < num_roots; i++) {
+		if (roots[i] == root) {
+			roots[i] = roots[--num_roots];
+			spin_unlock(&roots_lock);
+			return;
+		}
+	}
+	error("gc_remove_root given a pointer which is not a root");
+}
+
+////// Stopping the world
+//
+// A thread which has claimed a nursery is a mutator, and is in the
+// heap (may touch objects) until it calls gc_leave_heap, as it should
+// before blocking.  A collection runs with every other mutator out of
+// the heap: it sets gc_stop_requested, and each mutator leaves the
+// heap at its next safepoint (gc_safepoint, which allocation reaches
+// on its slow path) until the world is started again.  Whoever sets
+// gc_stop_requested collects, so a thread which wants to collect
+// while another does stops for it instead.
+//
+// running_mutators counts the mutators in the heap.  It is only
+// increased under world_lock while no stop is requested, except by
+// gc_try_enter_heap, which increases it first and backs out if it
+// then sees a stop requested; the collector sets gc_stop_requested
+// before counting, so one of the two sees the other.
+
+volatile bool gc_stop_requested;
+static volatile int running_mutators;
+static __thread bool in_heap;
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+// Broadcast when the world is started again
+static pthread_cond_t world_start_cond = PTHREAD_COND_INITIALIZER;
+// Signalled when a mutator leaves the heap (but gc_leave_heap doesn't
+// take world_lock, so the collector also polls)
+static pthread_cond_t world_stop_cond = PTHREAD_COND_INITIALIZER;
+#define WORLD_STOP_POLL_NS 100000
+
+// Wait for the world to be started again.  The caller holds
+// world_lock and is out of the heap.
+static
+void wait_for_world_start(void) {
+	while (gc_stop_requested) {
+		pthread_cond_wait(&world_start_cond, &world_lock);
+	}
+}
+
+// Enter the heap, waiting for any collection to finish first.
+void gc_enter_heap(void) {
+	guard(!in_heap, "Thread is already in the heap");
+	pthread_mutex_lock(&world_lock);
+	wait_for_world_start();
+	__sync_fetch_and_add(&running_mutators, 1);
+	in_heap = true;
+	pthread_mutex_unlock(&world_lock);
+}
+
+// Enter the heap unless a collection has stopped the world, without
+// waiting, as a realtime thread must.  Returns whether it entered.
+bool gc_try_enter_heap(void) {
+	guard(!in_heap, "Thread is already in the heap");
+	__sync_fetch_and_add(&running_mutators, 1);
+	if (gc_stop_requested) {
+		__sync_fetch_and_sub(&running_mutators, 1);
+		return false;
+	}
+	in_heap = true;
+	return true;
+}
+
+// Leave the heap: until it enters again, the thread mustn't touch any
+// object, and collections don't wait for it.  Never blocks.
+void gc_leave_heap(void) {
+	guard(in_heap, "Thread is not in the heap");
+	in_heap = false;
+	__sync_fetch_and_sub(&running_mutators, 1);
+	pthread_cond_signal(&world_stop_cond);
+}
+
+// Stop at a requested collection until it is done.  Threads of
+// realtime nurseries never stop here (they must leave the heap
+// instead).
+void gc_safepoint_slow(void) {
+	if (!in_heap || (thread_nursery != NULL && thread_nursery->realtime)) {
+		return;
+	}
+	pthread_mutex_lock(&world_lock);
+	__sync_fetch_and_sub(&running_mutators, 1);
+	pthread_cond_signal(&world_stop_cond);
+	wait_for_world_start();
+	__sync_fetch_and_add(&running_mutators, 1);
+	pthread_mutex_unlock(&world_lock);
+}
+
+// Stop every other mutator, first stopping for any collection another
+// thread is doing.  The caller may be a mutator in the heap or not.
+static
+void stop_the_world(void) {
+	int self = in_heap ? 1 : 0;
+	pthread_mutex_lock(&world_lock);
+	while (gc_stop_requested) {
+		__sync_fetch_and_sub(&running_mutators, self);
+		pthread_cond_signal(&world_stop_cond);
+		wait_for_world_start();
+		__sync_fetch_and_add(&running_mutators, self);
+	}
+	gc_stop_requested = true;
+	__sync_synchronize();
+	while (running_mutators > self) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += WORLD_STOP_POLL_NS;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&world_stop_cond, &world_lock, &deadline);
+	}
+	pthread_mutex_unlock(&world_lock);
+}
+
+static
+void start_the_world(void) {
+	pthread_mutex_lock(&world_lock);
+	gc_stop_requested = false;
+	pthread_cond_broadcast(&world_start_cond);
+	pthread_mutex_unlock(&world_lock);
+}
+
+////// Write barrier
+//
+// Pointers from older generations into younger ones are found through
+// cards.  Each block is divided into CARDS_PER_BLOCK cards, and a card
+// is marked in the blockinfo of its block when it may hold such a
+// pointer.  The head of each group with marked cards is on its
+// generation's dirty list, so a collection only looks at those groups
+// rather than the whole of the older generations.  Only the first
+// megablock of a megagroup has blockinfos, so an object with an entry
+// past it goes in its generation's remembered set instead and is
+// scavenged whole.
+
+// Put the head of a group on its generation's dirty list, if it isn't
+// already.
+static
+void gc_add_dirty_group(Blockinfo_t *head) {
+	if (__sync_fetch_and_or(&head->flags, BF_DIRTY) & BF_DIRTY) {
+		return;
+	}
+	Generation_t *gen = head->gen;
+	spin_lock(&gen->remembered_lock);
+	if (gen->n_dirty == gen->max_dirty) {
+		gen->max_dirty = gen->max_dirty == 0 ? 64 : 2 * gen->max_dirty;
+		gen->dirty = realloc(gen->dirty, gen->max_dirty * sizeof(Blockinfo_t *));
+		guard(gen->dirty != NULL, "Couldn't grow dirty list");
+	}
+	gen->dirty[gen->n_dirty++] = head;
+	spin_unlock(&gen->remembered_lock);
+}
+
+// Add an object to its generation's remembered set, if it isn't
+// already.
+static
+void gc_remember(Obj_t *obj, Generation_t *gen) {
+	spin_lock(&gen->remembered_lock);
+	if (obj->link == NULL) {
+		obj->link = gen->remembered;
+		gen->remembered = obj;
+	}
+	spin_unlock(&gen->remembered_lock);
+}
+
+// Record that the given entry of obj may point into a younger
+// generation.  This is the slow path of gc_write_field.
+void gc_mark_card(Obj_t *obj, Obj_t **slot) {
+	Blockinfo_t *head = get_blockinfo(obj);
+	if (TO_MEGABLOCK(slot) != TO_MEGABLOCK(obj)) {
+		gc_remember(obj, head->gen);
+		return;
+	}
+	get_blockinfo(slot)->cards[CARD_INDEX(slot)] = 1;
+	gc_add_dirty_group(head);
+}
+
+// The number of blocks of a group which have blockinfos, and so
+// cards.
+static inline
+word carded_blocks(Blockinfo_t *head) {
+	word blocks = (struct Blockinfo_aligned_s *)LAST_BLOCKINFO(head)
+		- (struct Blockinfo_aligned_s *)head + 1;
+	return blocks < head->blocks ? blocks : head->blocks;
+}
+
+// Clear the cards of every block of a group.
+static
+void gc_clear_cards(Blockinfo_t *head) {
+	word blocks = carded_blocks(head);
+	for (word j = 0; j < blocks; j++) {
+		Blockinfo_t *bd = (Blockinfo_t *)((struct Blockinfo_aligned_s *)head + j);
+		memset(bd->cards, 0, CARDS_PER_BLOCK);
+	}
+}
+
+// Called by alloc_obj when the object doesn't fit in the rest of the
+// allocation block.
+Obj_t *alloc_obj_slow(Nursery_t *nursery, word size) {
+	assert(((word)nursery - (word)nurseries) % sizeof(Nursery_t) == 0,
 				 "Bad nursery pointer");
 	if (size > BLOCK_SIZE) {
 		// The object is kind of big; allocate a group for it.
 		word blocks = (size + BLOCK_SIZE - 1) >> BLOCK_SIZE_LG;
 		assert(blocks * BLOCK_SIZE >= size,
 					 "Not getting enough blocks for given size.");
+		if (nursery->realtime) {
+			return NULL;
+		}
+		gc_safepoint();
+		if (generations[0].n_large_blocks + blocks > nursery_blocks) {
+			// Large objects count against the nursery.
+			garbage_collect();
+		}
 		Blockinfo_t *block = alloc_group(blocks);
-		block->link = generations[0].large;
-		generations[0].large = block;
+		block->gen = &generations[0];
+		block->flags = BF_LARGE;
+		block->free_ptr = (void *)((word)block->start + size);
+		spin_lock(&large_lock);
+		large_allocated_bytes += size;
+		list_link_blockinfo(block, &generations[0].large);
+		generations[0].n_large_blocks += blocks;
+		spin_unlock(&large_lock);
 		return (Obj_t *)block->start;
 	}
-	if (nursery->alloc_block != NULL && BLOCK_SIZE - ((word)nursery->alloc_block->free_ptr - (word)nursery->alloc_block->start) < size) {
-		// The object won't fit in the free space of the current
-		// allocation block.  Just go on to the next allocation block.
-		nursery->alloc_block = nursery->alloc_block->link;
-		if (nursery->alloc_block != NULL) {
-			nursery->alloc_block->free_ptr = nursery->alloc_block->start;
-		}
+	// Stop for any collection another thread wants to do first, since
+	// it resets the nursery to its first block, where the object then
+	// fits after all.
+	gc_safepoint();
+	if (unlikely(nursery->rebind)) {
+		// Bind the blocks it was given when it was resized.
+		nursery_bind(nursery);
+	}
+	void *next = (void *)((word)nursery->free_ptr + NEXT_PTR_ALIGNED(size));
+	if (next <= nursery->limit) {
+		Obj_t *obj = nursery->free_ptr;
+		nursery->free_ptr = next;
+		return obj;
 	}
-	if (nursery->alloc_block == NULL) {
+	// The object won't fit in the free space of the current allocation
+	// block.  Just go on to the next allocation block.
+	nursery->alloc_block->free_ptr = nursery->free_ptr;
+	if (nursery->alloc_block->link != NULL) {
+		nursery_set_block(nursery, nursery->alloc_block->link);
+	} else if (nursery->realtime) {
+		// Hand the full blocks over to the next collection.
+		if (nursery->retired_blocks != NULL) {
+			return NULL;
+		}
+		nursery->retired_blocks = nursery->blocks;
+		nursery->blocks = nursery->spare_blocks;
+		nursery->spare_blocks = NULL;
+		nursery_set_block(nursery, nursery->blocks);
+	} else {
 		garbage_collect();
-		assert(nursery->alloc_block != NULL,
-					 "Garbage collection didn't free up block");
 	}
-	Obj_t *obj = nursery->alloc_block->free_ptr;
-	nursery->alloc_block->free_ptr = (void *)NEXT_PTR_ALIGNED((word)nursery->alloc_block->free_ptr + size);
+	Obj_t *obj = nursery->free_ptr;
+	nursery->free_ptr = (void *)NEXT_PTR_ALIGNED((word)obj + size);
 	return obj;
 }
 
+// Allocate an object which is never moved by the collector, so that
+// its address can be handed to foreign code for as long as it is
+// reachable.  Objects which fit in a block are bump-allocated in the
+// nursery's pinned block, a BF_PINNED block on the large list which
+// is promoted and marked as a whole, like a large object.  A pinned
+// block is therefore kept while any object in it is reachable, and
+// everything in it is scavenged.  Large objects are never moved anyway.
+Obj_t *alloc_pinned_obj(Nursery_t *nursery, word size) {
+	if (size > BLOCK_SIZE) {
+		return alloc_obj_slow(nursery, size);
+	}
+	size = NEXT_PTR_ALIGNED(size);
+	Blockinfo_t *bd = nursery->pinned_block;
+	if (bd == NULL || (word)bd->free_ptr + size > (word)bd->start + BLOCK_SIZE) {
+		if (nursery->realtime) {
+			return NULL;
+		}
+		gc_safepoint();
+		if (generations[0].n_large_blocks + 1 > nursery_blocks) {
+			// Pinned blocks count against the nursery, like large objects.
+			garbage_collect();
+		}
+		bd = alloc_group(1);
+		bd->gen = &generations[0];
+		bd->flags = BF_PINNED;
+		bd->free_ptr = bd->start;
+		spin_lock(&large_lock);
+		list_link_blockinfo(bd, &generations[0].large);
+		generations[0].n_large_blocks++;
+		spin_unlock(&large_lock);
+		nursery->pinned_block = bd;
+	}
+	Obj_t *obj = bd->free_ptr;
+	bd->free_ptr = (void *)((word)obj + size);
+	__sync_fetch_and_add(&large_allocated_bytes, size);
+	return obj;
+}
+
+
+////// Collection
+//
+// The collector is a parallel copying collector.  Each GC thread has a
+// workspace per generation holding the to-space block it is copying
+// into (todo_block), which it scans itself.  Once a todo block fills
+// up, any unscanned part of it is pushed onto the thread's pending
+// queue, from which idle GC threads steal work.  Objects are claimed
+// by installing a forwarding pointer with a CAS on Obj_t.def.  Large
+// objects (BF_LARGE groups) and blocks of pinned objects (BF_PINNED)
+// are not copied but promoted by moving their groups between the
+// generations' large lists.
+//
+// The last step of the oldest generation is instead collected in
+// place (its groups are flagged BF_MARKED): live objects are marked in
+// a side bitmap per group and pushed on the marking thread's mark
+// stack to be scavenged.  Afterwards groups with nothing marked are
+// freed, and dead objects in the rest are overwritten with fillers so
+// that blocks can still be walked.  Holes are not allocated into, so
+// once too much of the generation is holes it is compacted by copying
+// it at its next collection.
+
+typedef struct Workspace_s {
+	Blockinfo_t *todo_block; // block being copied into and scanned
+	Blockinfo_t *scanned; // full blocks which have been scanned
+	word n_blocks; // number of blocks this thread evacuated into
+	Blockinfo_t *todo_large; // evacuated large objects yet to be scavenged
+	Blockinfo_t *large; // scavenged large objects
+	word n_large_blocks;
+	word live_bytes; // bytes copied or promoted into the generation,
+	                 // other than into marked blocks
+} Workspace_t;
+
+typedef struct GcThread_s {
+	int id;
+	pthread_t thread;
+	Spinlock_t pending_lock;
+	Blockinfo_t *pending; // full blocks with unscanned objects
+	Workspace_t ws[MAX_GENERATIONS];
+	Obj_t **mark_stack; // objects yet to be scavenged (see gc_mark)
+	word n_mark_stack;
+	word max_mark_stack;
+	Blockinfo_t *sized[NUM_SIZE_CLASSES]; // blocks of sized_gen being
+	                                      // allocated into
+	word survived_bytes[MAX_GENERATIONS]; // copied or promoted out of
+	                                      // each generation
+} GcThread_t;
+
+static GcThread_t gc_threads[MAX_GC_THREADS];
+static int num_gc_threads = 1;
+
+// Workers wait for gc_epoch to change to start a collection, and the
+// thread which called garbage_collect waits for them on gc_done_cond.
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gc_done_cond = PTHREAD_COND_INITIALIZER;
+static word gc_epoch;
+static int gc_threads_done;
+// Number of GC threads which are not idle, for termination detection
+static volatile int gc_running_threads;
+
+// The oldest generation number being collected by the current GC.
+static uint16_t collecting;
+
+static
+void gc_push_pending(GcThread_t *t, Blockinfo_t *bd) {
+	spin_lock(&t->pending_lock);
+	bd->link = t->pending;
+	t->pending = bd;
+	spin_unlock(&t->pending_lock);
+}
+
+static
+Blockinfo_t *gc_pop_pending(GcThread_t *t) {
+	if (t->pending == NULL) {
+		return NULL;
+	}
+	spin_lock(&t->pending_lock);
+	Blockinfo_t *bd = t->pending;
+	if (bd != NULL) {
+		t->pending = bd->link;
+	}
+	spin_unlock(&t->pending_lock);
+	return bd;
+}
+
+// Retire a full todo block: if it still has objects to scan, make it
+// available for stealing.
+static
+void gc_retire_todo_block(GcThread_t *t, Workspace_t *ws, Blockinfo_t *bd) {
+	if (bd->scan < bd->free_ptr) {
+		gc_push_pending(t, bd);
+	} else {
+		bd->link = ws->scanned;
+		ws->scanned = bd;
+	}
+}
+
+// Allocate size bytes of to-space in the given generation from the
+// thread's workspace.
+static
+Obj_t *gc_alloc_to(GcThread_t *t, Generation_t *gen, word size) {
+	Workspace_t *ws = &t->ws[gen - generations];
+	Blockinfo_t *bd = ws->todo_block;
+	if (bd == NULL || BLOCK_SIZE - ((word)bd->free_ptr - (word)bd->start) < size) {
+		Blockinfo_t *fresh = alloc_group(1);
+		fresh->gen = gen;
+		fresh->flags = BF_EVACUATED;
+		fresh->scan = fresh->start;
+		gc_clear_cards(fresh);
+		ws->todo_block = fresh;
+		ws->n_blocks++;
+		if (bd != NULL) {
+			gc_retire_todo_block(t, ws, bd);
+		}
+		bd = fresh;
+	}
+	Obj_t *obj = bd->free_ptr;
+	bd->free_ptr = (void *)NEXT_PTR_ALIGNED((word)bd->free_ptr + size);
+	return obj;
+}
+
+// Protects the old_large lists of the generations during GC
+static Spinlock_t old_large_lock;
+
+// Promote a large object or pinned block by moving its group from the
+// old_large list of its generation to the destination generation.
+// The objects themselves don't move, so the group is claimed with
+// BF_EVACUATED rather than a forwarding pointer, and it is scavenged
+// later from todo_large.
+static
+void gc_promote_large(GcThread_t *t, Blockinfo_t *bd) {
+	if (__sync_fetch_and_or(&bd->flags, BF_EVACUATED) & BF_EVACUATED) {
+		return;
+	}
+	Generation_t *from = bd->gen;
+	Generation_t *dest = from->to_gen != NULL ? from->to_gen : from;
+	spin_lock(&old_large_lock);
+	list_unlink_blockinfo(bd, &from->old_large);
+	spin_unlock(&old_large_lock);
+	// Its cards and remembered set membership were for the old
+	// generation; scavenging it sets them again.
+	__sync_fetch_and_and(&bd->flags, ~BF_DIRTY);
+	gc_clear_cards(bd);
+	((Obj_t *)bd->start)->link = NULL;
+	bd->gen = dest;
+	Workspace_t *ws = &t->ws[dest - generations];
+	bd->link = ws->todo_large;
+	ws->todo_large = bd;
+	ws->n_large_blocks += bd->blocks;
+	ws->live_bytes += (word)bd->free_ptr - (word)bd->start;
+	t->survived_bytes[from - generations] += (word)bd->free_ptr - (word)bd->start;
+}
+
+// Make a fresh block of sized_gen for the given size class, with
+// every slot free.
+static
+Blockinfo_t *gc_new_sized_block(GcThread_t *t, int c) {
+	Workspace_t *ws = &t->ws[sized_gen - generations];
+	Blockinfo_t *bd = alloc_group(1);
+	bd->gen = sized_gen;
+	bd->flags = BF_EVACUATED | BF_SIZED;
+	bd->size_class = c;
+	gc_clear_cards(bd);
+	word size = size_classes[c];
+	Obj_t *free_slots = NULL;
+	for (word i = BLOCK_SIZE / size; i > 0; i--) {
+		Obj_t *slot = (Obj_t *)((word)bd->start + (i - 1) * size);
+		slot->def = &free_slot_def;
+		slot->link = free_slots;
+		free_slots = slot;
+	}
+	bd->free_ptr = free_slots;
+	bd->link = ws->scanned;
+	ws->scanned = bd;
+	ws->n_blocks++;
+	return bd;
+}
+
+// Allocate a slot of the given size class in sized_gen, using the free
+// slots of its existing blocks before fresh blocks.
+static
+Obj_t *gc_alloc_sized(GcThread_t *t, int c) {
+	Blockinfo_t *bd = t->sized[c];
+	if (bd == NULL || bd->free_ptr == NULL) {
+		bd = NULL;
+		if (n_partial_blocks[c] > 0) {
+			spin_lock(&partial_blocks_lock);
+			if (n_partial_blocks[c] > 0) {
+				bd = partial_blocks[c][--n_partial_blocks[c]];
+			}
+			spin_unlock(&partial_blocks_lock);
+		}
+		if (bd == NULL) {
+			bd = gc_new_sized_block(t, c);
+		}
+		t->sized[c] = bd;
+	}
+	Obj_t *slot = bd->free_ptr;
+	bd->free_ptr = slot->link;
+	return slot;
+}
+
+// Put a block of sized_gen with free slots on its partial list.  Only
+// called while the GC threads aren't running.
+static
+void add_partial_block(Blockinfo_t *bd) {
+	int c = bd->size_class;
+	if (n_partial_blocks[c] == max_partial_blocks[c]) {
+		max_partial_blocks[c] = max_partial_blocks[c] == 0 ? 64 : 2 * max_partial_blocks[c];
+		partial_blocks[c] = realloc(partial_blocks[c], max_partial_blocks[c] * sizeof(Blockinfo_t *));
+		guard(partial_blocks[c] != NULL, "Couldn't grow partial block list");
+	}
+	partial_blocks[c][n_partial_blocks[c]++] = bd;
+}
+
+// Undo the allocation of a copy which lost the race to forward obj.
+static
+void gc_unalloc(GcThread_t *t, Generation_t *gen, Obj_t *copy) {
+	Blockinfo_t *bd = get_blockinfo(copy);
+	if (bd->flags & BF_SIZED) {
+		copy->def = &free_slot_def;
+		copy->link = bd->free_ptr;
+		bd->free_ptr = copy;
+		return;
+	}
+	Workspace_t *ws = &t->ws[gen - generations];
+	assert(get_blockinfo(copy) == ws->todo_block, "Lost copy is not in the todo block");
+	ws->todo_block->free_ptr = copy;
+}
+
+// Words of mark bitmap per group (one bit per word of a block)
+#define MARK_WORDS (BLOCK_SIZE / sizeof(word) / 64)
+
+// Push an object on the thread's mark stack to be scavenged.
+static
+void gc_push_mark_stack(GcThread_t *t, Obj_t *obj) {
+	if (t->n_mark_stack == t->max_mark_stack) {
+		t->max_mark_stack = t->max_mark_stack == 0 ? 1024 : 2 * t->max_mark_stack;
+		t->mark_stack = realloc(t->mark_stack, t->max_mark_stack * sizeof(Obj_t *));
+		guard(t->mark_stack != NULL, "Couldn't grow mark stack");
+	}
+	t->mark_stack[t->n_mark_stack++] = obj;
+}
+
+// Whether the object at word offset bit of a BF_MARKED group is marked.
+static inline
+bool gc_is_marked(Blockinfo_t *bd, word bit) {
+	return bd->marks[bit / 64] & ((uint64_t)1 << (bit % 64));
+}
+
+// Whether an object is in a group which has been marked but not yet
+// swept and was not marked itself.  Such an object may point into
+// groups which sweeping has already freed.
+static inline
+bool gc_is_unswept_garbage(Blockinfo_t *bd, Obj_t *obj) {
+	return incremental_phase == INCREMENTAL_SWEEPING && (bd->flags & BF_MARKED)
+		&& !gc_is_marked(bd, ((word)obj - (word)bd->start) / sizeof(word));
+}
+
+// Mark an object in a BF_MARKED group, and if it wasn't already
+// marked push it to be scavenged.
+static
+void gc_mark(GcThread_t *t, Obj_t *obj, Blockinfo_t *bd) {
+	word bit = ((word)obj - (word)bd->start) / sizeof(word);
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	if (bd->marks[bit / 64] & mask) {
+		return;
+	}
+	if (__sync_fetch_and_or(&bd->marks[bit / 64], mask) & mask) {
+		return;
+	}
+	gc_push_mark_stack(t, obj);
+}
+
+// Make *ptr point to the live copy of the object it points to,
+// copying the object into to-space if it has not been already.
+static
+void gc_evacuate(GcThread_t *t, Obj_t **ptr) {
+	Obj_t *obj = *ptr;
+	if (obj == NULL) {
+		return;
+	}
+	Blockinfo_t *bd = get_blockinfo(obj);
+	assert(bd->gen != NULL, "Pointer to an object in a free block");
+	if (bd->gen->num > collecting) {
+		// Not being collected
+		return;
+	}
+	if (bd->flags & (BF_EVACUATED | BF_MARKED | BF_LARGE | BF_PINNED)) {
+		// Already a copy, collected in place, or a large or pinned
+		// object (which is never copied)
+		if (bd->flags & BF_MARKED) {
+			gc_mark(t, obj, bd);
+		} else if (!(bd->flags & BF_EVACUATED)) {
+			gc_promote_large(t, bd);
+		}
+		return;
+	}
+	ObjDef_t *def = obj->def;
+	if ((word)def & FORWARDING_TAG) {
+		*ptr = FORWARDING_PTR(obj);
+		return;
+	}
+	Generation_t *dest = bd->gen->to_gen != NULL ? bd->gen->to_gen : bd->gen;
+	// Use our copy of def since another thread may forward obj meanwhile.
+	word size = def->type == OBJ_TYPE_ARRAY
+		? OBJ_ARRAY_SIZE(obj->payload.array.length) : OBJ_STD_SIZE(def->length);
+	assert(size <= BLOCK_SIZE, "Copying a large object");
+	bool sized = dest == sized_gen && size <= MAX_SIZE_CLASS_BYTES;
+	Obj_t *copy = sized
+		? gc_alloc_sized(t, size_class_of[size / sizeof(word)])
+		: gc_alloc_to(t, dest, size);
+	memcpy(copy, obj, size);
+	copy->def = def;
+	copy->link = NULL; // not in any remembered set yet
+	if (__sync_bool_compare_and_swap(&obj->def, def, (ObjDef_t *)((word)copy | FORWARDING_TAG))) {
+		*ptr = copy;
+		t->survived_bytes[bd->gen - generations] += size;
+		if (sized) {
+			// Slots aren't filled in address order, so the copy can't be
+			// found by scanning its block.
+			Blockinfo_t *copy_bd = get_blockinfo(copy);
+			if (copy_bd->flags & BF_MARKED) {
+				// Counted as live when its block is swept
+				gc_mark(t, copy, copy_bd);
+				return;
+			}
+			gc_push_mark_stack(t, copy);
+		}
+		t->ws[dest - generations].live_bytes += size;
+	} else {
+		// Another thread got there first.
+		gc_unalloc(t, dest, copy);
+		*ptr = FORWARDING_PTR(obj);
+	}
+}
+
+// Evacuate an Obj entry of an object in the given generation, and
+// mark its card if it then points into a younger generation.
+static inline
+void gc_scavenge_entry(GcThread_t *t, Obj_t *obj, Generation_t *gen, Obj_t **entry) {
+	gc_evacuate(t, entry);
+	if (*entry != NULL && get_blockinfo(*entry)->gen->num < gen->num) {
+		gc_mark_card(obj, entry);
+	}
+}
+
+// How many entries ahead of the one being evacuated the scan of a
+// pointer array prefetches what an entry points to
+#define SCAVENGE_PREFETCH_DISTANCE 8
+
+// Evacuate the Obj entries of an object in the given generation which
+// lie in [lo, hi).  Entries which afterwards point into a younger
+// generation have their cards marked.  Objects are scanned by shape:
+// pointer-free objects not at all, pointer arrays as one run whose
+// targets are prefetched ahead, and standard objects by the set bits
+// of their bitmap words.
+static
+void gc_scavenge_range(GcThread_t *t, Obj_t *obj, Generation_t *gen, void *lo, void *hi) {
+	ObjDef_t *def = obj->def;
+	Obj_t **data;
+	word length;
+	if (def->type == OBJ_TYPE_ARRAY) {
+		if (def->bitmap == 0) {
+			return;
+		}
+		data = obj->payload.array.data;
+		length = obj->payload.array.length;
+	} else {
+		if (def->bitmap == 0 && def->bitmap_ext == NULL) {
+			return;
+		}
+		data = obj->payload.obj.data;
+		length = def->length;
+	}
+	word i = 0;
+	if ((void *)data < lo) {
+		i = ((word)lo - (word)data + sizeof(Obj_t *) - 1) / sizeof(Obj_t *);
+	}
+	if ((void *)&data[length] > hi) {
+		length = ((word)hi - (word)data + sizeof(Obj_t *) - 1) / sizeof(Obj_t *);
+	}
+	if (def->type == OBJ_TYPE_ARRAY) {
+		for (; i < length; i++) {
+			if (i + SCAVENGE_PREFETCH_DISTANCE < length) {
+				__builtin_prefetch(data[i + SCAVENGE_PREFETCH_DISTANCE]);
+			}
+			gc_scavenge_entry(t, obj, gen, &data[i]);
+		}
+		return;
+	}
+	for (word w = i / 64; w * 64 < length; w++) {
+		uint64_t bits = w == 0 ? def->bitmap
+			: def->bitmap_ext != NULL ? def->bitmap_ext[w - 1] : 0;
+		if (w == i / 64) {
+			bits &= ~(uint64_t)0 << (i % 64);
+		}
+		if (length - w * 64 < 64) {
+			bits &= ((uint64_t)1 << (length - w * 64)) - 1;
+		}
+		for (; bits != 0; bits &= bits - 1) {
+			gc_scavenge_entry(t, obj, gen, &data[w * 64 + __builtin_ctzll(bits)]);
+		}
+	}
+}
+
+// Evacuate the children of an object in the given generation.
+static inline
+void gc_scavenge(GcThread_t *t, Obj_t *obj, Generation_t *gen) {
+	gc_scavenge_range(t, obj, gen, NULL, (void *)-1);
+}
+
+// Scavenge a block from a pending queue starting at its scan pointer.
+static
+void gc_scavenge_block(GcThread_t *t, Blockinfo_t *bd) {
+	Generation_t *gen = bd->gen;
+	while (bd->scan < bd->free_ptr) {
+		Obj_t *obj = bd->scan;
+		bd->scan = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+		gc_scavenge(t, obj, gen);
+	}
+	Workspace_t *ws = &t->ws[gen - generations];
+	bd->link = ws->scanned;
+	ws->scanned = bd;
+}
+
+// Scavenge the thread's own todo blocks and large objects.  Returns
+// whether any work was done.
+static
+bool gc_scavenge_todo(GcThread_t *t) {
+	bool progress = false;
+	for (int k = 0; k < num_generations; k++) {
+		Workspace_t *ws = &t->ws[k];
+		Blockinfo_t *bd;
+		while ((bd = ws->todo_block) != NULL && bd->scan < bd->free_ptr) {
+			// Once bd is retired another thread may own it, so recheck
+			// that it is still our todo block before each object.
+			while (bd == ws->todo_block && bd->scan < bd->free_ptr) {
+				Obj_t *obj = bd->scan;
+				bd->scan = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+				gc_scavenge(t, obj, &generations[k]);
+			}
+			progress = true;
+		}
+		while (ws->todo_large != NULL) {
+			bd = ws->todo_large;
+			ws->todo_large = bd->link;
+			// A large object's group holds just the one object, while
+			// everything in a pinned block is kept.
+			for (void *p = bd->start; p < bd->free_ptr; ) {
+				Obj_t *obj = p;
+				p = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+				gc_scavenge(t, obj, &generations[k]);
+			}
+			bd->link = ws->large;
+			ws->large = bd;
+			progress = true;
+		}
+	}
+	while (t->n_mark_stack > 0) {
+		Obj_t *obj = t->mark_stack[--t->n_mark_stack];
+		gc_scavenge(t, obj, get_blockinfo(obj)->gen);
+		progress = true;
+	}
+	return progress;
+}
+
+// Take a pending block from our own queue or else steal one.
+static
+Blockinfo_t *gc_find_work(GcThread_t *t) {
+	Blockinfo_t *bd = gc_pop_pending(t);
+	for (int i = 1; bd == NULL && i < num_gc_threads; i++) {
+		bd = gc_pop_pending(&gc_threads[(t->id + i) % num_gc_threads]);
+	}
+	return bd;
+}
+
+static
+bool gc_any_pending(void) {
+	for (int i = 0; i < num_gc_threads; i++) {
+		if (gc_threads[i].pending != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Scavenge the dirty cards of a group in a generation which is not
+// being collected.  The cards are cleared first, and marked again for
+// entries which still point into a younger generation.
+static
+void gc_scavenge_dirty_group(GcThread_t *t, Blockinfo_t *head) {
+	Generation_t *gen = head->gen;
+	word blocks = carded_blocks(head);
+	for (word j = 0; j < blocks; j++) {
+		Blockinfo_t *bd = (Blockinfo_t *)((struct Blockinfo_aligned_s *)head + j);
+		for (word c = 0; c < CARDS_PER_BLOCK; c++) {
+			if (bd->cards[c] == 0) {
+				continue;
+			}
+			bd->cards[c] = 0;
+			void *lo = (void *)((word)bd->start + c * CARD_SIZE);
+			void *hi = (void *)((word)lo + CARD_SIZE);
+			if (head->flags & BF_LARGE) {
+				gc_scavenge_range(t, head->start, gen, lo, hi);
+				continue;
+			}
+			if (head->flags & BF_SIZED) {
+				word size = size_classes[head->size_class];
+				word first = ((word)lo - (word)head->start) / size;
+				for (word i = first; i < BLOCK_SIZE / size; i++) {
+					Obj_t *obj = (Obj_t *)((word)head->start + i * size);
+					if ((void *)obj >= hi) {
+						break;
+					}
+					if (obj->def != &free_slot_def && !gc_is_unswept_garbage(head, obj)) {
+						gc_scavenge_range(t, obj, gen, lo, hi);
+					}
+				}
+				continue;
+			}
+			// A block of small objects, which don't straddle blocks
+			for (void *p = head->start; p < head->free_ptr && p < hi; ) {
+				Obj_t *obj = p;
+				p = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+				if (p > lo && !gc_is_unswept_garbage(head, obj)) {
+					gc_scavenge_range(t, obj, gen, lo, hi);
+				}
+			}
+		}
+	}
+}
+
+// The dirty lists and remembered sets of the generations which are not
+// being collected, taken before the GC threads start since scavenging
+// rebuilds them.  They are scavenged by the collecting thread before
+// the other GC threads start, since another thread could be copying
+// into a free slot of a sized block while its cards are scanned.
+static Blockinfo_t **dirty_snapshot;
+static word n_dirty_snapshot;
+static word max_dirty_snapshot;
+static Obj_t *remembered_snapshot[MAX_GENERATIONS];
+
+static
+void gc_take_remembered(void) {
+	n_dirty_snapshot = 0;
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		if (gen->num <= collecting) {
+			remembered_snapshot[k] = (void *)-1;
+			continue;
+		}
+		if (n_dirty_snapshot + gen->n_dirty > max_dirty_snapshot) {
+			max_dirty_snapshot = 2 * (n_dirty_snapshot + gen->n_dirty);
+			dirty_snapshot = realloc(dirty_snapshot, max_dirty_snapshot * sizeof(Blockinfo_t *));
+			guard(dirty_snapshot != NULL, "Couldn't allocate dirty list snapshot");
+		}
+		for (word i = 0; i < gen->n_dirty; i++) {
+			gen->dirty[i]->flags &= ~BF_DIRTY;
+			dirty_snapshot[n_dirty_snapshot++] = gen->dirty[i];
+		}
+		gen->n_dirty = 0;
+		remembered_snapshot[k] = gen->remembered;
+		gen->remembered = (void *)-1;
+	}
+}
+
+// Scavenge what gc_take_remembered took: the dirty cards and the
+// remembered objects of the generations which are not being collected.
+static
+void gc_scavenge_remembered(GcThread_t *t) {
+	for (word i = 0; i < n_dirty_snapshot; i++) {
+		gc_scavenge_dirty_group(t, dirty_snapshot[i]);
+	}
+	for (int k = 0; k < num_generations; k++) {
+		Obj_t *obj = remembered_snapshot[k];
+		while (obj != (void *)-1) {
+			Obj_t *next = obj->link;
+			obj->link = NULL;
+			gc_scavenge(t, obj, &generations[k]);
+			obj = next;
+		}
+	}
+}
+
+// The work of one GC thread: evacuate its share of the roots, then
+// scavenge until no thread has anything left to do.  A thread only
+// goes idle with its own queue empty, so when no thread is running
+// there is no pending work anywhere.
+static
+void gc_thread_work(GcThread_t *t) {
+	double start_ns = gc_trace_start();
+	for (int i = t->id; i < num_roots; i += num_gc_threads) {
+		gc_evacuate(t, roots[i]);
+	}
+	for (;;) {
+		Blockinfo_t *bd;
+		if (gc_scavenge_todo(t)) {
+			continue;
+		}
+		if ((bd = gc_find_work(t)) != NULL) {
+			gc_scavenge_block(t, bd);
+			continue;
+		}
+		__sync_fetch_and_sub(&gc_running_threads, 1);
+		for (;;) {
+			if (gc_any_pending()) {
+				__sync_fetch_and_add(&gc_running_threads, 1);
+				break;
+			}
+			if (gc_running_threads == 0) {
+				gc_trace("scavenge", t->id, collecting, start_ns);
+				return;
+			}
+			sched_yield();
+		}
+	}
+}
+
+static
+void *gc_worker(void *arg) {
+	GcThread_t *t = arg;
+	word seen = 0;
+	// To-space blocks come from this thread's own block cache.
+	attach_block_cache();
+	for (;;) {
+		pthread_mutex_lock(&gc_mutex);
+		while (gc_epoch == seen) {
+			pthread_cond_wait(&gc_start_cond, &gc_mutex);
+		}
+		seen = gc_epoch;
+		pthread_mutex_unlock(&gc_mutex);
+
+		gc_thread_work(t);
+
+		pthread_mutex_lock(&gc_mutex);
+		gc_threads_done++;
+		pthread_cond_signal(&gc_done_cond);
+		pthread_mutex_unlock(&gc_mutex);
+	}
+	return NULL;
+}
+
+// Set the number of threads which take part in a collection.  The
+// thread calling garbage_collect is one of them, and the rest are
+// started here.  The number of threads can only grow.
+void init_gc_threads(int num_threads) {
+	guard(num_threads <= MAX_GC_THREADS, "Number of GC threads exceeds MAX_GC_THREADS");
+	for (int i = num_gc_threads; i < num_threads; i++) {
+		gc_threads[i].id = i;
+		if (pthread_create(&gc_threads[i].thread, NULL, gc_worker, &gc_threads[i]) != 0) {
+			error("init_gc_threads unable to start GC thread");
+		}
+	}
+	if (num_threads > num_gc_threads) {
+		num_gc_threads = num_threads;
+	}
+}
+
+// Give a thread's evacuated blocks to their generations.
+static
+void gc_collect_workspaces(GcThread_t *t) {
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		Workspace_t *ws = &t->ws[k];
+		if (ws->todo_block != NULL) {
+			assert(ws->todo_block->scan == ws->todo_block->free_ptr,
+						 "Todo block was not fully scanned");
+			ws->todo_block->link = ws->scanned;
+			ws->scanned = ws->todo_block;
+		}
+		Blockinfo_t *bd, *next;
+		for (bd = ws->scanned; bd != NULL; bd = next) {
+			next = bd->link;
+			bd->flags &= ~BF_EVACUATED;
+			bd->link = gen->blocks;
+			gen->blocks = bd;
+		}
+		for (bd = ws->large; bd != NULL; bd = next) {
+			next = bd->link;
+			bd->flags &= ~BF_EVACUATED;
+			list_link_blockinfo(bd, &gen->large);
+		}
+		gen->n_blocks += ws->n_blocks;
+		gen->n_large_blocks += ws->n_large_blocks;
+		gen->live_bytes += ws->live_bytes;
+		*ws = (Workspace_t){0};
+	}
+}
+
+// Mark bitmaps for the groups of the generation being marked
+static uint64_t *mark_bitmaps;
+static word max_mark_bitmaps;
+
+// The live bytes of the generation being marked when marking started,
+// and those its sweep has found so far.  Objects copied or promoted
+// into it meanwhile, outside its marked groups, count as live too.
+static word marked_base_bytes, swept_bytes;
+
+// Prepare the groups of the generation to be collected in place by
+// giving each a cleared mark bitmap.
+static
+void gc_start_marking(Generation_t *gen) {
+	marked_base_bytes = gen->live_bytes;
+	swept_bytes = 0;
+	word groups = gen->n_blocks;
+	for (Blockinfo_t *bd = gen->large; bd != NULL; bd = bd->link) {
+		groups++;
+	}
+	if (groups * MARK_WORDS > max_mark_bitmaps) {
+		max_mark_bitmaps = 2 * groups * MARK_WORDS;
+		free(mark_bitmaps);
+		mark_bitmaps = malloc(max_mark_bitmaps * sizeof(uint64_t));
+		guard(mark_bitmaps != NULL, "Couldn't allocate mark bitmaps");
+	}
+	memset(mark_bitmaps, 0, groups * MARK_WORDS * sizeof(uint64_t));
+	uint64_t *marks = mark_bitmaps;
+	Blockinfo_t *lists[] = {gen->blocks, gen->large};
+	for (int l = 0; l < 2; l++) {
+		for (Blockinfo_t *bd = lists[l]; bd != NULL; bd = bd->link) {
+			bd->flags |= BF_MARKED;
+			bd->marks = marks;
+			marks += MARK_WORDS;
+		}
+	}
+}
+
+// Clear the cards and remembered set of a generation marked in a
+// pause, which scavenging its marked objects sets again.
+static
+void gc_forget_remembered(Generation_t *gen) {
+	Blockinfo_t *lists[] = {gen->blocks, gen->large};
+	for (int l = 0; l < 2; l++) {
+		for (Blockinfo_t *bd = lists[l]; bd != NULL; bd = bd->link) {
+			bd->flags &= ~BF_DIRTY;
+			gc_clear_cards(bd);
+		}
+	}
+	for (Obj_t *obj = gen->remembered; obj != (void *)-1; ) {
+		Obj_t *next = obj->link;
+		obj->link = NULL;
+		obj = next;
+	}
+	gen->remembered = (void *)-1;
+	gen->n_dirty = 0;
+}
+
+// Fillers overwrite dead objects in blocks of marked objects.  Neither
+// kind has Obj entries.
+static ObjDef_t small_filler_def = {.type = OBJ_TYPE_STD, .length = 0, .bitmap = 0};
+static ObjDef_t filler_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 0};
+
+// Overwrite the bytes from start to end with a filler object.
+static
+void gc_fill(void *start, void *end) {
+	Obj_t *filler = start;
+	word size = (word)end - (word)start;
+	filler->link = NULL;
+	if (size < OBJ_ARRAY_SIZE(0)) {
+		assert(size == OBJ_STD_SIZE(0), "Hole is too small for a filler");
+		filler->def = &small_filler_def;
+	} else {
+		filler->def = &filler_def;
+		filler->payload.array.length = (size - OBJ_ARRAY_SIZE(0)) / sizeof(Obj_t *);
+	}
+}
+
+// Rebuild the free slots of a BF_SIZED block from its unmarked slots,
+// in address order.  Returns the bytes of the objects in its marked
+// slots.
+static
+word gc_sweep_sized_block(Blockinfo_t *bd) {
+	word size = size_classes[bd->size_class];
+	Obj_t *free_slots = NULL;
+	word live_bytes = 0;
+	for (word i = BLOCK_SIZE / size; i > 0; i--) {
+		Obj_t *slot = (Obj_t *)((word)bd->start + (i - 1) * size);
+		if (gc_is_marked(bd, (i - 1) * size / sizeof(word))) {
+			live_bytes += NEXT_PTR_ALIGNED(obj_size(slot));
+			continue;
+		}
+		slot->def = &free_slot_def;
+		slot->link = free_slots;
+		free_slots = slot;
+	}
+	bd->free_ptr = free_slots;
+	return live_bytes;
+}
+
+// Fill the dead objects of a block of bump-allocated objects, which
+// then ends after its last marked object.  Returns the bytes of its
+// marked objects.
+static
+word gc_sweep_block(Blockinfo_t *bd) {
+	word live_bytes = 0;
+	void *hole = bd->start, *last_end = bd->start;
+	for (void *p = bd->start; p < bd->free_ptr; ) {
+		Obj_t *obj = p;
+		p = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+		if (gc_is_marked(bd, ((word)obj - (word)bd->start) / sizeof(word))) {
+			if (hole < (void *)obj) {
+				gc_fill(hole, obj);
+			}
+			hole = last_end = p;
+			live_bytes += (word)p - (word)obj;
+		}
+	}
+	bd->free_ptr = last_end;
+	return live_bytes;
+}
+
+// Sweep a group of a marked generation: free it if nothing in it is
+// marked, and otherwise put it back on the generation's blocks, and on
+// a partial list if it is a sized block with free slots.  Adds the
+// marked bytes of a block of bump-allocated objects to *live_bytes and
+// counts it in *n_bump_blocks.
+static
+void gc_sweep_group(Generation_t *gen, Blockinfo_t *bd, word *n_bump_blocks, word *live_bytes) {
+	word block_bytes;
+	// Mutators may be setting BF_DIRTY meanwhile.
+	__sync_fetch_and_and(&bd->flags, ~BF_MARKED);
+	if (bd->flags & BF_SIZED) {
+		block_bytes = gc_sweep_sized_block(bd);
+		if (block_bytes > 0 && bd->free_ptr != NULL) {
+			add_partial_block(bd);
+		}
+	} else {
+		block_bytes = gc_sweep_block(bd);
+		if (block_bytes > 0) {
+			*live_bytes += block_bytes;
+			(*n_bump_blocks)++;
+		}
+	}
+	swept_bytes += block_bytes;
+	if (block_bytes == 0) {
+		free_group(bd);
+		gen->n_blocks--;
+		return;
+	}
+	bd->link = gen->blocks;
+	gen->blocks = bd;
+}
+
+// Free the marked large objects of a generation which were not marked
+// themselves, and the marked pinned blocks with nothing marked.  The
+// dead objects of the other pinned blocks are filled.
+static
+void gc_sweep_large(Generation_t *gen) {
+	Blockinfo_t *bd, *next, *kept = NULL;
+	word n_kept = 0;
+	for (bd = gen->large; bd != NULL; bd = next) {
+		next = bd->link;
+		bool marked = bd->flags & BF_MARKED;
+		bd->flags &= ~BF_MARKED;
+		if (marked) {
+			word bytes = bd->flags & BF_PINNED ? gc_sweep_block(bd)
+				: (bd->marks[0] & 1) ? (word)bd->free_ptr - (word)bd->start : 0;
+			if (bytes == 0) {
+				free_group(bd);
+				continue;
+			}
+			swept_bytes += bytes;
+		}
+		list_link_blockinfo(bd, &kept);
+		n_kept += bd->blocks;
+	}
+	gen->large = kept;
+	gen->n_large_blocks = n_kept;
+}
+
+// Count what a finished sweep found live.
+static
+void gc_end_sweep(Generation_t *gen) {
+	gen->live_bytes = gen->live_bytes - marked_base_bytes + swept_bytes;
+	gen->survival_rate = marked_base_bytes > 0 ? (double)swept_bytes / marked_base_bytes : 0;
+}
+
+// Sweep a generation marked in a pause.  Decides whether to compact
+// the generation next time from the free space in its blocks of
+// bump-allocated objects, since the free slots of sized blocks are
+// reused without compaction.
+static
+void gc_sweep(Generation_t *gen) {
+	// Rebuilt from every swept block, including those taken during the
+	// collection.
+	for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+		n_partial_blocks[c] = 0;
+	}
+	Blockinfo_t *bd = gen->blocks, *next;
+	word n_bump_blocks = 0, live_bytes = 0;
+	gen->blocks = NULL;
+	for (; bd != NULL; bd = next) {
+		next = bd->link;
+		gc_sweep_group(gen, bd, &n_bump_blocks, &live_bytes);
+	}
+	gc_sweep_large(gen);
+	gc_end_sweep(gen);
+
+	word capacity = n_bump_blocks * BLOCK_SIZE;
+	compact_oldest = capacity > 0
+		&& 100 * (capacity - live_bytes) > (word)compaction_threshold * capacity;
+}
+
+// The blocks the nurseries and the younger generations may take up.
+static
+word young_blocks(void) {
+	word blocks = 0;
+	for (int i = 0; i < num_nurseries; i++) {
+		blocks += nurseries[i].n_blocks * (nurseries[i].realtime ? 2 : 1);
+	}
+	for (int k = 1; k < num_generations && generations[k].to_gen != NULL; k++) {
+		blocks += generations[k].n_max_blocks;
+	}
+	return blocks;
+}
+
+// Keep the threshold of the oldest generation within what the heap
+// bounds leave it.
+static
+void gc_bound_oldest(Generation_t *gen) {
+	word young = young_blocks();
+	if (max_heap_blocks != (word)-1) {
+		word max_blocks = max_heap_blocks > young ? max_heap_blocks - young : 0;
+		if (gen->n_max_blocks > max_blocks) {
+			gen->n_max_blocks = max_blocks;
+		}
+	}
+	if (min_heap_blocks > young && gen->n_max_blocks < min_heap_blocks - young) {
+		gen->n_max_blocks = min_heap_blocks - young;
+	}
+}
+
+// Let the oldest generation grow with its live data.
+static
+void gc_resize_oldest(Generation_t *gen) {
+	word live = 2 * (gen->n_blocks + gen->n_large_blocks);
+	word min_blocks = NURSERY_BLOCKS << (2 * gen->num);
+	gen->n_max_blocks = live > min_blocks ? live : min_blocks;
+	gc_bound_oldest(gen);
+}
+
+////// Incremental collection
+//
+// With a slice budget set, the oldest generation is never collected in
+// a pause.  Once it outgrows n_max_blocks, the next collection starts
+// marking it in place, and gc_slice then marks and sweeps it a bounded
+// number of words at a time, between collections of the younger
+// generations.  Marking is snapshot-at-the-beginning: when it starts,
+// the roots and every object of the younger generations (the nursery
+// is empty then) shade what they point to in the oldest generation,
+// and until it finishes gc_write_field shades what it overwrites, so
+// everything reachable when marking started is marked.  Objects
+// promoted meanwhile go in fresh groups, which aren't swept, or in
+// slots of marked blocks, which are marked as they are copied into.
+// The oldest generation is not compacted in this mode.
+
+// Mark an object of the oldest generation while it is being marked
+// incrementally, and if it wasn't already marked push it to be traced.
+// This is the slow path of gc_write_field.
+void gc_shade(Obj_t *obj) {
+	Blockinfo_t *bd = get_blockinfo(obj);
+	if (!(bd->flags & BF_MARKED)) {
+		return;
+	}
+	word bit = ((word)obj - (word)bd->start) / sizeof(word);
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	if (bd->marks[bit / 64] & mask) {
+		return;
+	}
+	if (__sync_fetch_and_or(&bd->marks[bit / 64], mask) & mask) {
+		return;
+	}
+	spin_lock(&grey_lock);
+	if (n_grey_objects == max_grey_objects) {
+		max_grey_objects = max_grey_objects == 0 ? 1024 : 2 * max_grey_objects;
+		grey_objects = realloc(grey_objects, max_grey_objects * sizeof(Obj_t *));
+		guard(grey_objects != NULL, "Couldn't grow grey objects");
+	}
+	grey_objects[n_grey_objects++] = obj;
+	spin_unlock(&grey_lock);
+}
+
+// The number of entries of an object which may be Objs.
+static inline
+word gc_obj_entries(Obj_t *obj) {
+	ObjDef_t *def = obj->def;
+	if (def->type == OBJ_TYPE_ARRAY) {
+		return def->bitmap == 0 ? 0 : obj->payload.array.length;
+	}
+	return def->bitmap == 0 && def->bitmap_ext == NULL ? 0 : def->length;
+}
+
+// Shade what entries [from, to) of an object point to.
+static
+void gc_shade_entries(Obj_t *obj, word from, word to) {
+	ObjDef_t *def = obj->def;
+	Obj_t **data = def->type == OBJ_TYPE_ARRAY
+		? obj->payload.array.data : obj->payload.obj.data;
+	for (word i = from; i < to; i++) {
+		if (obj_entry_is_obj(def, i) && data[i] != NULL) {
+			gc_shade(data[i]);
+		}
+	}
+}
+
+// Start marking the oldest generation incrementally.  Called at the
+// end of a collection, when the nursery is empty.
+static
+void gc_start_incremental(void) {
+	gc_start_marking(&generations[num_generations - 1]);
+	incremental_phase = INCREMENTAL_MARKING;
+	gc_incremental_marking = true;
+	for (int i = 0; i < num_roots; i++) {
+		if (*roots[i] != NULL) {
+			gc_shade(*roots[i]);
+		}
+	}
+	for (int k = 0; k < num_generations - 1; k++) {
+		Generation_t *gen = &generations[k];
+		Blockinfo_t *lists[] = {gen->blocks, gen->large};
+		for (int l = 0; l < 2; l++) {
+			for (Blockinfo_t *bd = lists[l]; bd != NULL; bd = bd->link) {
+				for (void *p = bd->start; p < bd->free_ptr; ) {
+					Obj_t *obj = p;
+					p = (void *)NEXT_PTR_ALIGNED((word)obj + obj_size(obj));
+					gc_shade_entries(obj, 0, gc_obj_entries(obj));
+				}
+			}
+		}
+	}
+}
+
+// Whether anything in a marked group is marked.
+static
+bool gc_group_marked(Blockinfo_t *bd) {
+	for (word i = 0; i < MARK_WORDS; i++) {
+		if (bd->marks[i] != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Finish marking and prepare to sweep: the dirty groups and remembered
+// objects which are garbage are forgotten, since their groups may be
+// freed before the next collection scans them, the large objects are
+// swept, and the marked blocks are set aside to be swept.
+static
+void gc_start_sweeping(void) {
+	Generation_t *gen = &generations[num_generations - 1];
+	gc_incremental_marking = false;
+	incremental_phase = INCREMENTAL_SWEEPING;
+	word n_dirty = 0;
+	for (word i = 0; i < gen->n_dirty; i++) {
+		Blockinfo_t *head = gen->dirty[i];
+		if (!(head->flags & BF_MARKED) || gc_group_marked(head)) {
+			gen->dirty[n_dirty++] = head;
+		}
+	}
+	gen->n_dirty = n_dirty;
+	Obj_t *remembered = (void *)-1;
+	for (Obj_t *obj = gen->remembered, *next; obj != (void *)-1; obj = next) {
+		next = obj->link;
+		if (gc_is_unswept_garbage(get_blockinfo(obj), obj)) {
+			obj->link = NULL;
+		} else {
+			obj->link = remembered;
+			remembered = obj;
+		}
+	}
+	gen->remembered = remembered;
+	// Swept blocks go back on the partial lists.
+	for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+		word n = 0;
+		for (word i = 0; i < n_partial_blocks[c]; i++) {
+			if (!(partial_blocks[c][i]->flags & BF_MARKED)) {
+				partial_blocks[c][n++] = partial_blocks[c][i];
+			}
+		}
+		n_partial_blocks[c] = n;
+	}
+	gc_sweep_large(gen);
+	Blockinfo_t *bd, *next, *kept = NULL;
+	for (bd = gen->blocks; bd != NULL; bd = next) {
+		next = bd->link;
+		if (bd->flags & BF_MARKED) {
+			bd->link = unswept_blocks;
+			unswept_blocks = bd;
+		} else {
+			bd->link = kept;
+			kept = bd;
+		}
+	}
+	gen->blocks = kept;
+}
+
+// Trace shaded objects for up to budget words, where an object costs
+// a word plus its entries.  Objects are traced up to the budget at a
+// time, so that a large array doesn't make for a long slice.  Returns
+// what is left of the budget, which is only non-zero once there is
+// nothing left to trace.
+static
+word gc_mark_work(word budget) {
+	while (budget > 0) {
+		if (tracing == NULL) {
+			spin_lock(&grey_lock);
+			if (n_grey_objects > 0) {
+				tracing = grey_objects[--n_grey_objects];
+			}
+			spin_unlock(&grey_lock);
+			if (tracing == NULL) {
+				break;
+			}
+			tracing_entry = 0;
+			budget--;
+		}
+		word entries = gc_obj_entries(tracing);
+		word end = entries - tracing_entry < budget ? entries : tracing_entry + budget;
+		gc_shade_entries(tracing, tracing_entry, end);
+		budget -= end - tracing_entry;
+		tracing_entry = end;
+		if (end == entries) {
+			tracing = NULL;
+		}
+	}
+	return budget;
+}
+
+// Sweep marked blocks for up to budget words, a block costing its size
+// in words, and finish the collection once they are all swept.
+static
+void gc_sweep_work(word budget) {
+	Generation_t *gen = &generations[num_generations - 1];
+	word n_bump_blocks = 0, live_bytes = 0;
+	while (unswept_blocks != NULL && budget > 0) {
+		Blockinfo_t *bd = unswept_blocks;
+		unswept_blocks = bd->link;
+		gc_sweep_group(gen, bd, &n_bump_blocks, &live_bytes);
+		budget -= BLOCK_SIZE / sizeof(word) < budget ? BLOCK_SIZE / sizeof(word) : budget;
+	}
+	if (unswept_blocks == NULL) {
+		incremental_phase = INCREMENTAL_IDLE;
+		gc_end_sweep(gen);
+		gen->collections++;
+		gc_resize_oldest(gen);
+	}
+}
+
+// Do up to budget words of incremental marking and sweeping.  The
+// mutators must be stopped, since marking is finished once nothing is
+// left to trace.
+static
+void gc_incremental_work(word budget) {
+	if (incremental_phase == INCREMENTAL_MARKING) {
+		budget = gc_mark_work(budget);
+		if (tracing == NULL && n_grey_objects == 0) {
+			gc_start_sweeping();
+		}
+	}
+	if (incremental_phase == INCREMENTAL_SWEEPING) {
+		gc_sweep_work(budget);
+	}
+}
+
+////// Background collection
+//
+// With the background collector on, the incremental marking and
+// sweeping is done by a thread of its own while the mutators run,
+// BACKGROUND_CHUNK_WORDS at a time.  It never runs alongside a
+// collection: garbage_collect waits for it to finish its chunk first.
+// While mutators may be shading objects it can't tell when marking is
+// finished, so once it runs out of objects to trace the next
+// collection remarks: it traces whatever was shaded since, with the
+// mutators stopped, and then starts sweeping.
+
+#define BACKGROUND_CHUNK_WORDS 4096
+
+static pthread_t background_thread;
+static bool background_started;
+// Held by the background thread while it works, and by whatever must
+// not run alongside it
+static pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_cond = PTHREAD_COND_INITIALIZER;
+// Number of threads waiting for background_lock
+static volatile int background_waiters;
+// Whether the background thread has run out of objects to trace
+static bool background_drained;
+
+static
+bool background_has_work(void) {
+	return background_enabled && background_waiters == 0
+		&& ((incremental_phase == INCREMENTAL_MARKING && !background_drained)
+				|| incremental_phase == INCREMENTAL_SWEEPING);
+}
+
+static
+void *gc_background(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&background_lock);
+	for (;;) {
+		if (!background_has_work()) {
+			pthread_cond_wait(&background_cond, &background_lock);
+			continue;
+		}
+		double start_ns = gc_trace_start();
+		if (incremental_phase == INCREMENTAL_MARKING) {
+			if (gc_mark_work(BACKGROUND_CHUNK_WORDS) > 0) {
+				background_drained = true;
+			}
+			gc_trace("mark", BACKGROUND_THREAD_ID, num_generations - 1, start_ns);
+		} else {
+			gc_sweep_work(BACKGROUND_CHUNK_WORDS);
+			gc_trace("sweep", BACKGROUND_THREAD_ID, num_generations - 1, start_ns);
+		}
+	}
+	return NULL;
+}
+
+// Stop the background thread between chunks of work, until
+// resume_background.
+static
+void pause_background(void) {
+	if (!background_started) {
+		return;
+	}
+	__sync_fetch_and_add(&background_waiters, 1);
+	pthread_mutex_lock(&background_lock);
+	__sync_fetch_and_sub(&background_waiters, 1);
+}
+
+static
+void resume_background(void) {
+	if (!background_started) {
+		return;
+	}
+	pthread_cond_signal(&background_cond);
+	pthread_mutex_unlock(&background_lock);
+}
+
+// Finish marking with the mutators stopped, if the background thread
+// has traced everything shaded before.  Returns whether it did.
+static
+bool gc_remark(void) {
+	if (background_enabled && incremental_phase == INCREMENTAL_MARKING
+			&& background_drained) {
+		gc_mark_work((word)-1);
+		gc_start_sweeping();
+		background_drained = false;
+		return true;
+	}
+	return false;
+}
+
+// Bytes allocated in the nurseries since the last collection.
+static
+word nursery_allocated_bytes(void) {
+	word bytes = large_allocated_bytes;
+	for (int i = 0; i < num_nurseries; i++) {
+		Nursery_t *nursery = &nurseries[i];
+		Blockinfo_t *bd;
+		for (bd = nursery->retired_blocks; bd != NULL; bd = bd->link) {
+			bytes += (word)bd->free_ptr - (word)bd->start;
+		}
+		for (bd = nursery->blocks; bd != nursery->alloc_block; bd = bd->link) {
+			bytes += (word)bd->free_ptr - (word)bd->start;
+		}
+		bytes += (word)nursery->free_ptr - (word)bd->start;
+	}
+	return bytes;
+}
+
+////// Adaptive sizing
+//
+// With a target overhead set, each collection measures the fraction
+// of time spent collecting and resizes the nurseries towards the
+// target: a nursery collection costs about what survives it, so the
+// overhead of nursery collections falls as the nursery grows.  The
+// thresholds of the younger generations follow their survival rates,
+// and the oldest generation is sized by gc_resize_oldest, all within
+// the heap bounds.
+
+// Set the percentage of time to aim to spend collecting.  Collections
+// then resize the nurseries and the thresholds of the younger
+// generations (see gc_adapt_sizes).  0, the default, keeps them fixed.
+void set_gc_target_overhead(int percent) {
+	guard(percent >= 0 && percent < 100, "Target overhead must be a percentage below 100");
+	target_overhead = percent;
+}
+
+// Bound the heap, in blocks.  The oldest generation is collected once
+// the heap would outgrow max_blocks, and not before it reaches
+// min_blocks, and the nurseries and younger generations get at most
+// half of max_blocks.  Only live data beyond max_blocks makes the heap
+// bigger.
+void set_gc_heap_bounds(word min_blocks, word max_blocks) {
+	guard(min_blocks <= max_blocks, "Minimum heap size is above the maximum");
+	min_heap_blocks = min_blocks;
+	max_heap_blocks = max_blocks;
+	if (num_generations > 0) {
+		gc_resize_oldest(&generations[num_generations - 1]);
+	}
+}
+
+// Give a nursery which has been collected n fresh blocks.
+static
+void nursery_resize(Nursery_t *nursery, word n) {
+	free_group_list(nursery->blocks);
+	nursery_alloc_blocks(nursery, n);
+	nursery->rebind = numa_nurseries && nursery - nurseries < num_claimed_nurseries;
+}
+
+static inline
+word clamp_blocks(word blocks, word min_blocks, word max_blocks) {
+	return blocks < min_blocks ? min_blocks : blocks > max_blocks ? max_blocks : blocks;
+}
+
+// Resize after a collection which paused for pause_ns after the
+// mutators ran for mutator_ns.
+static
+void gc_adapt_sizes(double pause_ns, double mutator_ns) {
+	double overhead = pause_ns / (pause_ns + mutator_ns);
+	gc_overhead = gc_collections == 0 ? overhead : (3 * gc_overhead + overhead) / 4;
+	if (target_overhead == 0) {
+		return;
+	}
+	// The nurseries and the younger generations get at most half the
+	// heap between them.
+	word young_max = max_heap_blocks / 4;
+	double ratio = gc_overhead * 100 / target_overhead;
+	ratio = ratio < 0.5 ? 0.5 : ratio > 2 ? 2 : ratio;
+	word blocks = clamp_blocks(nursery_blocks * ratio, MIN_NURSERY_BLOCKS,
+														 clamp_blocks(young_max / num_nurseries, MIN_NURSERY_BLOCKS,
+																					MAX_NURSERY_BLOCKS));
+	// Small changes aren't worth reallocating the nurseries for.
+	if (8 * blocks < 7 * nursery_blocks || 8 * blocks > 9 * nursery_blocks) {
+		nursery_blocks = blocks;
+		for (int i = 0; i < num_nurseries; i++) {
+			if (!nurseries[i].realtime) {
+				nursery_resize(&nurseries[i], blocks);
+			}
+		}
+	}
+	// A step whose objects mostly die is given the time for the rest to
+	// die too, while one whose objects mostly survive would only delay
+	// their promotion.
+	int steps = 0;
+	for (int k = 1; k < num_generations && generations[k].to_gen != NULL; k++) {
+		steps++;
+	}
+	for (int k = 1; k <= steps; k++) {
+		Generation_t *gen = &generations[k];
+		if (gen->collections == 0) {
+			continue;
+		}
+		double survival = gen->survival_rate < 1.0 / 16 ? 1.0 / 16 : gen->survival_rate;
+		gen->n_max_blocks = clamp_blocks(nursery_blocks * (1 - survival) / survival,
+																		 MIN_NURSERY_BLOCKS,
+																		 clamp_blocks(young_max / steps, MIN_NURSERY_BLOCKS,
+																									(word)-1));
+	}
+	gc_bound_oldest(&generations[num_generations - 1]);
+}
+
+// Collection of every generation numbered at most the highest
+// generation which has exceeded its n_max_blocks.  The nursery is
+// always collected.  In incremental mode the oldest generation is
+// instead marked and swept by gc_slice.  The world must be stopped.
+static
+void collect(void) {
+	guard(num_generations > 0, "No generations to collect into");
+	double start_ns = gc_now_ns();
+	pause_background();
+	word allocated = nursery_allocated_bytes();
+	allocated_bytes += allocated;
+	if (start_ns > last_gc_end_ns) {
+		allocation_rate = allocated * 1e9 / (start_ns - last_gc_end_ns);
+	}
+
+	collecting = 0;
+	bool start_incremental = false;
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		if (gen->n_blocks + gen->n_large_blocks > gen->n_max_blocks
+				&& gen->num > collecting) {
+			if ((slice_words != 0 || background_enabled) && gen->to_gen == NULL) {
+				start_incremental = incremental_phase == INCREMENTAL_IDLE;
+				continue;
+			}
+			collecting = gen->num;
+		}
+	}
+
+	// Set aside the from-space of the collected generations, except
+	// for the oldest generation when it is collected in place.
+	Generation_t *marking = NULL;
+	if (num_generations > 1 && generations[num_generations - 1].num == collecting
+			&& !compact_oldest) {
+		marking = &generations[num_generations - 1];
+		gc_start_marking(marking);
+		gc_forget_remembered(marking);
+	}
+	// What the copied generations held, for their survival rates
+	word input_bytes[MAX_GENERATIONS];
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		if (gen->num <= collecting && gen != marking) {
+			input_bytes[k] = gen->live_bytes + (k == 0 ? allocated : 0);
+			gen->old_blocks = gen->blocks;
+			gen->old_n_blocks = gen->n_blocks;
+			gen->old_large = gen->large;
+			gen->blocks = gen->large = NULL;
+			gen->n_blocks = gen->n_large_blocks = 0;
+			gen->live_bytes = 0;
+			gen->remembered = (void *)-1;
+			gen->n_dirty = 0;
+		}
+	}
+	double phase_ns = gc_trace_start();
+	gc_take_remembered();
+	if (sized_gen != NULL && sized_gen->num <= collecting && marking == NULL) {
+		// Its blocks are being freed.
+		for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+			n_partial_blocks[c] = 0;
+		}
+	}
+	gc_scavenge_remembered(&gc_threads[0]);
+	gc_trace("remembered set", 0, collecting, phase_ns);
+
+	// Run the GC threads, with this thread as thread 0.
+	gc_running_threads = num_gc_threads;
+	pthread_mutex_lock(&gc_mutex);
+	gc_threads_done = 1;
+	gc_epoch++;
+	pthread_cond_broadcast(&gc_start_cond);
+	pthread_mutex_unlock(&gc_mutex);
+	gc_thread_work(&gc_threads[0]);
+	pthread_mutex_lock(&gc_mutex);
+	while (gc_threads_done < num_gc_threads) {
+		pthread_cond_wait(&gc_done_cond, &gc_mutex);
+	}
+	pthread_mutex_unlock(&gc_mutex);
+
+	// Sweep the generation collected in place, then give to-space to
+	// the generations and free from-space.
+	if (marking != NULL) {
+		phase_ns = gc_trace_start();
+		gc_sweep(marking);
+		gc_trace("sweep", 0, marking->num, phase_ns);
+	} else if (generations[num_generations - 1].num == collecting) {
+		// The oldest generation was compacted.
+		compact_oldest = false;
+	}
+	for (int i = 0; i < num_gc_threads; i++) {
+		for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+			// The sweep already put the swept blocks on the partial lists.
+			Blockinfo_t *bd = gc_threads[i].sized[c];
+			if (bd != NULL && bd->free_ptr != NULL
+					&& (marking == NULL || (bd->flags & BF_EVACUATED))) {
+				add_partial_block(bd);
+			}
+			gc_threads[i].sized[c] = NULL;
+		}
+	}
+	for (int i = 0; i < num_gc_threads; i++) {
+		gc_collect_workspaces(&gc_threads[i]);
+	}
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		word survived = 0;
+		for (int i = 0; i < num_gc_threads; i++) {
+			survived += gc_threads[i].survived_bytes[k];
+			gc_threads[i].survived_bytes[k] = 0;
+		}
+		if (gen->num <= collecting && gen != marking) {
+			gen->survival_rate = input_bytes[k] > 0 ? (double)survived / input_bytes[k] : 0;
+		}
+		if (gen->num <= collecting) {
+			gen->collections++;
+			free_group_list(gen->old_blocks);
+			free_group_list(gen->old_large);
+			gen->old_blocks = gen->old_large = NULL;
+			gen->old_n_blocks = 0;
+			if (gen->to_gen == NULL) {
+				gc_resize_oldest(gen);
+			}
+		}
+	}
+
+	// The nursery blocks can be reused from the start, and the pinned
+	// blocks have been promoted or freed.  The full blocks a realtime
+	// nursery handed over are its spares again.
+	large_allocated_bytes = 0;
+	for (int i = 0; i < num_nurseries; i++) {
+		Nursery_t *nursery = &nurseries[i];
+		nursery->pinned_block = NULL;
+		for (Blockinfo_t *bd = nursery->blocks; bd != NULL; bd = bd->link) {
+			bd->free_ptr = bd->start;
+		}
+		nursery_set_block(nursery, nursery->blocks);
+		if (nursery->retired_blocks != NULL) {
+			for (Blockinfo_t *bd = nursery->retired_blocks; bd != NULL; bd = bd->link) {
+				bd->free_ptr = bd->start;
+			}
+			nursery->spare_blocks = nursery->retired_blocks;
+			nursery->retired_blocks = NULL;
+		}
+	}
+
+	phase_ns = gc_trace_start();
+	if (start_incremental) {
+		gc_start_incremental();
+		gc_trace("start marking", 0, num_generations - 1, phase_ns);
+	} else if (gc_remark()) {
+		gc_trace("remark", 0, num_generations - 1, phase_ns);
+	}
+	gc_adapt_sizes(gc_now_ns() - start_ns, start_ns - last_gc_end_ns);
+	release_free_megablocks();
+	resume_background();
+
+	double end_ns = gc_now_ns();
+	gc_trace("gc", 0, collecting, start_ns);
+	gc_collections++;
+	last_pause_ns = end_ns - start_ns;
+	total_pause_ns += last_pause_ns;
+	if (last_pause_ns > max_pause_ns) {
+		max_pause_ns = last_pause_ns;
+	}
+	last_gc_end_ns = end_ns;
+}
+
+// Collect (see collect) with the other mutators stopped.  Any thread
+// may call it; if another thread collects meanwhile, it stops for that
+// collection instead.
 void garbage_collect(void) {
-	Generation_t *gen;
-	uint16_t num = -1;
-	for (gen = generations[0]; gen != NULL; gen = gen->to_gen) {
-		if (gen->n_blocks + gen->n_large_blocks > n_max_blocks) {
-			num = gen->num;
+	word collections = gc_collections;
+	stop_the_world();
+	if (gc_collections == collections) {
+		collect();
+	}
+	start_the_world();
+}
+
+// The number of blocks of a nursery which have been allocated into.
+static
+word nursery_used_blocks(Nursery_t *nursery) {
+	word n = 1;
+	for (Blockinfo_t *bd = nursery->blocks; bd != nursery->alloc_block; bd = bd->link) {
+		n++;
+	}
+	return n;
+}
+
+// Whether the oldest generation can be collected incrementally: it
+// must have a single step.
+static
+bool gc_can_be_incremental(void) {
+	return num_generations > 1
+		&& generations[num_generations - 2].num < generations[num_generations - 1].num;
+}
+
+// Finish any incremental collection of the oldest generation.
+static
+void gc_finish_incremental(void) {
+	while (incremental_phase != INCREMENTAL_IDLE) {
+		gc_incremental_work((word)-1);
+	}
+}
+
+// Set how many words of the oldest generation each gc_slice marks or
+// sweeps.  0, the default, collects the oldest generation in pauses,
+// and finishes any incremental collection of it first.
+void set_gc_slice_words(word words) {
+	guard(words == 0 || gc_can_be_incremental(),
+				"Incremental collection needs an oldest generation of one step");
+	guard(words == 0 || !background_enabled,
+				"Slices can't be used with the background collector");
+	if (words == 0) {
+		gc_finish_incremental();
+	}
+	slice_words = words;
+}
+
+// Set whether the oldest generation is marked and swept by a
+// background thread while the mutators run, rather than in pauses.
+// Turning it off finishes any collection in progress.  Mutator threads
+// must be stopped.
+void set_gc_background(bool enabled) {
+	guard(!enabled || gc_can_be_incremental(),
+				"Background collection needs an oldest generation of one step");
+	guard(!enabled || slice_words == 0,
+				"The background collector can't be used with slices");
+	if (enabled && !background_started) {
+		if (pthread_create(&background_thread, NULL, gc_background, NULL) != 0) {
+			error("set_gc_background unable to start background thread");
 		}
+		background_started = true;
+	}
+	pause_background();
+	if (!enabled) {
+		gc_finish_incremental();
+	}
+	background_enabled = enabled;
+	background_drained = false;
+	resume_background();
+}
+
+// Do some collection, to be called regularly from a thread which
+// isn't realtime: the nurseries are collected if any is more than half
+// used or a realtime nursery has handed over its full blocks (see
+// set_nursery_realtime), and then up to slice_words words of the
+// oldest generation are marked or swept (unless the background
+// collector is doing that).  As with garbage_collect, the other
+// mutators are stopped meanwhile, and only the marking and sweeping is
+// bounded; realtime threads don't wait for any of it.
+void gc_slice(void) {
+	guard(slice_words != 0 || background_enabled,
+				"gc_slice needs set_gc_slice_words or set_gc_background");
+	stop_the_world();
+	for (int i = 0; i < num_nurseries; i++) {
+		if (nurseries[i].retired_blocks != NULL
+				|| nursery_used_blocks(&nurseries[i]) > nurseries[i].n_blocks / 2) {
+			collect();
+			break;
+		}
+	}
+	if (slice_words != 0 && incremental_phase != INCREMENTAL_IDLE) {
+		double start_ns = gc_trace_start();
+		gc_incremental_work(slice_words);
+		gc_trace("slice", 0, num_generations - 1, start_ns);
 	}
-	error("Need to implement GC trigger here.");
+	start_the_world();
 }
 
-void gc_evacuate(Obj_t **ptr) {
-	
+// Fill in the statistics of the heap and the collector.  They are a
+// snapshot taken with the other mutators stopped (so not to be taken
+// from a realtime thread), since collections and adaptive sizing
+// change the nurseries and generations it reads.
+void gc_get_stats(GcStats_t *stats) {
+	stop_the_world();
+	pause_background();
+	stats->num_generations = num_generations;
+	for (int k = 0; k < num_generations; k++) {
+		Generation_t *gen = &generations[k];
+		stats->generations[k] = (GenerationStats_t){
+			.blocks = gen->n_blocks,
+			.large_blocks = gen->n_large_blocks,
+			.live_bytes = gen->live_bytes,
+			.collections = gen->collections,
+			.survival_rate = gen->survival_rate,
+			.max_blocks = gen->n_max_blocks
+		};
+	}
+	resume_background();
+	get_megablock_stats(&stats->megablocks);
+	stats->allocated_bytes = allocated_bytes + nursery_allocated_bytes();
+	stats->allocation_rate = allocation_rate;
+	stats->collections = gc_collections;
+	stats->last_pause_ns = last_pause_ns;
+	stats->max_pause_ns = max_pause_ns;
+	stats->total_pause_ns = total_pause_ns;
+	stats->overhead = gc_overhead;
+	stats->nursery_blocks = nursery_blocks;
+	start_the_world();
+}
+
+// Set how many of the most recent collector events are kept for
+// gc_write_trace, discarding those kept so far.  0, the default, turns
+// tracing off.  No collection may be running.
+void set_gc_trace_events(word events) {
+	pause_background();
+	free(trace_events);
+	trace_events = NULL;
+	if (events != 0) {
+		trace_events = malloc(events * sizeof(GcEvent_t));
+		guard(trace_events != NULL, "Couldn't allocate trace events");
+	}
+	max_trace_events = events;
+	n_trace_events = 0;
+	resume_background();
 }
 
-void gc_scavange(Obj_t *obj) {
-	Blockinfo_t *blockinfo = get_blockinfo(obj);
+// Write the recorded events, oldest first, as a Chrome trace (JSON in
+// the trace event format).  No collection may be running.
+void gc_write_trace(FILE *out) {
+	pause_background();
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	for (int i = 0; i < num_gc_threads; i++) {
+		fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+						"\"args\": {\"name\": \"gc thread %d\"}},\n", i, i);
+	}
+	fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+					"\"args\": {\"name\": \"background\"}},\n", BACKGROUND_THREAD_ID);
+	word first = n_trace_events > max_trace_events ? n_trace_events - max_trace_events : 0;
+	for (word i = first; i < n_trace_events; i++) {
+		GcEvent_t *e = &trace_events[i % max_trace_events];
+		fprintf(out, "{\"name\": \"%s\", \"cat\": \"gc\", \"ph\": \"X\", "
+						"\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d",
+						e->name, e->start_ns / 1e3, (e->end_ns - e->start_ns) / 1e3, e->thread);
+		if (e->generation >= 0) {
+			fprintf(out, ", \"args\": {\"generation\": %d}", e->generation);
+		}
+		fprintf(out, "}%s\n", i + 1 < n_trace_events ? "," : "");
+	}
+	fprintf(out, "]}\n");
+	resume_background();
 }
@@ -8,6 +8,7 @@
 #define clangor_blocks_h
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "constants.h"
 #include "util.h"
 
@@ -31,6 +32,12 @@
 // The number of blocks which are useable in a megablock, since the
 // beginning of a megablock is used by the blockinfos
 #define NUM_USABLE_BLOCKS ((word)(MEGABLOCK_SIZE / (BLOCK_SIZE + BLOCKINFO_SIZE)))
+// The size of a card of the write barrier, in bytes
+#define CARD_SIZE (1<<CARD_SIZE_LG)
+// The number of cards in a block
+#define CARDS_PER_BLOCK (BLOCK_SIZE / CARD_SIZE)
+// The index within its block of the card of a pointer
+#define CARD_INDEX(p) (((word)(p) & (BLOCK_SIZE - 1)) >> CARD_SIZE_LG)
 // The number of blocks there would be if there weren't blockinfos 
 #define NUM_BLOCKS ((word)MEGABLOCK_SIZE / BLOCK_SIZE)
 // The index of the first usable block (the first block after the
@@ -73,17 +80,58 @@ typedef struct Blockinfo_s {
                                // the head of its group
   struct Blockinfo_s *back; // for a doubly-linked free list
   struct Generation_s *gen; // generation
+  union {
+    void *scan; // next object to scavenge during GC
+    uint64_t *marks; // mark bitmap during GC of BF_MARKED groups
+  };
   uint16_t flags; // block flags (see BF_*)
+  uint8_t cards[CARDS_PER_BLOCK]; // non-zero if a card of this block
+                                  // (even in the middle of a group)
+                                  // may point into a younger generation
+  uint8_t size_class; // size class of a BF_SIZED block
 } Blockinfo_t;
 
 // Block contains objects evacuated during this GC
 #define BF_EVACUATED 1
 // Block is a large object
 #define BF_LARGE     2
-// Block is pinned
+// Block holds pinned objects, which are never moved (see
+// alloc_pinned_obj)
 #define BF_PINNED    4
+// Group has dirty cards and is on its generation's dirty list
+#define BF_DIRTY     8
 // Block is to be marked, not copied
 #define BF_MARKED   16
+// Group is free in a thread's block cache
+#define BF_CACHED   32
+// Block is divided into slots of one size class.  Its free_ptr is
+// the first free slot, rather than the end of its objects.
+#define BF_SIZED    64
+
+// Remove a block from a list, double-linked.
+static inline
+void list_unlink_blockinfo(Blockinfo_t *removed, Blockinfo_t **list) {
+  if (removed->back != NULL) {
+    removed->back->link = removed->link;
+  } else {
+    // otherwise 'removed' was the beginning of the list
+    *list = removed->link;
+  }
+  if (removed->link != NULL) {
+    removed->link->back = removed->back;
+  }
+}
+
+// Add a block to the front of a list, double-linked.
+static inline
+void list_link_blockinfo(Blockinfo_t *added, Blockinfo_t **list) {
+  added->link = *list;
+  added->back = NULL;
+  if (*list != NULL) {
+    (*list)->back = added;
+  }
+  *list = added;
+}
 
 // This is a power-of-two aligned version of Blockinfo_t so we can
 // easily find a blockinfo for a corresponding pointer in a block
@@ -105,6 +153,16 @@ typedef union {
 } Megablock_t;
 
 
+// Megablock accounting, in megablocks unless noted
+typedef struct MegablockStats_s {
+  word mapped_megablocks; // currently mapped from the OS
+  word free_megablocks; // mapped but in the free megagroup bins
+  word returned_megablocks; // returned to the OS so far
+  word reserved_megablocks; // reserved address space not yet committed
+  word free_blocks; // blocks in the free block lists (not counting
+                    // those in thread caches)
+} MegablockStats_t;
+
 // API
 
 void init_free_lists(void);
@@ -113,11 +171,23 @@ Blockinfo_t *alloc_group(word blocks);
 
 void free_group(Blockinfo_t *blockinfo);
 
+Blockinfo_t *split_group(Blockinfo_t *group, word blocks);
+
+void attach_block_cache(void);
+void flush_block_cache(void);
+
+void set_megablock_reservation(bool enabled);
+void set_megablock_huge_pages(bool enabled);
+bool bind_to_local_node(void *start, word size);
+void set_megablock_retention(word megablocks);
+void release_free_megablocks(void);
+void get_megablock_stats(MegablockStats_t *stats);
+
 
 // Useful inline functions
 
 // Get a blockinfo for a block which contains the given pointer
-inline
+static inline
 Blockinfo_t *get_blockinfo(void *ptr) {
   word block = (word)ptr & BLOCK_MASK;
   Megablock_t *megablock = (Megablock_t *)TO_MEGABLOCK(block);
@@ -10,5 +10,12 @@
 #define MEGABLOCK_SIZE_LG 20
 // 2**BLOCK_SIZE_LG is the size of an individual block in the megablock
 #define BLOCK_SIZE_LG 12
+// 2**RESERVATION_SIZE_LG bytes of address space are reserved at a time
+// for megablocks
+#define RESERVATION_SIZE_LG 30
+// 2**HUGE_PAGE_SIZE_LG is the size of a (transparent) huge page
+#define HUGE_PAGE_SIZE_LG 21
+// 2**CARD_SIZE_LG is the size of a card for the GC write barrier
+#define CARD_SIZE_LG 10
 
 #endif
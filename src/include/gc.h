@@ -13,12 +13,21 @@
 //GC_t* gc_new_manager(void);
 //void* gc_alloc(GC_t* gc
 
+#include <stdio.h>
 #include <blocks.h>
 #include <objects.h>
 
 #define MAX_GENERATIONS 16
-#define MAX_GC_THREADS 1
+#define MAX_GC_THREADS 16
+// Blocks per nursery, unless adaptive sizing changes it (see
+// set_gc_target_overhead) within MIN_ and MAX_NURSERY_BLOCKS
 #define NURSERY_BLOCKS 128
+#define MIN_NURSERY_BLOCKS (NURSERY_BLOCKS / 8)
+#define MAX_NURSERY_BLOCKS (NURSERY_BLOCKS * 16)
+#define MAX_ROOTS 1024
+// Default percentage of free space in the blocks of the oldest
+// generation, after it is swept, above which it is compacted
+#define COMPACTION_THRESHOLD 50
 
 // Aligns a pointer to a void * multiple.
 #define NEXT_PTR_ALIGNED(x)																\
@@ -29,29 +38,164 @@ typedef struct Generation_s {
   uint16_t num; // generation number
   Blockinfo_t *blocks; // blocks in this generation
   word n_blocks;
-	Blockinfo_t *large; // large objects, doubly linked
+	Blockinfo_t *large; // large objects and pinned blocks, doubly linked
 	word n_large_blocks;
 	word n_max_blocks; // max blocks before gc
 	//  word n_words;
   Obj_t *remembered; // linked list of objects in the remembered set
+	Blockinfo_t **dirty; // heads of groups with dirty cards
+	word n_dirty;
+	word max_dirty;
+	Spinlock_t remembered_lock; // protects remembered and dirty
+	word live_bytes; // see GenerationStats_t
+	word collections;
+	double survival_rate;
   struct Generation_s *to_gen; // destination generation for live objects
   Blockinfo_t *old_blocks;
   word old_n_blocks;
 	Blockinfo_t *old_large;
 } Generation_t;
 
+// A thread's allocation area.  free_ptr and limit cache the free
+// space of alloc_block so that allocation is a pointer bump;
+// alloc_block->free_ptr is only brought up to date on the slow path.
 typedef struct Nursery_s {
+	void *free_ptr;
+	void *limit;
 	Blockinfo_t *blocks;
 	Blockinfo_t *alloc_block;
+	word n_blocks;
+	Blockinfo_t *pinned_block; // where alloc_pinned_obj allocates
+	bool realtime; // never collects (see set_nursery_realtime)
+	Blockinfo_t *spare_blocks; // realtime: swapped in when blocks are full
+	Blockinfo_t *retired_blocks; // realtime: full, for the next collection
+	bool rebind; // resized since claim_nursery bound it to a NUMA node
 } Nursery_t;
 
+// Statistics of a generation (see gc_get_stats)
+typedef struct GenerationStats_s {
+	word blocks; // blocks of small objects
+	word large_blocks; // blocks of large objects and pinned blocks
+	word live_bytes; // bytes of objects found live by its last
+	                 // collection or promoted into it since
+	word collections; // times it was collected
+	double survival_rate; // fraction of its bytes which survived its
+	                      // last collection
+	word max_blocks; // collected once it outgrows this
+} GenerationStats_t;
+
+// Statistics of the heap and the collector.  Pauses are the
+// durations of garbage_collect.
+typedef struct GcStats_s {
+	int num_generations;
+	GenerationStats_t generations[MAX_GENERATIONS];
+	MegablockStats_t megablocks;
+	word allocated_bytes; // allocated in the nurseries so far
+	double allocation_rate; // bytes per second allocated in the
+	                        // nurseries between the last two collections
+	word collections;
+	double last_pause_ns;
+	double max_pause_ns;
+	double total_pause_ns;
+	double overhead; // fraction of time spent collecting, smoothed
+	word nursery_blocks; // blocks of each nursery (see
+	                     // set_gc_target_overhead)
+} GcStats_t;
+
+extern Generation_t generations[MAX_GENERATIONS];
+extern int default_generation_config[];
+
+// The nursery of the current thread (see claim_nursery)
+extern __thread Nursery_t *thread_nursery;
+// Whether the oldest generation is being marked incrementally, during
+// which gc_write_field shades what it overwrites (see gc_slice and
+// set_gc_background)
+extern volatile bool gc_incremental_marking;
+// Whether a collection wants the mutators to stop (see gc_safepoint)
+extern volatile bool gc_stop_requested;
+
 // API
 
 void init_generations(int generation_config[]);
 void init_nurseries(int num_threads);
-Obj_t *alloc_obj(Nursery_t *nursery, word size);
+void init_gc_threads(int num_threads);
+Nursery_t *claim_nursery(void);
+void release_nursery(void);
+void gc_enter_heap(void);
+bool gc_try_enter_heap(void);
+void gc_leave_heap(void);
+void gc_safepoint_slow(void);
+void set_nursery_numa_binding(bool enabled);
+void set_compaction_threshold(int percent);
+void set_gc_target_overhead(int percent);
+void set_gc_heap_bounds(word min_blocks, word max_blocks);
+void set_nursery_realtime(Nursery_t *nursery, bool realtime);
+void set_gc_slice_words(word words);
+void set_gc_background(bool enabled);
+Obj_t *alloc_obj_slow(Nursery_t *nursery, word size);
+Obj_t *alloc_pinned_obj(Nursery_t *nursery, word size);
 void garbage_collect(void);
+void gc_slice(void);
+void gc_get_stats(GcStats_t *stats);
+void set_gc_trace_events(word events);
+void gc_write_trace(FILE *out);
+
+void gc_add_root(Obj_t **root);
+void gc_remove_root(Obj_t **root);
+void gc_mark_card(Obj_t *obj, Obj_t **slot);
+void gc_shade(Obj_t *obj);
 
 Nursery_t *get_nursery(int i);
 
+// Stop for a collection another thread wants to do, if there is one.
+// Allocation does this on its slow path; a mutator which runs for long
+// without allocating should call it now and then, and one which
+// blocks should leave the heap (see gc_leave_heap) first.
+static inline
+void gc_safepoint(void) {
+	if (unlikely(gc_stop_requested)) {
+		gc_safepoint_slow();
+	}
+}
+
+// Allocate an object of the given number of bytes.  The fast path is
+// a bump of the nursery's free pointer; everything else (moving to
+// the next block, large objects, GC) is in alloc_obj_slow.  Only a
+// realtime nursery returns NULL (see set_nursery_realtime).
+static inline
+Obj_t *alloc_obj(Nursery_t *nursery, word size) {
+	void *obj = nursery->free_ptr;
+	void *next = (void *)((word)obj + NEXT_PTR_ALIGNED(size));
+	if (likely(next <= nursery->limit)) {
+		nursery->free_ptr = next;
+		return obj;
+	}
+	return alloc_obj_slow(nursery, size);
+}
+
+// Allocate from the current thread's nursery.
+static inline
+Obj_t *thread_alloc_obj(word size) {
+	return alloc_obj(thread_nursery, size);
+}
+
+// Store value in entry i of obj (of either object type).  Objects
+// which may have survived a collection must only be given Obj entries
+// through here, so that a pointer from an older generation into a
+// younger one marks a card for the next collection to scan, and so
+// that incremental marking sees the object being overwritten.
+static inline
+void gc_write_field(Obj_t *obj, word i, Obj_t *value) {
+	Obj_t **slot = obj->def->type == OBJ_TYPE_ARRAY
+		? &obj->payload.array.data[i] : &obj->payload.obj.data[i];
+	if (unlikely(gc_incremental_marking) && *slot != NULL) {
+		gc_shade(*slot);
+	}
+	*slot = value;
+	if (value != NULL
+			&& unlikely(get_blockinfo(obj)->gen->num > get_blockinfo(value)->gen->num)) {
+		gc_mark_card(obj, slot);
+	}
+}
+
 #endif
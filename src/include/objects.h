@@ -8,6 +8,8 @@
 #define clangor_objects_h
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include "util.h"
 
 // A standard object
@@ -26,6 +28,10 @@ typedef struct ObjDef_s {
   // i) is true iff payload.obj[i] is an Obj.  If type is
   // OBJ_TYPE_ARRAY, then bitmap != 0 iff it is made entirely of Objs.
   uint64_t bitmap;
+  // For a standard object with more than 64 entries, the rest of its
+  // bitmap: entry i >= 64 is an Obj iff bitmap_ext[i / 64 - 1] & (1 <<
+  // i % 64).  NULL if none of those entries are Objs.
+  uint64_t *bitmap_ext;
   // Pointer to code to execute
 } ObjDef_t;
 
@@ -46,4 +52,37 @@ typedef struct Obj_s {
   } payload;
 } Obj_t;
 
+// The number of bytes before the payload of an object
+#define OBJ_HEADER_SIZE (offsetof(Obj_t, payload))
+// The number of bytes for a standard object with the given number of
+// entries
+#define OBJ_STD_SIZE(length) \
+  (OBJ_HEADER_SIZE + (word)(length) * sizeof(Obj_t *))
+// The number of bytes for an array object with the given number of
+// entries
+#define OBJ_ARRAY_SIZE(length) \
+  (OBJ_HEADER_SIZE + sizeof(word) + (word)(length) * sizeof(Obj_t *))
+
+// Whether entry i of an object with the given def is an Obj.
+static inline
+bool obj_entry_is_obj(ObjDef_t *def, word i) {
+  if (def->type == OBJ_TYPE_ARRAY) {
+    return def->bitmap != 0;
+  } else if (i < 64) {
+    return (def->bitmap >> i) & 1;
+  } else {
+    return def->bitmap_ext != NULL && ((def->bitmap_ext[i / 64 - 1] >> (i % 64)) & 1);
+  }
+}
+
+// The number of bytes an object occupies, according to its def.
+static inline
+word obj_size(Obj_t *obj) {
+  if (obj->def->type == OBJ_TYPE_ARRAY) {
+    return OBJ_ARRAY_SIZE(obj->payload.array.length);
+  } else {
+    return OBJ_STD_SIZE(obj->def->length);
+  }
+}
+
 #endif
@@ -52,6 +52,26 @@
     }                                                                   \
   } while (0)
 
+// Branch prediction hints
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// A minimal spinlock for short critical sections
+typedef volatile int Spinlock_t;
+
+static inline
+void spin_lock(Spinlock_t *lock) {
+  while (__sync_lock_test_and_set(lock, 1)) {
+    while (*lock)
+      ;
+  }
+}
+
+static inline
+void spin_unlock(Spinlock_t *lock) {
+  __sync_lock_release(lock);
+}
+
 // Next power of two.  This should only be for computations in the
 // pre-processor!
 #define _npo2_b2(x) ((x) | ((x) >> 1))
@@ -7,6 +7,8 @@
 #include "blocks.h"
 #include "util.h"
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 // Some sanity checks on the constants related to block sizes.
 void TEST_SUCCEEDS test_constants(void) {
@@ -187,3 +189,242 @@ void TEST_FAILS test_writing_junk_into_blockinfo3(void) {
   }
   verify_free_megablock_list();
 }
+
+// Allocate and free groups of assorted sizes through the thread's
+// block cache, writing to each group to check no two threads are
+// given the same memory.
+static void *churn_groups(void *arg) {
+  uint8_t id = (uint8_t)(word)arg;
+  Blockinfo_t *b[64];
+  attach_block_cache();
+  for (int round = 0; round < 200; round++) {
+    for (int i = 0; i < 64; i++) {
+      b[i] = alloc_group(1 + (i + round) % 6);
+      *(uint8_t *)b[i]->start = id;
+    }
+    for (int i = 0; i < 64; i++) {
+      assert(*(uint8_t *)b[i]->start == id, "Group was shared between threads.");
+      free_group(b[i]);
+    }
+  }
+  flush_block_cache();
+  return NULL;
+}
+
+// Several threads using block caches at once, after which everything
+// coalesces back into free megablocks.
+void TEST_SUCCEEDS test_threaded_block_caches(void) {
+  init_free_lists();
+  pthread_t threads[4];
+  for (word i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, churn_groups, (void *)(i + 1));
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  verify_free_block_list();
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
+
+// Freeing a group twice is caught even when it went to a cache.
+void TEST_FAILS test_double_free_to_cache(void) {
+  init_free_lists();
+  attach_block_cache();
+  Blockinfo_t *b = alloc_group(1);
+  free_group(b);
+  free_group(b);
+}
+
+// Free every other megagroup of assorted sizes, reallocate into the
+// holes, then free everything so it all coalesces again.
+void TEST_SUCCEEDS test_megagroup_fragmentation(void) {
+  init_free_lists();
+  Blockinfo_t *b[200];
+  for (int i = 0; i < 200; i++) {
+    b[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(1 + i % 5));
+  }
+  for (int i = 0; i < 200; i += 2) {
+    free_group(b[i]);
+  }
+  verify_free_megablock_list();
+  Blockinfo_t *holes[100];
+  for (int i = 0; i < 200; i += 2) {
+    holes[i / 2] = b[i];
+  }
+  for (int i = 0; i < 200; i += 2) {
+    // Should reuse a hole of exactly the right size.
+    b[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(1 + i % 5));
+    assert(b[i]->blocks == MEGABLOCKS_TO_BLOCKS(1 + i % 5), "Wrong megagroup size.");
+    bool reused = false;
+    for (int j = 0; j < 100; j++) {
+      reused |= b[i] == holes[j];
+    }
+    assert(reused, "Megagroup did not reuse a hole.");
+  }
+  verify_free_megablock_list();
+  for (int i = 199; i >= 0; i -= 2) {
+    free_group(b[i]);
+  }
+  for (int i = 0; i < 200; i += 2) {
+    free_group(b[i]);
+  }
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
+
+// Holes of assorted sizes all in one of the bins of groups of 64 or
+// more megablocks are each filled by the smallest hole big enough.
+void TEST_SUCCEEDS test_megagroup_best_fit(void) {
+  init_free_lists();
+  enum { HOLES = 12 };
+  Blockinfo_t *holes[HOLES], *separators[HOLES];
+  word sizes[HOLES];
+  for (int i = 0; i < HOLES; i++) {
+    // 64 to 119 megablocks, in no particular order
+    sizes[i] = 64 + (i * 7) % HOLES * 5;
+    holes[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(sizes[i]));
+    separators[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(1));
+  }
+  for (int i = 0; i < HOLES; i++) {
+    free_group(holes[i]);
+  }
+  verify_free_megablock_list();
+  word requests[] = {66, 101, 119, 64, 70, 112, 65};
+  Blockinfo_t *taken[sizeof(requests) / sizeof(requests[0])];
+  for (word r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+    int best = -1;
+    for (int i = 0; i < HOLES; i++) {
+      if (sizes[i] >= requests[r] && (best < 0 || sizes[i] < sizes[best])) {
+        best = i;
+      }
+    }
+    assert(best >= 0, "The test ran out of holes.");
+    taken[r] = alloc_group(MEGABLOCKS_TO_BLOCKS(requests[r]));
+    // Taken off the end of the hole
+    assert(TO_MEGABLOCK(taken[r]) == TO_MEGABLOCK(holes[best]) + sizes[best] - requests[r],
+           "Megagroup was not taken from the best fitting hole.");
+    sizes[best] -= requests[r];
+    verify_free_megablock_list();
+  }
+  for (word r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+    free_group(taken[r]);
+  }
+  for (int i = 0; i < HOLES; i++) {
+    free_group(separators[i]);
+  }
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
+
+// Free megablocks beyond the retention limit go back to the OS, and
+// the allocator keeps working afterwards.
+void TEST_SUCCEEDS test_megablock_retention(void) {
+  init_free_lists();
+  MegablockStats_t before, after;
+  get_megablock_stats(&before);
+  Blockinfo_t *b[10];
+  for (int i = 0; i < 10; i++) {
+    b[i] = alloc_group(MEGABLOCKS_TO_BLOCKS(3));
+  }
+  for (int i = 0; i < 10; i++) {
+    free_group(b[i]);
+  }
+  get_megablock_stats(&after);
+  assert(after.free_megablocks == 30, "Freed megablocks not counted.");
+  assert(after.mapped_megablocks == before.mapped_megablocks + 30,
+         "Mapped megablocks not counted.");
+  set_megablock_retention(4);
+  release_free_megablocks();
+  get_megablock_stats(&after);
+  assert(after.free_megablocks == 4, "Didn't keep the retained megablocks.");
+  assert(after.returned_megablocks == before.returned_megablocks + 26,
+         "Didn't return the excess megablocks.");
+  assert(after.mapped_megablocks == before.mapped_megablocks + 4,
+         "Returned megablocks are still counted as mapped.");
+  verify_free_megablock_list();
+  Blockinfo_t *c = alloc_group(MEGABLOCKS_TO_BLOCKS(6));
+  Blockinfo_t *d = alloc_group(1);
+  free_group(c);
+  free_group(d);
+  verify_free_block_list();
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
+
+// The blocks in the free block lists are counted as groups are split
+// off and coalesced.
+void TEST_SUCCEEDS test_free_block_stats(void) {
+  init_free_lists();
+  MegablockStats_t stats;
+  Blockinfo_t *a = alloc_group(1);
+  Blockinfo_t *b = alloc_group(5);
+  get_megablock_stats(&stats);
+  assert(stats.free_blocks == NUM_USABLE_BLOCKS - 6, "Free blocks not counted.");
+  free_group(a);
+  get_megablock_stats(&stats);
+  assert(stats.free_blocks == NUM_USABLE_BLOCKS - 5, "Freed group not counted.");
+  free_group(b);
+  get_megablock_stats(&stats);
+  assert(stats.free_blocks == 0, "A coalesced megablock is still counted.");
+  assert_free_block_list_empty();
+}
+
+// Megablocks committed from one reservation are contiguous, and
+// megagroups too big for a reservation still work.
+void TEST_SUCCEEDS test_megablock_reservation(void) {
+  init_free_lists();
+  set_megablock_reservation(true);
+  MegablockStats_t stats;
+  Blockinfo_t *a = alloc_group(MEGABLOCKS_TO_BLOCKS(2));
+  Blockinfo_t *b = alloc_group(MEGABLOCKS_TO_BLOCKS(3));
+  get_megablock_stats(&stats);
+  assert(stats.reserved_megablocks > 0, "Nothing was reserved.");
+  assert(TO_MEGABLOCK(b) == TO_MEGABLOCK(a) + 2 || TO_MEGABLOCK(a) == TO_MEGABLOCK(b) + 3,
+         "Consecutive megagroups are not adjacent in the reservation.");
+  for (word i = 0; i < b->blocks * BLOCK_SIZE; i++) {
+    *((uint8_t *)b->start + i) = 22;
+  }
+  Blockinfo_t *huge = alloc_group(MEGABLOCKS_TO_BLOCKS((1 << (RESERVATION_SIZE_LG - MEGABLOCK_SIZE_LG)) + 1));
+  *((uint8_t *)huge->start) = 22;
+  free_group(huge);
+  free_group(a);
+  free_group(b);
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
+
+// split_group gives contiguous groups which can be freed separately.
+void TEST_SUCCEEDS test_split_group(void) {
+  init_free_lists();
+  Blockinfo_t *g = split_group(alloc_group(12), 3);
+  int n = 0;
+  for (Blockinfo_t *b = g; b != NULL; b = b->link, n++) {
+    assert(b->blocks == 3, "Split group is the wrong size.");
+    assert(b->link == NULL || b->link->start == b->start + 3 * BLOCK_SIZE,
+           "Split groups are not contiguous.");
+  }
+  assert(n == 4, "Wrong number of split groups.");
+  while (g != NULL) {
+    Blockinfo_t *next = g->link;
+    free_group(g);
+    g = next;
+  }
+  verify_free_block_list();
+  assert_free_block_list_empty();
+}
+
+// Allocation still works from huge-page-aligned reservations.
+void TEST_SUCCEEDS test_huge_page_reservation(void) {
+  init_free_lists();
+  set_megablock_huge_pages(true);
+  Blockinfo_t *b = alloc_group(MEGABLOCKS_TO_BLOCKS(4));
+  for (word i = 0; i < b->blocks * BLOCK_SIZE; i++) {
+    *((uint8_t *)b->start + i) = 22;
+  }
+  Blockinfo_t *c = alloc_group(1);
+  free_group(b);
+  free_group(c);
+  verify_free_megablock_list();
+  assert_free_block_list_empty();
+}
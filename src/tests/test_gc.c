@@ -5,6 +5,10 @@
 
 #include "test.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 //#include "objects.h"
 #include "gc.h"
 
@@ -15,15 +19,15 @@ void TEST_SUCCEEDS test_alloc_obj(void) {
 	init_generations(generation_config);
 	init_nurseries(1);
 	Nursery_t *nursery = get_nursery(0);
-	Obj_t *o = alloc_obj(nursery, 5);
-	assert((word)nursery->alloc_block->free_ptr - (word)nursery->alloc_block->start >= 5,
+	alloc_obj(nursery, 5);
+	assert((word)nursery->free_ptr - (word)nursery->alloc_block->start >= 5,
 				 "Didn't move free pointer far enough.");
-	assert(((word)nursery->alloc_block->free_ptr & (sizeof(void *) - 1)) == 0,
+	assert(((word)nursery->free_ptr & (sizeof(void *) - 1)) == 0,
 				 "Not correctly aligned.");
 	verify_free_block_list();
-	word ptr = (word)nursery->alloc_block->free_ptr;
-	o = alloc_obj(nursery, sizeof(void *));
-	assert((word)nursery->alloc_block->free_ptr - ptr == sizeof(void *),
+	word ptr = (word)nursery->free_ptr;
+	alloc_obj(nursery, sizeof(void *));
+	assert((word)nursery->free_ptr - ptr == sizeof(void *),
 				 "Didn't move free pointer exactly the right amount.");
 }
 
@@ -37,6 +41,1181 @@ void TEST_FAILS test_alloc_a_lot(void) {
 	for (int i = 0; ; i++) {
 		printf("%p\n", alloc_obj(nursery, 4096));
 		mem += 4096;
-		printf("%d\n", mem);
+		printf("%lu\n", mem);
 	}
 }
+
+// A cons cell holding a non-pointer value and a pointer to the next cell
+ObjDef_t cons_def = {.type = OBJ_TYPE_STD, .length = 2, .bitmap = 2};
+// A binary tree node holding a non-pointer value and two children
+ObjDef_t node_def = {.type = OBJ_TYPE_STD, .length = 3, .bitmap = 6};
+// An array made entirely of Objs
+ObjDef_t ptr_array_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 1};
+// An array with no Objs
+ObjDef_t record_def = {.type = OBJ_TYPE_ARRAY, .length = 0, .bitmap = 0};
+
+// Push a new cons cell onto a rooted list.
+static void push(Nursery_t *nursery, Obj_t **list, word value) {
+	Obj_t *cell = alloc_obj(nursery, OBJ_STD_SIZE(2));
+	cell->def = &cons_def;
+	cell->link = NULL;
+	cell->payload.obj.data[0] = (Obj_t *)value;
+	cell->payload.obj.data[1] = *list;
+	*list = cell;
+}
+
+static void check_list(Obj_t *list, word n) {
+	for (word i = n; i > 0; i--) {
+		assert(list != NULL, "List is too short.");
+		assert(list->def == &cons_def, "Cell has a bad def.");
+		assert((word)list->payload.obj.data[0] == i - 1, "Cell has wrong value.");
+		list = list->payload.obj.data[1];
+	}
+	assert(list == NULL, "List is too long.");
+}
+
+// Allocate enough garbage to go through the nursery several times.
+// The garbage overwrites whatever was in the nursery, so that dangling
+// pointers into it are noticed.
+static void churn(Nursery_t *nursery) {
+	for (int i = 0; i < 4 * NURSERY_BLOCKS * (BLOCK_SIZE / 64); i++) {
+		Obj_t *o = alloc_obj(nursery, 64);
+		memset(o, 0xdb, 64);
+		o->def = &cons_def;
+		o->link = NULL;
+		o->payload.obj.data[1] = NULL;
+	}
+}
+
+// A rooted list survives both explicit and allocation-triggered GCs.
+void TEST_SUCCEEDS test_gc_preserves_list(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *list = NULL;
+	gc_add_root(&list);
+	for (word i = 0; i < 10000; i++) {
+		push(nursery, &list, i);
+	}
+	Obj_t *before = list;
+	garbage_collect();
+	assert(list != before, "Root was not updated by the collector.");
+	check_list(list, 10000);
+	for (int i = 0; i < 5; i++) {
+		churn(nursery);
+		check_list(list, 10000);
+	}
+	verify_free_block_list();
+	verify_free_megablock_list();
+}
+
+// Garbage is reclaimed: the heap does not grow when nothing is live.
+void TEST_SUCCEEDS test_gc_reclaims_garbage(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	for (int i = 0; i < 20; i++) {
+		churn(nursery);
+	}
+	garbage_collect();
+	for (int k = 0; generations[k].to_gen != NULL; k++) {
+		assert(generations[k].num != 0 || generations[k].n_blocks == 0,
+					 "Generation 0 kept garbage.");
+	}
+}
+
+// Pointer arrays, including large ones, are evacuated with their
+// contents.
+void TEST_SUCCEEDS test_gc_arrays(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *small = NULL, *large = NULL;
+	gc_add_root(&small);
+	gc_add_root(&large);
+	word large_length = 3 * BLOCK_SIZE / sizeof(Obj_t *);
+	small = alloc_obj(nursery, OBJ_ARRAY_SIZE(10));
+	small->def = &ptr_array_def;
+	small->link = NULL;
+	small->payload.array.length = 10;
+	for (word i = 0; i < 10; i++) {
+		small->payload.array.data[i] = NULL;
+	}
+	large = alloc_obj(nursery, OBJ_ARRAY_SIZE(large_length));
+	large->def = &ptr_array_def;
+	large->link = NULL;
+	large->payload.array.length = large_length;
+	for (word i = 0; i < large_length; i++) {
+		large->payload.array.data[i] = NULL;
+	}
+	for (word i = 0; i < 10; i++) {
+		Obj_t *list = NULL;
+		gc_add_root(&list);
+		for (word j = 0; j < i; j++) {
+			push(nursery, &list, j);
+		}
+		gc_write_field(small, i, list);
+		gc_write_field(large, i * 100, list);
+		gc_remove_root(&list);
+	}
+	for (int i = 0; i < 3; i++) {
+		churn(nursery);
+		garbage_collect();
+	}
+	assert(small->payload.array.length == 10, "Small array lost its length.");
+	assert(large->payload.array.length == large_length, "Large array lost its length.");
+	for (word i = 0; i < 10; i++) {
+		check_list(small->payload.array.data[i], i);
+		assert(large->payload.array.data[i * 100] == small->payload.array.data[i],
+					 "Sharing was not preserved.");
+	}
+}
+
+// Young lists stored with gc_write_field into objects which have been
+// promoted out of generation 0 survive collections of only the young
+// generation, including in a large array with entries in several
+// blocks.
+void TEST_SUCCEEDS test_write_barrier(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *cell = NULL, *array = NULL;
+	gc_add_root(&cell);
+	gc_add_root(&array);
+	push(nursery, &cell, 0);
+	word length = 3 * BLOCK_SIZE / sizeof(Obj_t *);
+	array = alloc_obj(nursery, OBJ_ARRAY_SIZE(length));
+	array->def = &ptr_array_def;
+	array->link = NULL;
+	array->payload.array.length = length;
+	for (word i = 0; i < length; i++) {
+		array->payload.array.data[i] = NULL;
+	}
+	garbage_collect();
+	garbage_collect();
+	assert(get_blockinfo(cell)->gen->num == 1, "Cell was not promoted.");
+	assert(get_blockinfo(array)->gen->num == 1, "Array was not promoted.");
+	for (int round = 0; round < 3; round++) {
+		for (word i = 0; i < 4; i++) {
+			Obj_t *list = NULL;
+			gc_add_root(&list);
+			for (word j = 0; j < 10 + i; j++) {
+				push(nursery, &list, j);
+			}
+			gc_write_field(array, i * length / 4, list);
+			if (i == 0) {
+				gc_write_field(cell, 1, list);
+			}
+			gc_remove_root(&list);
+		}
+		garbage_collect();
+		churn(nursery);
+		assert(get_blockinfo(array)->gen->num == 1, "Array was collected.");
+		check_list(cell->payload.obj.data[1], 10);
+		for (word i = 0; i < 4; i++) {
+			check_list(array->payload.array.data[i * length / 4], 10 + i);
+		}
+	}
+}
+
+// A standard object with more than 64 entries has the Obj entries past
+// its first 64 found from its extended bitmap, both when it is copied
+// and when its cards are scanned, and its other entries are left
+// alone.
+void TEST_SUCCEEDS test_wide_objects(void) {
+	enum { FIELDS = 150 };
+	// Entries 1, 64, 100 and 149 are Objs.
+	static uint64_t bitmap_ext[] = {1 | (uint64_t)1 << 36, (uint64_t)1 << 21};
+	static ObjDef_t wide_def = {.type = OBJ_TYPE_STD, .length = FIELDS, .bitmap = 2, .bitmap_ext = bitmap_ext};
+	word entries[] = {1, 64, 100, 149};
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *wide = NULL, *list = NULL;
+	gc_add_root(&wide);
+	gc_add_root(&list);
+	wide = alloc_obj(nursery, OBJ_STD_SIZE(FIELDS));
+	wide->def = &wide_def;
+	wide->link = NULL;
+	for (word i = 0; i < FIELDS; i++) {
+		// Odd, so not a pointer to anything
+		wide->payload.obj.data[i] = (Obj_t *)(2 * i + 1);
+	}
+	for (word e = 0; e < 4; e++) {
+		for (word j = 0; j < 10 + e; j++) {
+			push(nursery, &list, j);
+		}
+		wide->payload.obj.data[entries[e]] = list;
+		list = NULL;
+	}
+	garbage_collect();
+	garbage_collect();
+	assert(get_blockinfo(wide)->gen->num == 1, "Wide object was not promoted.");
+	for (int round = 0; round < 3; round++) {
+		for (word e = 2; e < 4; e++) {
+			for (word j = 0; j < 20 + e; j++) {
+				push(nursery, &list, j);
+			}
+			gc_write_field(wide, entries[e], list);
+			list = NULL;
+		}
+		garbage_collect();
+		churn(nursery);
+		for (word e = 0; e < 4; e++) {
+			check_list(wide->payload.obj.data[entries[e]], e < 2 ? 10 + e : 20 + e);
+		}
+	}
+	for (word i = 0, e = 0; i < FIELDS; i++) {
+		if (e < 4 && i == entries[e]) {
+			e++;
+			continue;
+		}
+		assert(wide->payload.obj.data[i] == (Obj_t *)(2 * i + 1),
+					 "Non-Obj entry was changed.");
+	}
+}
+
+// Collect every generation which has anything in it.
+static void collect_all(void) {
+	int k;
+	for (k = 0; generations[k].to_gen != NULL; k++) {
+		generations[k].n_max_blocks = 0;
+	}
+	generations[k].n_max_blocks = 0;
+	garbage_collect();
+	for (k = 0; generations[k].to_gen != NULL; k++) {
+		generations[k].n_max_blocks = NURSERY_BLOCKS << (2 * generations[k].num);
+	}
+}
+
+// The oldest generation is collected without moving its objects:
+// blocks left empty are freed, and live data around dead objects is
+// preserved.
+void TEST_SUCCEEDS test_mark_region(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *lists[3] = {NULL};
+	for (int i = 0; i < 3; i++) {
+		gc_add_root(&lists[i]);
+	}
+	// lists[0] and lists[1] are interleaved, lists[2] is on its own.
+	for (word i = 0; i < 2000; i++) {
+		push(nursery, &lists[0], i);
+		push(nursery, &lists[1], i);
+	}
+	for (word i = 0; i < 2000; i++) {
+		push(nursery, &lists[2], i);
+	}
+	garbage_collect();
+	assert(get_blockinfo(lists[2])->gen == &generations[1], "List was not promoted.");
+	Obj_t *first = lists[0];
+	word blocks = generations[1].n_blocks;
+	lists[2] = NULL;
+	collect_all();
+	assert(lists[0] == first, "The oldest generation was copied.");
+	assert(generations[1].n_blocks < blocks, "Empty blocks were not freed.");
+	check_list(lists[0], 2000);
+	check_list(lists[1], 2000);
+	lists[1] = NULL;
+	collect_all();
+	churn(nursery);
+	assert(lists[0] == first, "The oldest generation was copied.");
+	check_list(lists[0], 2000);
+	verify_free_block_list();
+}
+
+// Once sweeping leaves too much of the oldest generation free, its
+// next collection compacts it.
+void TEST_SUCCEEDS test_mark_region_compaction(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	set_compaction_threshold(25);
+	Nursery_t *nursery = get_nursery(0);
+	// Records are too big for a size class, so are bump-allocated.
+	// They are copied in the order of the array, so dropping every
+	// other one leaves every block about half full.
+	word n = 600, record_length = 160;
+	Obj_t *array = NULL;
+	gc_add_root(&array);
+	array = alloc_obj(nursery, OBJ_ARRAY_SIZE(n));
+	array->def = &ptr_array_def;
+	array->link = NULL;
+	array->payload.array.length = n;
+	for (word i = 0; i < n; i++) {
+		array->payload.array.data[i] = NULL;
+	}
+	for (word i = 0; i < n; i++) {
+		Obj_t *record = alloc_obj(nursery, OBJ_ARRAY_SIZE(record_length));
+		record->def = &record_def;
+		record->link = NULL;
+		record->payload.array.length = record_length;
+		record->payload.array.data[0] = (Obj_t *)(i + 1);
+		gc_write_field(array, i, record);
+	}
+	garbage_collect();
+	for (word i = 1; i < n; i += 2) {
+		gc_write_field(array, i, NULL);
+	}
+	Obj_t *first = array->payload.array.data[0];
+	word blocks = generations[1].n_blocks;
+	collect_all();
+	assert(array->payload.array.data[0] == first, "The oldest generation was copied.");
+	assert(generations[1].n_blocks == blocks, "Half-full blocks were freed.");
+	collect_all();
+	assert(array->payload.array.data[0] != first, "The oldest generation was not compacted.");
+	assert(generations[1].n_blocks < blocks, "Compaction didn't shrink the generation.");
+	first = array->payload.array.data[0];
+	collect_all();
+	assert(array->payload.array.data[0] == first, "The oldest generation was copied again.");
+	for (word i = 0; i < n; i += 2) {
+		Obj_t *record = array->payload.array.data[i];
+		assert(record->def == &record_def, "Record has a bad def.");
+		assert((word)record->payload.array.data[0] == i + 1, "Record has wrong value.");
+	}
+	set_compaction_threshold(COMPACTION_THRESHOLD);
+}
+
+// Small objects promoted into the oldest generation reuse the slots
+// of dead ones rather than growing it.
+void TEST_SUCCEEDS test_size_class_reuse(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	word n = 4000;
+	Obj_t *array = NULL;
+	gc_add_root(&array);
+	array = alloc_obj(nursery, OBJ_ARRAY_SIZE(n));
+	array->def = &ptr_array_def;
+	array->link = NULL;
+	array->payload.array.length = n;
+	for (word i = 0; i < n; i++) {
+		array->payload.array.data[i] = NULL;
+	}
+	for (word i = 0; i < n; i++) {
+		Obj_t *cell = NULL;
+		push(nursery, &cell, i + 1);
+		gc_write_field(array, i, cell);
+	}
+	garbage_collect();
+	for (word i = 1; i < n; i += 2) {
+		gc_write_field(array, i, NULL);
+	}
+	collect_all();
+	word blocks = generations[1].n_blocks;
+	for (word i = 1; i < n; i += 2) {
+		Obj_t *cell = NULL;
+		push(nursery, &cell, i + 1);
+		gc_write_field(array, i, cell);
+	}
+	garbage_collect();
+	assert(generations[1].n_blocks == blocks, "Free slots were not reused.");
+	churn(nursery);
+	collect_all();
+	for (word i = 0; i < n; i++) {
+		Obj_t *cell = array->payload.array.data[i];
+		assert(cell->def == &cons_def, "Cell has a bad def.");
+		assert((word)cell->payload.obj.data[0] == i + 1, "Cell has wrong value.");
+	}
+}
+
+// Large objects are promoted without being copied, keep what they
+// point to alive, and have their groups freed once they are dead.
+void TEST_SUCCEEDS test_large_objects(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *large = NULL, *list = NULL;
+	gc_add_root(&large);
+	gc_add_root(&list);
+	word length = 3 * BLOCK_SIZE / sizeof(Obj_t *);
+	large = alloc_obj(nursery, OBJ_ARRAY_SIZE(length));
+	large->def = &ptr_array_def;
+	large->link = NULL;
+	large->payload.array.length = length;
+	for (word i = 0; i < length; i++) {
+		large->payload.array.data[i] = NULL;
+	}
+	Blockinfo_t *bd = get_blockinfo(large);
+	assert(bd->flags & BF_LARGE, "Large object isn't flagged BF_LARGE.");
+	Obj_t *before = large;
+	for (int i = 0; i < 5; i++) {
+		for (word j = 0; j < 10; j++) {
+			push(nursery, &list, j);
+		}
+		gc_write_field(large, length - 1 - i, list);
+		list = NULL;
+		collect_all();
+		churn(nursery);
+	}
+	assert(large == before, "Large object was copied.");
+	assert(bd->gen->to_gen == NULL, "Large object wasn't promoted to the oldest generation.");
+	for (int i = 0; i < 5; i++) {
+		check_list(large->payload.array.data[length - 1 - i], 10);
+	}
+	large = NULL;
+	collect_all();
+	for (Generation_t *gen = generations; gen != NULL; gen = gen->to_gen) {
+		assert(gen->large == NULL && gen->n_large_blocks == 0,
+					 "Dead large object wasn't freed.");
+	}
+	verify_free_block_list();
+}
+
+// Pinned objects keep their addresses through promotion and marking,
+// keep what they point to alive, and have dead neighbours in their
+// block filled.  Their blocks are freed once nothing in them is live.
+void TEST_SUCCEEDS test_pinned_objects(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *buffer = NULL, *dropped = NULL, *holder = NULL, *list = NULL;
+	gc_add_root(&buffer);
+	gc_add_root(&dropped);
+	gc_add_root(&holder);
+	gc_add_root(&list);
+	word samples = 256;
+	buffer = alloc_pinned_obj(nursery, OBJ_ARRAY_SIZE(samples));
+	buffer->def = &record_def;
+	buffer->link = NULL;
+	buffer->payload.array.length = samples;
+	for (word i = 0; i < samples; i++) {
+		buffer->payload.array.data[i] = (Obj_t *)(i * i);
+	}
+	dropped = alloc_pinned_obj(nursery, OBJ_STD_SIZE(2));
+	dropped->def = &cons_def;
+	dropped->link = NULL;
+	dropped->payload.obj.data[1] = NULL;
+	holder = alloc_pinned_obj(nursery, OBJ_ARRAY_SIZE(4));
+	holder->def = &ptr_array_def;
+	holder->link = NULL;
+	holder->payload.array.length = 4;
+	for (word i = 0; i < 4; i++) {
+		holder->payload.array.data[i] = NULL;
+	}
+	Blockinfo_t *bd = get_blockinfo(buffer);
+	assert(bd->flags & BF_PINNED, "Pinned object isn't in a BF_PINNED block.");
+	assert(get_blockinfo(holder) == bd, "Small pinned objects don't share a block.");
+	Obj_t *before = buffer, *dropped_before = dropped, *holder_before = holder;
+	for (int i = 0; i < 4; i++) {
+		for (word j = 0; j < 10; j++) {
+			push(nursery, &list, j);
+		}
+		gc_write_field(holder, i, list);
+		list = NULL;
+		collect_all();
+		churn(nursery);
+	}
+	assert(buffer == before && holder == holder_before && dropped == dropped_before,
+				 "Pinned object was moved.");
+	assert(bd->gen->to_gen == NULL, "Pinned block wasn't promoted to the oldest generation.");
+	for (word i = 0; i < samples; i++) {
+		assert(buffer->payload.array.data[i] == (Obj_t *)(i * i), "Pinned buffer was corrupted.");
+	}
+	for (int i = 0; i < 4; i++) {
+		check_list(holder->payload.array.data[i], 10);
+	}
+	dropped = NULL;
+	collect_all();
+	assert(dropped_before->def != &cons_def, "Dead pinned object wasn't filled.");
+	check_list(holder->payload.array.data[0], 10);
+	Obj_t *large = alloc_pinned_obj(nursery, OBJ_ARRAY_SIZE(BLOCK_SIZE));
+	assert(get_blockinfo(large)->flags & BF_LARGE, "Large pinned object isn't a large object.");
+	buffer = holder = NULL;
+	collect_all();
+	for (Generation_t *gen = generations; gen != NULL; gen = gen->to_gen) {
+		assert(gen->large == NULL && gen->n_large_blocks == 0,
+					 "Dead pinned block wasn't freed.");
+	}
+	verify_free_block_list();
+}
+
+// A claimed nursery is used by thread_alloc_obj, and consecutive small
+// allocations are adjacent.
+void TEST_SUCCEEDS test_thread_alloc_obj(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = claim_nursery();
+	assert(nursery == thread_nursery, "claim_nursery didn't set thread_nursery.");
+	Obj_t *a = thread_alloc_obj(OBJ_STD_SIZE(1));
+	Obj_t *b = thread_alloc_obj(OBJ_STD_SIZE(1));
+	assert((word)b - (word)a == OBJ_STD_SIZE(1), "Allocations are not adjacent.");
+	assert(get_blockinfo(a) == nursery->alloc_block, "Not allocated in the nursery.");
+}
+
+// Fill a record array with values derived from seed.
+static void fill_record(Obj_t *record, word length, word seed) {
+	record->def = &record_def;
+	record->link = NULL;
+	record->payload.array.length = length;
+	for (word i = 0; i < length; i++) {
+		record->payload.array.data[i] = (Obj_t *)(seed + i);
+	}
+}
+
+static void check_record(Obj_t *record, word length, word seed) {
+	assert(record->def == &record_def && record->payload.array.length == length,
+				 "Record has a bad header.");
+	for (word i = 0; i < length; i++) {
+		assert(record->payload.array.data[i] == (Obj_t *)(seed + i), "Record was corrupted.");
+	}
+}
+
+#define MUTATORS 4
+
+// A mutator for test_concurrent_mutators: it keeps a list, a large
+// object and a pinned object alive while making enough garbage to
+// fill its nursery again and again.
+static void *mutate(void *arg) {
+	word id = (word)arg;
+	Nursery_t *nursery = claim_nursery();
+	Obj_t *list = NULL, *large = NULL, *pinned = NULL;
+	gc_add_root(&list);
+	gc_add_root(&large);
+	gc_add_root(&pinned);
+	word large_length = 2 * BLOCK_SIZE / sizeof(Obj_t *), pinned_length = 16;
+	word collections = 0;
+	for (int round = 0; round < 16; round++) {
+		word seed = id << 32 | (word)round << 16;
+		list = NULL;
+		for (word i = 0; i < 1000; i++) {
+			push(nursery, &list, i);
+		}
+		large = alloc_obj(nursery, OBJ_ARRAY_SIZE(large_length));
+		fill_record(large, large_length, seed);
+		pinned = alloc_pinned_obj(nursery, OBJ_ARRAY_SIZE(pinned_length));
+		fill_record(pinned, pinned_length, seed);
+		Obj_t *pinned_before = pinned;
+		churn(nursery);
+		if (id == 0 && round % 4 == 0) {
+			garbage_collect();
+		}
+		if (id == 1) {
+			GcStats_t stats;
+			gc_get_stats(&stats);
+			assert(stats.collections >= collections, "Statistics went backwards.");
+			collections = stats.collections;
+		}
+		check_list(list, 1000);
+		check_record(large, large_length, seed);
+		check_record(pinned, pinned_length, seed);
+		assert(pinned == pinned_before, "Pinned object was moved.");
+	}
+	gc_remove_root(&list);
+	gc_remove_root(&large);
+	gc_remove_root(&pinned);
+	release_nursery();
+	return NULL;
+}
+
+// Several threads allocate at once, including large and pinned
+// objects, and each one's collections stop the others, as does taking
+// statistics.
+void TEST_SUCCEEDS test_concurrent_mutators(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(MUTATORS);
+	init_gc_threads(2);
+	pthread_t threads[MUTATORS];
+	for (word i = 0; i < MUTATORS; i++) {
+		guard(pthread_create(&threads[i], NULL, mutate, (void *)i) == 0,
+					"Couldn't start a mutator");
+	}
+	for (int i = 0; i < MUTATORS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	collect_all();
+	for (Generation_t *gen = generations; gen != NULL; gen = gen->to_gen) {
+		assert(gen->large == NULL && gen->n_large_blocks == 0,
+					 "Dead large objects weren't freed.");
+	}
+	verify_free_block_list();
+}
+
+// A nursery is contiguous, and binding it to the local NUMA node (or
+// failing to, off Linux) leaves it usable.
+void TEST_SUCCEEDS test_numa_nursery(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	set_nursery_numa_binding(true);
+	Nursery_t *nursery = claim_nursery();
+	word n = 0;
+	for (Blockinfo_t *bd = nursery->blocks; bd != NULL; bd = bd->link, n++) {
+		assert(bd->start == nursery->blocks->start + n * BLOCK_SIZE,
+					 "Nursery is not contiguous.");
+	}
+	assert(n == NURSERY_BLOCKS, "Nursery has the wrong number of blocks.");
+	churn(nursery);
+}
+
+// Only as many nurseries as were initialized may be claimed.
+void TEST_FAILS test_claim_too_many_nurseries(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	claim_nursery();
+	claim_nursery();
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	return (*(double *)a > *(double *)b) - (*(double *)a < *(double *)b);
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// In incremental mode gc_slice pauses for under a millisecond (at the
+// 99th percentile) while the oldest generation (about 4MB live) is
+// repeatedly marked and swept, and entries moved around while it is
+// being marked survive.
+void TEST_SUCCEEDS test_incremental_slices(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	word n = 1 << 13, length = 16;
+	Obj_t *table = NULL;
+	gc_add_root(&table);
+	table = alloc_obj(nursery, OBJ_ARRAY_SIZE(n));
+	table->def = &ptr_array_def;
+	table->link = NULL;
+	table->payload.array.length = n;
+	for (word i = 0; i < n; i++) {
+		table->payload.array.data[i] = NULL;
+	}
+	Obj_t *list = NULL;
+	gc_add_root(&list);
+	for (word i = 0; i < n; i++) {
+		push(nursery, &list, 1);
+		for (word j = 1; j < length; j++) {
+			push(nursery, &list, 0);
+		}
+		gc_write_field(table, i, list);
+		list = NULL;
+	}
+	garbage_collect();
+	set_gc_slice_words(1 << 12);
+	word live_blocks = generations[1].n_blocks;
+	static double pauses[4000];
+	int rounds = sizeof(pauses) / sizeof(pauses[0]);
+	word seed = 1;
+	for (int round = 0; round < rounds; round++) {
+		for (int k = 0; k < 16; k++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			word i = (seed >> 33) % n, j = (seed >> 17) % n;
+			// Swap two entries, sometimes replace one with a fresh list,
+			// and make garbage.
+			Obj_t *a = table->payload.array.data[i];
+			gc_write_field(table, i, table->payload.array.data[j]);
+			gc_write_field(table, j, a);
+			if (k % 2 == 0) {
+				push(nursery, &list, 1);
+				for (word j = 1; j < length; j++) {
+					push(nursery, &list, 0);
+				}
+				gc_write_field(table, (seed >> 40) % n, list);
+			}
+			list = NULL;
+			for (int g = 0; g < 16; g++) {
+				push(nursery, &list, 0);
+			}
+			list = NULL;
+		}
+		double start = now_ns();
+		gc_slice();
+		pauses[round] = now_ns() - start;
+	}
+	set_gc_slice_words(0);
+	qsort(pauses, rounds, sizeof(double), compare_doubles);
+	// Without collection the promoted lists would add this many blocks.
+	word promoted_blocks = rounds * 8 * length * OBJ_STD_SIZE(2) / BLOCK_SIZE;
+	printf("pauses p50 %.0f ns, p99 %.0f ns, max %.0f ns; %lu blocks (%lu live, %lu promoted)\n",
+				 pauses[rounds / 2], pauses[rounds * 99 / 100], pauses[rounds - 1],
+				 (unsigned long)generations[1].n_blocks, (unsigned long)live_blocks,
+				 (unsigned long)promoted_blocks);
+	// The maximum is left to the scheduler.
+	assert(pauses[rounds * 99 / 100] < 1e6, "Slices paused for more than a millisecond.");
+	// It is allowed to grow to twice its live data between collections.
+	assert(promoted_blocks > 3 * live_blocks && generations[1].n_blocks < 3 * live_blocks,
+				 "The oldest generation wasn't collected.");
+	for (word i = 0; i < n; i++) {
+		list = table->payload.array.data[i];
+		assert(list->def == &cons_def, "Cell has a bad def.");
+		assert((word)list->payload.obj.data[0] == 0, "Cell has wrong value.");
+		while (list->payload.obj.data[1] != NULL) {
+			list = list->payload.obj.data[1];
+			assert(list->def == &cons_def, "Cell has a bad def.");
+		}
+		assert((word)list->payload.obj.data[0] == 1, "List lost its last cell.");
+	}
+}
+
+#define REALTIME_CYCLES 4000
+#define REALTIME_LISTS 64
+#define REALTIME_LENGTH 200
+// Every this many cycles, the realtime thread also makes garbage
+// until its nursery is full
+#define REALTIME_BURST_CYCLES 16
+
+// What the realtime thread of test_realtime_nursery saw
+typedef struct RealtimeRun_s {
+	Obj_t *lists; // the lists it keeps alive, rooted
+	volatile bool done;
+	int cycles; // cycles in which it entered the heap
+	int failures; // cycles in which an allocation returned NULL
+	int handovers; // times it handed its full blocks over
+	double max_alloc_ns;
+} RealtimeRun_t;
+
+// Allocate a cons cell in a realtime nursery, timing it.
+static Obj_t *realtime_cons(RealtimeRun_t *run, Nursery_t *nursery, word value, Obj_t *next) {
+	Blockinfo_t *blocks = nursery->blocks;
+	double start = now_ns();
+	Obj_t *cell = alloc_obj(nursery, OBJ_STD_SIZE(2));
+	double ns = now_ns() - start;
+	run->max_alloc_ns = ns > run->max_alloc_ns ? ns : run->max_alloc_ns;
+	if (cell != NULL) {
+		run->handovers += nursery->blocks != blocks;
+		cell->def = &cons_def;
+		cell->link = NULL;
+		cell->payload.obj.data[0] = (Obj_t *)value;
+		cell->payload.obj.data[1] = next;
+	}
+	return cell;
+}
+
+// Each cycle, replace one of the kept lists with a new one.  A cycle
+// whose allocation fails drops its list.
+static void *realtime_mutator(void *arg) {
+	RealtimeRun_t *run = arg;
+	// As a realtime thread would be, where that is allowed
+	struct sched_param param = {.sched_priority = sched_get_priority_min(SCHED_FIFO)};
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	Nursery_t *nursery = claim_nursery();
+	set_nursery_realtime(nursery, true);
+	run->lists = alloc_obj(nursery, OBJ_ARRAY_SIZE(REALTIME_LISTS));
+	run->lists->def = &ptr_array_def;
+	run->lists->link = NULL;
+	run->lists->payload.array.length = REALTIME_LISTS;
+	for (word i = 0; i < REALTIME_LISTS; i++) {
+		run->lists->payload.array.data[i] = NULL;
+	}
+	gc_leave_heap();
+	for (int cycle = 0; cycle < REALTIME_CYCLES; cycle++) {
+		struct timespec period = {0, 20000};
+		nanosleep(&period, NULL);
+		if (!gc_try_enter_heap()) {
+			continue;
+		}
+		run->cycles++;
+		Obj_t *list = NULL;
+		for (word i = 0; i < REALTIME_LENGTH && (i == 0 || list != NULL); i++) {
+			list = realtime_cons(run, nursery, i, list);
+		}
+		if (cycle % REALTIME_BURST_CYCLES == 0) {
+			int handovers = run->handovers;
+			while (list != NULL && run->handovers == handovers) {
+				if (realtime_cons(run, nursery, 0, NULL) == NULL) {
+					list = NULL;
+				}
+			}
+		}
+		if (list != NULL) {
+			gc_write_field(run->lists, cycle % REALTIME_LISTS, list);
+		} else {
+			run->failures++;
+		}
+		gc_leave_heap();
+	}
+	run->done = true;
+	return NULL;
+}
+
+// A realtime thread fills its nursery many times over while another
+// thread collects with gc_slice, which copies the lists it keeps.  Its
+// allocations never wait for a collection, and its lists survive.
+void TEST_SUCCEEDS test_realtime_nursery(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	set_gc_slice_words(1 << 12);
+	static RealtimeRun_t run;
+	run.lists = NULL;
+	gc_add_root(&run.lists);
+	pthread_t thread;
+	guard(pthread_create(&thread, NULL, realtime_mutator, &run) == 0,
+				"Couldn't start the realtime thread");
+	double max_slice_ns = 0;
+	while (!run.done) {
+		double start = now_ns();
+		gc_slice();
+		double ns = now_ns() - start;
+		max_slice_ns = ns > max_slice_ns ? ns : max_slice_ns;
+		struct timespec period = {0, 200000};
+		nanosleep(&period, NULL);
+	}
+	pthread_join(thread, NULL);
+	printf("%d cycles, %d handovers, %d failed; max allocation %.0f ns, max slice %.0f ns\n",
+				 run.cycles, run.handovers, run.failures, run.max_alloc_ns, max_slice_ns);
+	assert(run.handovers >= run.cycles / REALTIME_BURST_CYCLES / 2,
+				 "The nursery wasn't handed over often.");
+	assert(run.failures < run.cycles / 20, "Too many cycles failed to allocate.");
+	// An allocation is a bump or a swap of block lists; only the
+	// scheduler could make one take this long.
+	assert(run.max_alloc_ns < 1e6, "An allocation paused for more than a millisecond.");
+	word intact = 0;
+	for (word i = 0; i < REALTIME_LISTS; i++) {
+		Obj_t *list = run.lists->payload.array.data[i];
+		if (list != NULL) {
+			check_list(list, REALTIME_LENGTH);
+			intact++;
+		}
+	}
+	assert(intact > REALTIME_LISTS / 2, "The realtime thread lost its lists.");
+	set_gc_slice_words(0);
+}
+
+void TEST_SUCCEEDS test_concurrent_marking(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	word n = 1 << 13, length = 16;
+	Obj_t *table = NULL;
+	gc_add_root(&table);
+	table = alloc_obj(nursery, OBJ_ARRAY_SIZE(n));
+	table->def = &ptr_array_def;
+	table->link = NULL;
+	table->payload.array.length = n;
+	for (word i = 0; i < n; i++) {
+		table->payload.array.data[i] = NULL;
+	}
+	Obj_t *list = NULL;
+	gc_add_root(&list);
+	for (word i = 0; i < n; i++) {
+		push(nursery, &list, 1);
+		for (word j = 1; j < length; j++) {
+			push(nursery, &list, 0);
+		}
+		gc_write_field(table, i, list);
+		list = NULL;
+	}
+	garbage_collect();
+	set_gc_background(true);
+	word live_blocks = generations[1].n_blocks;
+	static double pauses[8000];
+	int rounds = sizeof(pauses) / sizeof(pauses[0]);
+	word seed = 1;
+	for (int round = 0; round < rounds; round++) {
+		for (int k = 0; k < 16; k++) {
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			word i = (seed >> 33) % n, j = (seed >> 17) % n;
+			// Swap two entries, sometimes replace one with a fresh list,
+			// and make garbage, all while the oldest generation is being
+			// marked or swept.
+			Obj_t *a = table->payload.array.data[i];
+			gc_write_field(table, i, table->payload.array.data[j]);
+			gc_write_field(table, j, a);
+			if (k % 2 == 0) {
+				push(nursery, &list, 1);
+				for (word j = 1; j < length; j++) {
+					push(nursery, &list, 0);
+				}
+				gc_write_field(table, (seed >> 40) % n, list);
+			}
+			list = NULL;
+			for (int g = 0; g < 16; g++) {
+				push(nursery, &list, 0);
+			}
+			list = NULL;
+		}
+		double start = now_ns();
+		gc_slice();
+		pauses[round] = now_ns() - start;
+		// Leave the background thread time to run, as a mutator waiting
+		// for its next frame would, even on a single core.
+		if (round % 8 == 0) {
+			struct timespec frame = {0, 100000};
+			nanosleep(&frame, NULL);
+		}
+	}
+	set_gc_background(false);
+	qsort(pauses, rounds, sizeof(double), compare_doubles);
+	word promoted_blocks = rounds * 8 * length * OBJ_STD_SIZE(2) / BLOCK_SIZE;
+	printf("pauses p50 %.0f ns, p99 %.0f ns, max %.0f ns; %lu blocks (%lu live, %lu promoted)\n",
+				 pauses[rounds / 2], pauses[rounds * 99 / 100], pauses[rounds - 1],
+				 (unsigned long)generations[1].n_blocks, (unsigned long)live_blocks,
+				 (unsigned long)promoted_blocks);
+	// The pauses are nursery collections and remarks; marking the
+	// whole table takes several milliseconds.
+	assert(pauses[rounds * 99 / 100] < 1e6, "Collections paused for more than a millisecond.");
+	// How far it grows depends on how much time the background thread
+	// gets, but without collection it would have grown by eight times.
+	assert(promoted_blocks > 7 * live_blocks && generations[1].n_blocks < 4 * live_blocks,
+				 "The oldest generation wasn't collected.");
+	for (word i = 0; i < n; i++) {
+		list = table->payload.array.data[i];
+		assert(list->def == &cons_def, "Cell has a bad def.");
+		assert((word)list->payload.obj.data[0] == 0, "Cell has wrong value.");
+		while (list->payload.obj.data[1] != NULL) {
+			list = list->payload.obj.data[1];
+			assert(list->def == &cons_def, "Cell has a bad def.");
+		}
+		assert((word)list->payload.obj.data[0] == 1, "List lost its last cell.");
+	}
+}
+
+// Statistics follow the live data through promotion and a marking
+// collection of the oldest generation.
+void TEST_SUCCEEDS test_gc_stats(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *lists[2] = {NULL};
+	gc_add_root(&lists[0]);
+	gc_add_root(&lists[1]);
+	word n = 1000;
+	for (word i = 0; i < n; i++) {
+		push(nursery, &lists[0], i);
+		push(nursery, &lists[1], i);
+	}
+	GcStats_t stats;
+	gc_get_stats(&stats);
+	assert(stats.collections == 0, "Counted a collection too many.");
+	assert(stats.allocated_bytes == 2 * n * OBJ_STD_SIZE(2), "Allocation not counted.");
+	garbage_collect();
+	gc_get_stats(&stats);
+	assert(stats.num_generations == 2, "Wrong number of generations.");
+	assert(stats.collections == 1 && stats.generations[0].collections == 1
+				 && stats.generations[1].collections == 0, "Collections not counted.");
+	assert(stats.generations[1].live_bytes == 2 * n * OBJ_STD_SIZE(2),
+				 "Promoted bytes not counted.");
+	assert(stats.generations[1].blocks == generations[1].n_blocks, "Blocks not reported.");
+	assert(stats.last_pause_ns > 0 && stats.max_pause_ns >= stats.last_pause_ns
+				 && stats.total_pause_ns >= stats.last_pause_ns, "Pause not timed.");
+	assert(stats.allocation_rate > 0, "Allocation rate not measured.");
+	assert(stats.megablocks.mapped_megablocks > 0, "Megablocks not reported.");
+	lists[1] = NULL;
+	collect_all();
+	gc_get_stats(&stats);
+	assert(stats.collections == 2 && stats.generations[1].collections == 1,
+				 "Collection of the oldest generation not counted.");
+	assert(stats.generations[1].live_bytes == n * OBJ_STD_SIZE(2),
+				 "Marking didn't count the live bytes.");
+	check_list(lists[0], n);
+}
+
+// A quarter of what the nursery allocated survives, and then nothing
+// in the oldest generation does.
+void TEST_SUCCEEDS test_survival_rate(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *list = NULL, *garbage = NULL;
+	gc_add_root(&list);
+	for (word i = 0; i < 1000; i++) {
+		push(nursery, &list, i);
+		for (int g = 0; g < 3; g++) {
+			push(nursery, &garbage, i);
+		}
+	}
+	garbage_collect();
+	GcStats_t stats;
+	gc_get_stats(&stats);
+	assert(stats.generations[0].survival_rate == 0.25, "Wrong nursery survival rate.");
+	list = NULL;
+	collect_all();
+	gc_get_stats(&stats);
+	assert(stats.generations[1].survival_rate == 0, "Wrong oldest generation survival rate.");
+}
+
+// Allocate cells into a nursery until there have been the given
+// number of collections, keeping the last n_ring alive through ring
+// (if not NULL).
+static void churn_collections(Nursery_t *nursery, Obj_t **ring, word n_ring, word collections) {
+	GcStats_t stats;
+	gc_get_stats(&stats);
+	word until = stats.collections + collections;
+	Obj_t *cell = NULL;
+	gc_add_root(&cell);
+	for (word i = 0; stats.collections < until; i++) {
+		push(nursery, &cell, i);
+		if (ring != NULL) {
+			gc_write_field(*ring, i % n_ring, cell);
+		}
+		cell = NULL;
+		if (i % 1024 == 0) {
+			gc_get_stats(&stats);
+		}
+	}
+	gc_remove_root(&cell);
+}
+
+// The nursery grows while collections take more than the target share
+// of the time, within the heap bounds, and shrinks once they take much
+// less.  The thresholds of the younger generations stay in the bounds
+// too.
+void TEST_SUCCEEDS test_adaptive_sizing(void) {
+	int generation_config[] = {1, 1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	Nursery_t *nursery = get_nursery(0);
+	word max_heap = 2048;
+	set_gc_target_overhead(1);
+	set_gc_heap_bounds(0, max_heap);
+	// Every collection copies the last 4096 cells.
+	word n_ring = 4096;
+	Obj_t *ring = NULL;
+	gc_add_root(&ring);
+	ring = alloc_obj(nursery, OBJ_ARRAY_SIZE(n_ring));
+	ring->def = &ptr_array_def;
+	ring->link = NULL;
+	ring->payload.array.length = n_ring;
+	for (word i = 0; i < n_ring; i++) {
+		ring->payload.array.data[i] = NULL;
+	}
+	churn_collections(nursery, &ring, n_ring, 40);
+	GcStats_t stats;
+	gc_get_stats(&stats);
+	printf("overhead %.3f, nursery %lu blocks, step max %lu blocks, oldest max %lu blocks\n",
+				 stats.overhead, (unsigned long)stats.nursery_blocks,
+				 (unsigned long)stats.generations[1].max_blocks,
+				 (unsigned long)stats.generations[2].max_blocks);
+	assert(stats.nursery_blocks == max_heap / 4, "Nursery didn't grow to its bound.");
+	word n = 0;
+	for (Blockinfo_t *bd = nursery->blocks; bd != NULL; bd = bd->link) {
+		n++;
+	}
+	assert(n == stats.nursery_blocks && nursery->n_blocks == n, "Nursery wasn't resized.");
+	assert(stats.generations[1].collections > 0 && stats.generations[1].max_blocks <= max_heap / 4,
+				 "Step threshold outside the heap bounds.");
+	assert(stats.generations[2].max_blocks <= max_heap - max_heap / 4 - stats.generations[1].max_blocks,
+				 "Oldest generation threshold outside the heap bounds.");
+	ring = NULL;
+	set_gc_target_overhead(99);
+	churn_collections(nursery, NULL, 0, 40);
+	gc_get_stats(&stats);
+	printf("overhead %.3f, nursery %lu blocks\n", stats.overhead, (unsigned long)stats.nursery_blocks);
+	assert(stats.nursery_blocks == MIN_NURSERY_BLOCKS, "Nursery didn't shrink.");
+}
+
+// The trace keeps the most recent events, in the Chrome trace format.
+void TEST_SUCCEEDS test_gc_trace(void) {
+	int generation_config[] = {1, 1, 0};
+	init_free_lists();
+	init_generations(generation_config);
+	init_nurseries(1);
+	set_gc_trace_events(8);
+	for (int i = 0; i < 20; i++) {
+		garbage_collect();
+	}
+	FILE *f = tmpfile();
+	gc_write_trace(f);
+	word size = ftell(f);
+	char *trace = calloc(size + 1, 1);
+	rewind(f);
+	assert(fread(trace, 1, size, f) == size, "Couldn't read the trace back.");
+	fclose(f);
+	printf("%s", trace);
+	assert(trace[0] == '{' && strstr(trace, "\"traceEvents\"") != NULL, "Not a Chrome trace.");
+	int events = 0;
+	for (char *p = trace; (p = strstr(p, "\"ph\": \"X\"")) != NULL; p++) {
+		events++;
+	}
+	assert(events == 8, "Trace doesn't hold the most recent events.");
+	assert(strstr(trace, "\"name\": \"gc\"") != NULL, "Collections not traced.");
+	free(trace);
+}
+
+// Build a complete binary tree of the given depth, where each node
+// holds its depth.  The children are rooted while the node is
+// allocated.
+static Obj_t *build_tree(Nursery_t *nursery, word depth) {
+	Obj_t *left = NULL, *right = NULL;
+	if (depth > 0) {
+		gc_add_root(&left);
+		gc_add_root(&right);
+		left = build_tree(nursery, depth - 1);
+		right = build_tree(nursery, depth - 1);
+	}
+	Obj_t *node = alloc_obj(nursery, OBJ_STD_SIZE(3));
+	node->def = &node_def;
+	node->link = NULL;
+	node->payload.obj.data[0] = (Obj_t *)depth;
+	node->payload.obj.data[1] = left;
+	node->payload.obj.data[2] = right;
+	if (depth > 0) {
+		gc_remove_root(&left);
+		gc_remove_root(&right);
+	}
+	return node;
+}
+
+static word check_tree(Obj_t *tree, word depth) {
+	assert(tree->def == &node_def, "Node has a bad def.");
+	assert((word)tree->payload.obj.data[0] == depth, "Node has wrong depth.");
+	if (depth == 0) {
+		return 1;
+	}
+	return 1 + check_tree(tree->payload.obj.data[1], depth - 1)
+		+ check_tree(tree->payload.obj.data[2], depth - 1);
+}
+
+// Several GC threads together preserve a structure spanning many
+// blocks, including objects reachable from more than one root.
+void TEST_SUCCEEDS test_parallel_gc(void) {
+	init_free_lists();
+	init_generations(default_generation_config);
+	init_nurseries(1);
+	init_gc_threads(4);
+	Nursery_t *nursery = get_nursery(0);
+	Obj_t *trees[8] = {NULL};
+	Obj_t *shared[8] = {NULL};
+	for (int i = 0; i < 8; i++) {
+		gc_add_root(&trees[i]);
+		gc_add_root(&shared[i]);
+	}
+	for (int i = 0; i < 8; i++) {
+		trees[i] = build_tree(nursery, 10);
+	}
+	for (int i = 0; i < 8; i++) {
+		shared[i] = trees[(i + 1) % 8]->payload.obj.data[1];
+	}
+	for (int i = 0; i < 4; i++) {
+		churn(nursery);
+		garbage_collect();
+		for (int j = 0; j < 8; j++) {
+			assert(check_tree(trees[j], 10) == 2047, "Tree lost nodes.");
+			assert(shared[j] == trees[(j + 1) % 8]->payload.obj.data[1],
+						 "Sharing was not preserved.");
+		}
+	}
+	verify_free_block_list();
+	verify_free_megablock_list();
+}